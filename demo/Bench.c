@@ -2,24 +2,57 @@
 #include "chipmunk/chipmunk_unsafe.h"
 #include "ChipmunkDemo.h"
 
-#define ENABLE_HASTY 0
-#if ENABLE_HASTY
-	#include "chipmunk/cpHastySpace.h"
-	
-	static cpSpace *MakeHastySpace(){
-		cpSpace *space = cpHastySpaceNew();
-		cpHastySpaceSetThreads(space, 0);
-		return space;
+#include "chipmunk/cpHastySpace.h"
+
+// Space settings for the benchmarks.
+// The demo app uses the defaults, chipmunk_bench sets them from the command line.
+bool BenchUseHasty = false;
+// Number of threads for cpHastySpace, 0 uses one per CPU.
+unsigned long BenchThreads = 0;
+// Use the SIMD solver for cpHastySpace when the CPU has one.
+bool BenchVectorized = true;
+// Use the packed contact solver for cpHastySpace.
+bool BenchPackedSolver = false;
+// Use a spatial hash with these settings instead of the default bounding box tree if the cell size is greater than 0.
+cpFloat BenchSpatialHashDim = 0.0f;
+int BenchSpatialHashCount = 0;
+
+static cpSpace *
+BenchSpaceNew(void)
+{
+	cpSpace *space;
+	if(BenchUseHasty){
+		space = cpHastySpaceNew();
+		cpHastySpaceSetThreads(space, BenchThreads);
+		cpHastySpaceSetVectorized(space, BenchVectorized);
+		cpHastySpaceSetPackedSolver(space, BenchPackedSolver);
+	} else {
+		space = cpSpaceNew();
 	}
 	
-	#define BENCH_SPACE_NEW MakeHastySpace
-	#define BENCH_SPACE_FREE cpHastySpaceFree
-	#define BENCH_SPACE_STEP cpHastySpaceStep
-#else
-	#define BENCH_SPACE_NEW cpSpaceNew
-	#define BENCH_SPACE_FREE cpSpaceFree
-	#define BENCH_SPACE_STEP cpSpaceStep
-#endif
+	if(BenchSpatialHashDim > 0.0f) cpSpaceUseSpatialHash(space, BenchSpatialHashDim, BenchSpatialHashCount);
+	return space;
+}
+
+static void
+BenchSpaceFree(cpSpace *space)
+{
+	if(BenchUseHasty){
+		cpHastySpaceFree(space);
+	} else {
+		cpSpaceFree(space);
+	}
+}
+
+static void
+BenchSpaceStep(cpSpace *space, cpFloat dt)
+{
+	if(BenchUseHasty){
+		cpHastySpaceStep(space, dt);
+	} else {
+		cpSpaceStep(space, dt);
+	}
+}
 
 const cpFloat bevel = 1.0;
 
@@ -80,7 +113,7 @@ static void add_hexagon(cpSpace *space, int index, cpFloat radius){
 
 static cpSpace *
 SetupSpace_simpleTerrain(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -215,7 +248,7 @@ static cpVect complex_terrain_verts[] = {
 static int complex_terrain_count = sizeof(complex_terrain_verts)/sizeof(cpVect);
 
 static cpSpace *init_ComplexTerrainCircles_1000(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -240,7 +273,7 @@ static cpSpace *init_ComplexTerrainCircles_1000(void){
 }
 
 static cpSpace *init_ComplexTerrainHexagons_1000(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -320,7 +353,7 @@ static cpVect bouncy_terrain_verts[] = {
 static int bouncy_terrain_count = sizeof(bouncy_terrain_verts)/sizeof(cpVect);
 
 static cpSpace *init_BouncyTerrainCircles_500(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpVect offset = cpv(-320, -240);
@@ -345,7 +378,7 @@ static cpSpace *init_BouncyTerrainCircles_500(void){
 }
 
 static cpSpace *init_BouncyTerrainHexagons_500(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpVect offset = cpv(-320, -240);
@@ -386,7 +419,7 @@ static bool NoCollide_begin(cpArbiter *arb, cpSpace *space, void *data){
 
 
 static cpSpace *init_NoCollide(void){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpCollisionHandler *handler = cpSpaceAddCollisionHandler(space, 2, 2);
@@ -440,12 +473,12 @@ static cpSpace *init_NoCollide(void){
 
 // Build benchmark list
 static void update(cpSpace *space, double dt){
-	BENCH_SPACE_STEP(space, dt);
+	BenchSpaceStep(space, dt);
 }
 
 static void destroy(cpSpace *space){
 	ChipmunkDemoFreeSpaceChildren(space);
-	BENCH_SPACE_FREE(space);
+	BenchSpaceFree(space);
 }
 
 // Make a second demo declaration for this demo to use in the regular demo set.
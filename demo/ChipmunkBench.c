@@ -0,0 +1,343 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Headless runner for the benchmark scenes in Bench.c.
+// Runs each scene for a fixed number of steps and prints the timings as JSON, so it can run on machines without a GPU.
+// With --check vectorized|packed it runs each scene with the scalar and SIMD versions of that cpHastySpace solver instead,
+// and fails if the bodies don't end up bit for bit the same.
+//
+// Usage: chipmunk_bench [--space cpSpace|cpHastySpace] [--threads n] [--index bbtree|hash]
+//                       [--hash-dim size] [--hash-count count] [--steps n] [--seed n] [--filter substring] [--output file]
+//                       [--check vectorized|packed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+#include "ChipmunkDemo.h"
+
+#if defined(_WIN32)
+	#include <windows.h>
+	
+	static double
+	BenchTime(void)
+	{
+		LARGE_INTEGER count, frequency;
+		QueryPerformanceCounter(&count);
+		QueryPerformanceFrequency(&frequency);
+		return (double)count.QuadPart/(double)frequency.QuadPart;
+	}
+#else
+	#include <time.h>
+	
+	static double
+	BenchTime(void)
+	{
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+	}
+#endif
+
+extern ChipmunkDemo bench_list[];
+extern int bench_count;
+
+extern bool BenchUseHasty;
+extern unsigned long BenchThreads;
+extern bool BenchVectorized;
+extern bool BenchPackedSolver;
+extern cpFloat BenchSpatialHashDim;
+extern int BenchSpatialHashCount;
+
+// Bench.c uses these from ChipmunkDemo.c, which needs a window to run.
+void ChipmunkDemoDefaultDrawImpl(cpSpace *space){}
+
+static void FreeShape(cpShape *shape, cpArray *shapes){cpArrayPush(shapes, shape);}
+static void FreeConstraint(cpConstraint *constraint, cpArray *constraints){cpArrayPush(constraints, constraint);}
+static void FreeBody(cpBody *body, cpArray *bodies){cpArrayPush(bodies, body);}
+
+void
+ChipmunkDemoFreeSpaceChildren(cpSpace *space)
+{
+	// The space isn't locked here, so everything can be removed right away.
+	cpArray *shapes = cpArrayNew(0), *constraints = cpArrayNew(0), *bodies = cpArrayNew(0);
+	cpSpaceEachShape(space, (cpSpaceShapeIteratorFunc)FreeShape, shapes);
+	cpSpaceEachConstraint(space, (cpSpaceConstraintIteratorFunc)FreeConstraint, constraints);
+	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)FreeBody, bodies);
+	
+	// Must remove these BEFORE freeing the body or you will access dangling pointers.
+	for(int i=0; i<shapes->num; i++){
+		cpSpaceRemoveShape(space, (cpShape *)shapes->arr[i]);
+		cpShapeFree((cpShape *)shapes->arr[i]);
+	}
+	
+	for(int i=0; i<constraints->num; i++){
+		cpSpaceRemoveConstraint(space, (cpConstraint *)constraints->arr[i]);
+		cpConstraintFree((cpConstraint *)constraints->arr[i]);
+	}
+	
+	for(int i=0; i<bodies->num; i++){
+		cpSpaceRemoveBody(space, (cpBody *)bodies->arr[i]);
+		cpBodyFree((cpBody *)bodies->arr[i]);
+	}
+	
+	cpArrayFree(shapes);
+	cpArrayFree(constraints);
+	cpArrayFree(bodies);
+}
+
+static int
+CompareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+CountContacts(cpSpace *space)
+{
+	int count = 0;
+	cpArray *arbiters = space->arbiters;
+	for(int i=0; i<arbiters->num; i++) count += ((cpArbiter *)arbiters->arr[i])->count;
+	
+	return count;
+}
+
+static void GatherBody(cpBody *body, cpArray *bodies){cpArrayPush(bodies, body);}
+
+static bool
+SameBodies(cpSpace *space1, cpSpace *space2)
+{
+	cpArray *bodies1 = cpArrayNew(0), *bodies2 = cpArrayNew(0);
+	cpSpaceEachBody(space1, (cpSpaceBodyIteratorFunc)GatherBody, bodies1);
+	cpSpaceEachBody(space2, (cpSpaceBodyIteratorFunc)GatherBody, bodies2);
+	
+	bool same = (bodies1->num == bodies2->num);
+	for(int i=0; same && i<bodies1->num; i++){
+		cpBody *a = (cpBody *)bodies1->arr[i], *b = (cpBody *)bodies2->arr[i];
+		
+		// Compare the bits so that signed zeros and NaNs count too.
+		same = (
+			memcmp(&a->p, &b->p, sizeof(cpVect)) == 0 && memcmp(&a->v, &b->v, sizeof(cpVect)) == 0 &&
+			memcmp(&a->a, &b->a, sizeof(cpFloat)) == 0 && memcmp(&a->w, &b->w, sizeof(cpFloat)) == 0
+		);
+	}
+	
+	cpArrayFree(bodies1);
+	cpArrayFree(bodies2);
+	return same;
+}
+
+// Step a scene in two spaces that only differ by their solver and check the bodies after every step.
+// Returns the first step where the bodies differ, or -1 if they never did.
+static int
+CheckScene(ChipmunkDemo *bench, unsigned int seed, int steps)
+{
+	BenchVectorized = false;
+	srand(seed);
+	cpSpace *expected = bench->initFunc();
+	
+	BenchVectorized = true;
+	srand(seed);
+	cpSpace *actual = bench->initFunc();
+	
+	int diverged = -1;
+	for(int step=0; step<steps && diverged < 0; step++){
+		// Reseed so both spaces see the same random numbers if the update function uses them.
+		srand(seed + step);
+		bench->updateFunc(expected, bench->timestep);
+		srand(seed + step);
+		bench->updateFunc(actual, bench->timestep);
+		
+		if(!SameBodies(expected, actual)) diverged = step;
+	}
+	
+	bench->destroyFunc(expected);
+	bench->destroyFunc(actual);
+	return diverged;
+}
+
+static void
+Usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [--space cpSpace|cpHastySpace] [--threads n] [--index bbtree|hash]\n"
+		"          [--hash-dim size] [--hash-count count] [--steps n] [--seed n] [--filter substring] [--output file]\n"
+		"          [--check vectorized|packed]\n",
+		name
+	);
+	exit(1);
+}
+
+int
+main(int argc, const char **argv)
+{
+	int steps = 1000;
+	unsigned int seed = 1;
+	const char *filter = NULL;
+	const char *output = NULL;
+	const char *check = NULL;
+	const char *index = "bbtree";
+	cpFloat hash_dim = 20.0f;
+	int hash_count = 10000;
+	
+	for(int i=1; i<argc; i++){
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc ? argv[i + 1] : NULL);
+		if(!value) Usage(argv[0]);
+		i++;
+		
+		if(strcmp(arg, "--space") == 0){
+			if(strcmp(value, "cpSpace") == 0){
+				BenchUseHasty = false;
+			} else if(strcmp(value, "cpHastySpace") == 0){
+				BenchUseHasty = true;
+			} else {
+				Usage(argv[0]);
+			}
+		} else if(strcmp(arg, "--threads") == 0){
+			BenchThreads = strtoul(value, NULL, 10);
+		} else if(strcmp(arg, "--index") == 0){
+			if(strcmp(value, "bbtree") != 0 && strcmp(value, "hash") != 0) Usage(argv[0]);
+			index = value;
+		} else if(strcmp(arg, "--hash-dim") == 0){
+			hash_dim = atof(value);
+		} else if(strcmp(arg, "--hash-count") == 0){
+			hash_count = atoi(value);
+		} else if(strcmp(arg, "--steps") == 0){
+			steps = atoi(value);
+		} else if(strcmp(arg, "--seed") == 0){
+			seed = (unsigned int)strtoul(value, NULL, 10);
+		} else if(strcmp(arg, "--filter") == 0){
+			filter = value;
+		} else if(strcmp(arg, "--output") == 0){
+			output = value;
+		} else if(strcmp(arg, "--check") == 0){
+			if(strcmp(value, "vectorized") != 0 && strcmp(value, "packed") != 0) Usage(argv[0]);
+			check = value;
+		} else {
+			Usage(argv[0]);
+		}
+	}
+	
+	if(steps <= 0 || hash_dim <= 0.0f || hash_count <= 0) Usage(argv[0]);
+	
+	if(strcmp(index, "hash") == 0){
+		BenchSpatialHashDim = hash_dim;
+		BenchSpatialHashCount = hash_count;
+	}
+	
+	if(check){
+		// The solvers being checked only exist in cpHastySpace.
+		BenchUseHasty = true;
+		BenchPackedSolver = (strcmp(check, "packed") == 0);
+		
+		int failures = 0;
+		for(int i=0; i<bench_count; i++){
+			ChipmunkDemo *bench = bench_list + i;
+			
+			const char *name = strrchr(bench->name, ' ');
+			name = (name ? name + 1 : bench->name);
+			if(filter && !strstr(name, filter)) continue;
+			
+			int diverged = CheckScene(bench, seed, steps);
+			if(diverged < 0){
+				printf("%s: ok\n", name);
+			} else {
+				printf("%s: %s solver diverged at step %d\n", name, check, diverged);
+				failures++;
+			}
+			fflush(stdout);
+		}
+		
+		return (failures ? 1 : 0);
+	}
+	
+	FILE *out = stdout;
+	if(output){
+		out = fopen(output, "w");
+		if(!out){
+			perror(output);
+			return 1;
+		}
+	}
+	
+	// Debug builds print a banner the first time a space is created, get it out of the way before any JSON is printed.
+	cpSpaceFree(cpSpaceNew());
+	
+	double *times = (double *)cpcalloc(steps, sizeof(double));
+	
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"version\": \"%s\",\n", cpVersionString);
+	fprintf(out, "\t\"space\": \"%s\",\n", BenchUseHasty ? "cpHastySpace" : "cpSpace");
+	fprintf(out, "\t\"threads\": %lu,\n", BenchUseHasty ? BenchThreads : 1);
+	fprintf(out, "\t\"index\": \"%s\",\n", index);
+	fprintf(out, "\t\"steps\": %d,\n", steps);
+	fprintf(out, "\t\"benchmarks\": [");
+	
+	int printed = 0;
+	for(int i=0; i<bench_count; i++){
+		ChipmunkDemo *bench = bench_list + i;
+		
+		// Strip the "benchmark - " prefix from the names.
+		const char *name = strrchr(bench->name, ' ');
+		name = (name ? name + 1 : bench->name);
+		if(filter && !strstr(name, filter)) continue;
+		
+		srand(seed);
+		cpSpace *space = bench->initFunc();
+		
+		double total = 0.0;
+		long total_contacts = 0;
+		int max_contacts = 0;
+		
+		for(int step=0; step<steps; step++){
+			double start = BenchTime();
+			bench->updateFunc(space, bench->timestep);
+			times[step] = BenchTime() - start;
+			total += times[step];
+			
+			int contacts = CountContacts(space);
+			total_contacts += contacts;
+			if(contacts > max_contacts) max_contacts = contacts;
+		}
+		
+		bench->destroyFunc(space);
+		
+		qsort(times, steps, sizeof(double), CompareDoubles);
+		int p99 = steps*99/100;
+		
+		fprintf(out, "%s\n\t\t{\"name\": \"%s\", ", printed ? "," : "", name);
+		fprintf(out, "\"ns_per_step\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f, ",
+			1e9*total/steps, 1e9*times[steps/2], 1e9*times[p99], 1e9*times[steps - 1]
+		);
+		fprintf(out, "\"contacts_mean\": %.1f, \"contacts_max\": %d}", (double)total_contacts/steps, max_contacts);
+		fflush(out);
+		printed++;
+	}
+	
+	fprintf(out, "\n\t]\n}\n");
+	
+	if(out != stdout) fclose(out);
+	cpfree(times);
+	return 0;
+}
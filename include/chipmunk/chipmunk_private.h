@@ -78,6 +78,12 @@ void cpBodyAccumulateMassFromShapes(cpBody *body);
 
 void cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint);
 
+// Bullet bodies remember where they started the step so they can be rewound to their time of impact.
+// cpBodyGetSweepTransform() interpolates the body's transform between the start and end of the step.
+void cpBodyBeginSweep(cpBody *body);
+cpTransform cpBodyGetSweepTransform(const cpBody *body, cpFloat t);
+void cpBodyRewindSweep(cpBody *body, cpFloat t);
+
 
 //MARK: Spatial Index Functions
 
@@ -97,7 +103,7 @@ cpArbiterThreadForBody(cpArbiter *arb, cpBody *body)
 void cpArbiterUnthread(cpArbiter *arb);
 
 void cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *space);
-void cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat bias, cpFloat slop);
+void cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias, bool speculative);
 void cpArbiterApplyCachedImpulse(cpArbiter *arb, cpFloat dt_coef);
 void cpArbiterApplyImpulse(cpArbiter *arb);
 
@@ -106,6 +112,13 @@ void cpArbiterApplyImpulse(cpArbiter *arb);
 
 cpShape *cpShapeInit(cpShape *shape, const cpShapeClass *klass, cpBody *body, struct cpShapeMassInfo massInfo);
 
+// Update the shape's bounding box and sweep it along the body's velocity for a step of length dt.
+// Only the box used by the dynamic spatial index is swept, cpShapeGetBB() still returns the shape's actual bounds.
+cpBB cpShapeCacheSweptBB(cpShape *shape, cpFloat dt);
+
+// Bounding box function for the dynamic spatial index.
+cpBB cpShapeGetSweptBB(const cpShape *shape);
+
 static inline bool
 cpShapeActive(cpShape *shape)
 {
@@ -115,8 +128,17 @@ cpShapeActive(cpShape *shape)
 }
 
 // Note: This function returns contact points with r1/r2 in absolute coordinates, not body relative.
+// cpCollide() doesn't create speculative contacts, the info's margin is always 0.
 struct cpCollisionInfo cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact *contacts);
 
+// Distance between the surfaces of two shapes using their cached transformed geometry, negative if they overlap.
+// Like cpCollide(), the id caches the closest features between calls for the same pair.
+cpFloat cpCollideDistance(const cpShape *a, const cpShape *b, cpCollisionID *id);
+
+// Run the narrow phase on a batch of pairs that all have the same shape types.
+// The pairs' infos must already be set up with their shapes sorted by type and a place to put their contacts.
+void cpCollideBatch(struct cpCollisionPair *pairs, const int *order, int count);
+
 static inline void
 CircleSegmentQuery(cpShape *shape, cpVect center, cpFloat r1, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo *info)
 {
@@ -282,6 +304,9 @@ extern cpCollisionHandler cpCollisionHandlerDoNothing;
 
 void cpSpaceProcessComponents(cpSpace *space, cpFloat dt);
 
+typedef void (*cpSpaceComponentIteratorFunc)(cpBody *root, void *data);
+void cpSpaceEachActiveComponent(cpSpace *space, cpSpaceComponentIteratorFunc func, void *data);
+
 void cpSpacePushFreshContactBuffer(cpSpace *space);
 struct cpContact *cpContactBufferGetArray(cpSpace *space);
 void cpSpacePushContacts(cpSpace *space, int count);
@@ -311,9 +336,131 @@ cpSpaceArrayForBodyType(cpSpace *space, cpBodyType type)
 	return (type == CP_BODY_TYPE_STATIC ? space->staticBodies : space->dynamicBodies);
 }
 
+//MARK: Snapshots
+
+// Snapshots are mostly lists of objects saved along with their addresses so they can be copied back in place.
+// Writing past the end of the buffer only counts the bytes that would have been written.
+typedef struct cpSnapshotWriter {
+	char *buffer;
+	size_t size, used;
+} cpSnapshotWriter;
+
+typedef struct cpSnapshotReader {
+	const char *buffer;
+	size_t size, used;
+} cpSnapshotReader;
+
+void cpSnapshotWrite(cpSnapshotWriter *writer, const void *data, size_t bytes);
+void cpSnapshotWriteObject(cpSnapshotWriter *writer, const void *ptr, size_t bytes);
+void cpSnapshotEndList(cpSnapshotWriter *writer);
+
+void cpSnapshotRead(cpSnapshotReader *reader, void *data, size_t bytes);
+// Returns the address of the next object and skips over its contents, or NULL at the end of a list.
+// If contents is not NULL, it's set to where the object's contents are stored in the snapshot.
+void *cpSnapshotNextObject(cpSnapshotReader *reader, const void **contents);
+// Copies the next object back to its address and returns it, or NULL at the end of a list.
+void *cpSnapshotRestoreObject(cpSnapshotReader *reader);
+
+// Free objects missing from a snapshot are put back into the pools when restoring.
+// The scratch array is used to gather the objects in use beforehand.
+void cpHashSetSnapshot(cpHashSet *set, cpSnapshotWriter *writer);
+void cpHashSetRestore(cpHashSet *set, cpSnapshotReader *reader);
+
+void cpBBTreeSnapshot(cpSpatialIndex *index, cpSnapshotWriter *writer);
+void cpBBTreeRestore(cpSpatialIndex *index, cpSnapshotReader *reader, cpArray *scratch);
+
+// Returns true if the index is a cpBBTree.
+bool cpSpatialIndexIsBBTree(cpSpatialIndex *index);
+
+// Refresh the categories of an object after they change. Does nothing if the index isn't a tree or doesn't contain the object.
+void cpBBTreeUpdateCategories(cpSpatialIndex *index, void *obj, cpHashValue hashid);
+
+// The number of segments must fit in the bits of an unsigned int.
+#define CP_BBTREE_PACKET_SIZE 32
+
+// Callback for cpBBTreeSegmentQueryPacket(). ray is the index of the segment in the packet.
+typedef cpFloat (*cpBBTreePacketQueryFunc)(int ray, void *obj, void *data);
+// Segment query up to CP_BBTREE_PACKET_SIZE segments at once so they share the work of visiting each node.
+// t_exit holds the exit time of each segment and is lowered to the values returned by func.
+// Other spatial indexes query the segments one at a time.
+void cpBBTreeSegmentQueryPacket(cpSpatialIndex *index, const cpVect *a, const cpVect *b, cpFloat *t_exit, int count, cpBitmask mask, cpBBTreePacketQueryFunc func, void *data);
+
+void cpSpaceSnapshotContactBuffers(cpSpace *space, cpSnapshotWriter *writer);
+void cpSpaceRestoreContactBuffers(cpSpace *space, cpSnapshotReader *reader);
+
+//MARK: Profiling
+
+// Seconds from a monotonic clock.
+double cpProfileTime(void);
+
+#ifdef CP_ENABLE_PROFILER
+	struct cpSpaceProfiler {
+		// Profile of the step in progress.
+		cpSpaceProfile current;
+		double stepStart, lastMark;
+		
+		// Ring buffer of the most recent steps.
+		cpSpaceProfile *history;
+		int length, count, head;
+	};
+	
+	void cpSpaceProfileBeginStep(cpSpace *space);
+	void cpSpaceProfileMark(cpSpace *space, cpSpaceProfileStage stage);
+	void cpSpaceProfileEndStep(cpSpace *space);
+	
+	// Each mark adds the time since the previous mark to the stage.
+	#define CP_PROFILE_BEGIN_STEP(space) do{if((space)->profiler) cpSpaceProfileBeginStep(space);}while(0)
+	#define CP_PROFILE_MARK(space, stage) do{if((space)->profiler) cpSpaceProfileMark(space, stage);}while(0)
+	#define CP_PROFILE_END_STEP(space) do{if((space)->profiler) cpSpaceProfileEndStep(space);}while(0)
+	#define CP_PROFILE_COUNT(space, counter, n) do{if((space)->profiler) (space)->profiler->current.counter += (n);}while(0)
+#else
+	#define CP_PROFILE_BEGIN_STEP(space)
+	#define CP_PROFILE_MARK(space, stage)
+	#define CP_PROFILE_END_STEP(space)
+	#define CP_PROFILE_COUNT(space, counter, n)
+#endif
+
 void cpShapeUpdateFunc(cpShape *shape, void *unused);
+cpVect cpShapeVelocityFunc(cpShape *shape);
+cpBitmask cpShapeCategoriesFunc(cpShape *shape);
+
+// Returns the order to run a batch of segment queries in, which should be freed with cpfree().
+int *cpSpaceSegmentQueryBatchOrder(const cpVect *starts, const cpVect *ends, int count);
+// Run the segment queries from order[start] up to order[end].
+void cpSpaceSegmentQueryFirstBatchRange(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, const int *order, int start, int end);
 cpCollisionID cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space);
 
+// cpSpaceCollideShapes() split into two halves so the collisions can be found on other threads.
+// cpSpaceNarrowPhase() only reads from the shapes, and reports a count of 0 for rejected or non-touching shapes.
+// cpSpaceCommitCollision() expects the info's contacts to have been pushed into the space's contact buffer.
+struct cpCollisionInfo cpSpaceNarrowPhase(cpShape *a, cpShape *b, cpCollisionID id, struct cpContact *contacts);
+void cpSpaceCommitCollision(cpSpace *space, struct cpCollisionInfo *info);
+
+// Batched narrow phase. Instead of colliding shapes as the broadphase finds them:
+// cpSpaceSwapPairs() starts a new list of pairs, and cpSpaceQueuePair() is passed to cpSpatialIndexReindexQuery() to fill it.
+// cpSpaceSortPairs() buckets the pairs by shape types and returns how many need to be collided.
+// cpSpaceCollidePairs() runs the narrow phase on a range of the sorted pairs, and is safe to call from other threads.
+// cpSpaceCommitPairs() commits the collisions in the order the broadphase found them.
+void cpSpaceSwapPairs(cpSpace *space);
+cpCollisionID cpSpaceQueuePair(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space);
+int cpSpaceSortPairs(cpSpace *space);
+void cpSpaceCollidePairs(cpSpace *space, int start, int end);
+void cpSpaceCommitPairs(cpSpace *space);
+
+// Runs the broadphase on the dynamic shapes, filling in the pairs and returning the result of cpSpaceSortPairs().
+// Bullet bodies are moved back to their time of impact before the pairs are sorted.
+int cpSpaceFindPairs(cpSpace *space);
+
+// Records the starting positions of the awake bullet bodies. Must be called before the positions are integrated.
+void cpSpaceBeginBullets(cpSpace *space);
+
+// Spatial index tuning, see cpSpaceSetSpatialIndexTuning().
+// cpSpaceTuneSpatialIndex() may replace the dynamic index, so it must be called while the space is unlocked.
+// cpSpaceReplaceDynamicShapes() moves the dynamic shapes into a new index created without a static index, and frees the old one.
+void cpSpaceTuneSpatialIndex(cpSpace *space);
+void cpSpaceSampleBroadphase(cpSpace *space, double time);
+void cpSpaceReplaceDynamicShapes(cpSpace *space, cpSpatialIndex *dynamicShapes);
+
 
 //MARK: Foreach loops
 
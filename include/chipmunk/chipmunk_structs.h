@@ -78,6 +78,16 @@ struct cpBody {
 		cpBody *next;
 		cpFloat idleTime;
 	} sleeping;
+	
+	// Continuous collision detection, see cpBodySetBullet().
+	struct {
+		bool enabled;
+		// Position and angle at the start of the step.
+		cpVect p;
+		cpFloat a;
+		// Earliest time of impact found this step as a fraction of the body's motion.
+		cpFloat toi;
+	} bullet;
 };
 
 enum cpArbiterState {
@@ -119,6 +129,23 @@ struct cpCollisionInfo {
 	int count;
 	// TODO Should this be a unique struct type?
 	struct cpContact *arr;
+	
+	// Speculative contacts are created for surfaces up to this far apart, see cpSpaceSetCollisionSpeculation().
+	cpFloat margin;
+};
+
+// A broadphase pair queued up for the batched narrow phase.
+struct cpCollisionPair {
+	cpShape *a, *b;
+	
+	// Index of the pair's shape type bucket, or -1 if the pair was rejected or reused last step's contacts.
+	int bucket;
+	
+	struct cpCollisionInfo info;
+	
+	// Arbiter the pair was last committed to, carried over from the previous step for persistent pairs.
+	// Only a hint, cpSpaceCommitPairs() checks it's still valid before skipping the cachedArbiters lookup.
+	cpArbiter *arb;
 };
 
 struct cpArbiter {
@@ -142,6 +169,12 @@ struct cpArbiter {
 	
 	cpTimestamp stamp;
 	enum cpArbiterState state;
+	
+	// Rotations of the bodies when the contacts were last updated by cpSpaceCommitPairs(),
+	// and the pose of body b in body a's frame when the narrow phase last found the contacts.
+	// Used to reuse the contacts of pairs that barely moved, see cpSpaceSetCollisionCoherence().
+	cpVect rot_a, rot_b;
+	cpVect coherence_p, coherence_rot;
 };
 
 struct cpShapeMassInfo {
@@ -181,6 +214,8 @@ struct cpShape {
 	cpBody *body;
 	struct cpShapeMassInfo massInfo;
 	cpBB bb;
+	// Bounding box used by the dynamic spatial index. Swept along the body's motion by speculative contacts and bullets.
+	cpBB sweptBB;
 	
 	bool sensor;
 	
@@ -405,6 +440,8 @@ struct cpSpace {
 	cpFloat collisionSlop;
 	cpFloat collisionBias;
 	cpTimestamp collisionPersistence;
+	cpFloat collisionCoherence;
+	bool collisionSpeculation;
 	
 	cpDataPointer userData;
 	
@@ -415,6 +452,7 @@ struct cpSpace {
 	cpArray *staticBodies;
 	cpArray *rousedBodies;
 	cpArray *sleepingComponents;
+	cpArray *bulletBodies;
 	
 	cpHashValue shapeIDCounter;
 	cpSpatialIndex *staticShapes;
@@ -430,6 +468,20 @@ struct cpSpace {
 	cpArray *allocatedBuffers;
 	unsigned int locked;
 	
+	// Broadphase pairs queued up for the narrow phase.
+	// The previous step's pairs are kept around to look up the collision ids of persistent pairs.
+	struct cpCollisionPair *pairs, *prevPairs;
+	int pairCount, pairCapacity;
+	int prevPairCount, prevPairCapacity;
+	
+	// Indexes of the pairs sorted by shape types, and where each type bucket starts.
+	int *pairOrder;
+	int pairBuckets[CP_NUM_SHAPES*CP_NUM_SHAPES + 1];
+	
+	// Scratch contacts for the narrow phase, CP_MAX_CONTACTS_PER_ARBITER per pair.
+	struct cpContact *pairContacts;
+	int pairScratchCapacity;
+	
 	bool usesWildcards;
 	cpHashSet *collisionHandlers;
 	cpCollisionHandler defaultHandler;
@@ -437,6 +489,16 @@ struct cpSpace {
 	bool skipPostStep;
 	cpArray *postStepCallbacks;
 	
+	// Step profiler, only used if Chipmunk is compiled with CP_ENABLE_PROFILER.
+	struct cpSpaceProfiler *profiler;
+	
+	// Broadphase measurements for choosing the dynamic index, NULL unless tuning is enabled.
+	struct cpSpatialIndexTuner *tuner;
+	
+	// Incremented whenever objects are added or removed. Snapshots can only be restored while it matches.
+	cpTimestamp topologyStamp;
+	cpArray *snapshotScratch;
+	
 	cpBody *staticBody;
 	cpBody _staticBody;
 };
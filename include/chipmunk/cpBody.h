@@ -84,6 +84,15 @@ CP_EXPORT void cpBodySetType(cpBody *body, cpBodyType type);
 /// Get the space this body is added to.
 CP_EXPORT cpSpace* cpBodyGetSpace(const cpBody *body);
 
+/// Returns true if the body uses continuous collision detection.
+CP_EXPORT bool cpBodyIsBullet(const cpBody *body);
+/// Enable continuous collision detection for a fast moving dynamic body.
+/// Each step the bullet's shapes are swept from where the body started the step to where it ended up,
+/// and the body is moved back to its first time of impact with any non-sensor shape so it can't tunnel through it.
+/// The rest of the step's motion is dropped. Other bodies are treated as if they were already at their new positions.
+/// This is much more expensive than regular collision detection, so only use it for a few small fast bodies.
+CP_EXPORT void cpBodySetBullet(cpBody *body, bool bullet);
+
 /// Get the mass of the body.
 CP_EXPORT cpFloat cpBodyGetMass(const cpBody *body);
 /// Set the mass of the body.
@@ -2,26 +2,71 @@
 // See http://chipmunk2d.net/legal.php for more information.
 
 /// cpHastySpace is exclusive to Chipmunk Pro
-/// Currently it enables ARM NEON optimizations in the solver, but in the future will include other optimizations such as
-/// a multi-threaded solver and multi-threaded collision broadphases.
+/// It enables ARM NEON or x86 SSE2/AVX2 optimizations in the solver and can split the solver up across multiple threads.
+/// The contact graph is divided into islands of objects that don't touch each other, and islands are solved in parallel.
+/// Large islands such as big piles of objects are graph colored so that all of the threads can help solve them.
+/// When running with multiple threads, updating the shapes and narrow phase collision detection are split up between them as well.
 
 struct cpHastySpace;
 typedef struct cpHastySpace cpHastySpace;
 
 /// Create a new hasty space.
-/// On ARM platforms that support NEON, this will enable the vectorized solver.
-/// cpHastySpace also supports multiple threads, but runs single threaded by default for determinism.
+/// On ARM platforms that support NEON or x86 platforms, this will enable the vectorized solver.
+/// On x86 the widest instruction set supported by the CPU is picked at runtime.
+/// cpHastySpace also supports multiple threads, but runs single threaded by default.
+/// Since each island is always solved by a single thread, the results are deterministic regardless of the thread count.
 CP_EXPORT cpSpace *cpHastySpaceNew(void);
 CP_EXPORT void cpHastySpaceFree(cpSpace *space);
 
 /// Set the number of threads to use for the solver.
-/// Currently Chipmunk is limited to 2 threads as using more generally provides very minimal performance gains.
-/// Passing 0 as the thread count on iOS or OS X will cause Chipmunk to automatically detect the number of threads it should use.
-/// On other platforms passing 0 for the thread count will set 1 thread.
+/// Small islands are solved by a single thread each, while large islands are split up between all of the threads.
+/// Passing 0 as the thread count will cause Chipmunk to automatically detect the number of threads it should use.
+/// When using more than one thread, body position and velocity integration functions are called from the worker threads.
 CP_EXPORT void cpHastySpaceSetThreads(cpSpace *space, unsigned long threads);
 
 /// Returns the number of threads the solver is using to run.
 CP_EXPORT unsigned long cpHastySpaceGetThreads(cpSpace *space);
 
+/// Set how many times an idle worker thread checks for new work before going to sleep.
+/// Spinning lets the threads start working on the next phase of a step much sooner at the cost of burning CPU time.
+/// Pass 0 to put idle threads to sleep immediately.
+CP_EXPORT void cpHastySpaceSetSpinBudget(cpSpace *space, unsigned long spins);
+
+/// Returns the number of times idle worker threads check for new work before going to sleep.
+CP_EXPORT unsigned long cpHastySpaceGetSpinBudget(cpSpace *space);
+
+/// Set the size of the smallest island (counting both arbiters and constraints) that is graph colored so all of the threads can solve it together.
+/// Smaller islands are solved start to finish by a single thread.
+/// Each color adds a point each iteration where the threads wait for each other, so coloring only pays off when an island has enough work
+/// to keep all of the threads busy in between. Defaults to 256.
+/// Coloring changes the order that items are solved in, so changing the threshold changes the results. The thread count still doesn't.
+CP_EXPORT void cpHastySpaceSetColorThreshold(cpSpace *space, int threshold);
+
+/// Returns the size of the smallest island that is graph colored.
+CP_EXPORT int cpHastySpaceGetColorThreshold(cpSpace *space);
+
+/// Enable or disable the vectorized solver. Enabled by default.
+/// The SSE2 and AVX2 solvers give exactly the same results as the scalar solver, so this is mostly useful for testing.
+CP_EXPORT void cpHastySpaceSetVectorized(cpSpace *space, bool vectorized);
+
+/// Returns true if the vectorized solver is enabled.
+CP_EXPORT bool cpHastySpaceGetVectorized(cpSpace *space);
+
+/// Enable the packed solver. Disabled by default.
+/// The packed solver copies the velocities of the bodies into a flat array and the contacts into vectorizable lanes before solving,
+/// then copies the results back afterwards. This lets it solve several contacts at once using SSE2 or AVX2 (detected at runtime) on x86 CPUs.
+/// Other CPUs use a scalar version of the same solver. The SSE2 and AVX2 versions give exactly the same results as the scalar version,
+/// so a packed space steps the same with or without cpHastySpaceSetVectorized().
+/// The contacts are graph colored and solved one color at a time, so the results don't depend on the thread count.
+/// They are not the same as the results of the regular solver however. Constraints are always solved by a single thread.
+CP_EXPORT void cpHastySpaceSetPackedSolver(cpSpace *space, bool packed);
+
+/// Returns true if the packed solver is enabled.
+CP_EXPORT bool cpHastySpaceGetPackedSolver(cpSpace *space);
+
 /// When stepping a hasty space, you must use this function.
 CP_EXPORT void cpHastySpaceStep(cpSpace *space, cpFloat dt);
+
+/// Same as cpSpaceSegmentQueryFirstBatch(), but splits the queries up between the worker threads.
+/// When called from a callback during a step, the queries are run on the calling thread.
+CP_EXPORT void cpHastySpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, int count);
@@ -123,6 +123,24 @@ CP_EXPORT void cpSpaceSetCollisionBias(cpSpace *space, cpFloat collisionBias);
 CP_EXPORT cpTimestamp cpSpaceGetCollisionPersistence(const cpSpace *space);
 CP_EXPORT void cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence);
 
+/// How far the shapes of a colliding pair can move relative to each other before their contacts are recalculated.
+/// Pairs that stay within it skip the narrow phase and carry last step's contacts along with the bodies instead.
+/// Useful for large piles of resting objects. Keep it well below the collision slop.
+/// Defaults to 0, which runs the narrow phase for every pair every step.
+CP_EXPORT cpFloat cpSpaceGetCollisionCoherence(const cpSpace *space);
+CP_EXPORT void cpSpaceSetCollisionCoherence(cpSpace *space, cpFloat collisionCoherence);
+
+/// Speculative contacts let fast moving shapes collide with thin shapes without substepping.
+/// The broadphase sweeps the bounding boxes of dynamic shapes along their velocity,
+/// and contacts are created for shapes that could touch within the step.
+/// cpShapeGetBB() and the space queries still use the shapes' actual bounding boxes.
+/// The solver only lets the shapes approach as fast as it would take them to close the gap by the end of the step.
+/// Only linear velocity is accounted for, and sensors never get speculative contacts.
+/// Collision callbacks are called for speculative contacts before the shapes actually touch,
+/// and shapes don't bounce until they do. Defaults to false.
+CP_EXPORT bool cpSpaceGetCollisionSpeculation(const cpSpace *space);
+CP_EXPORT void cpSpaceSetCollisionSpeculation(cpSpace *space, bool collisionSpeculation);
+
 /// User definable data pointer.
 /// Generally this points to your game's controller or game state
 /// class so you can access it when given a cpSpace reference in a callback.
@@ -205,6 +223,10 @@ typedef void (*cpSpaceSegmentQueryFunc)(cpShape *shape, cpVect point, cpVect nor
 CP_EXPORT void cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSpaceSegmentQueryFunc func, void *data);
 /// Perform a directed line segment query (like a raycast) against the space and return the first shape hit. Returns NULL if no shapes were hit.
 CP_EXPORT cpShape *cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out);
+/// Perform many segment queries at once, like calling cpSpaceSegmentQueryFirst() for each of the segments from @c starts[i] to @c ends[i].
+/// The first hit of each segment is written to @c out[i], which will have a NULL shape if it didn't hit anything.
+/// Segments that start near each other and point the same way are queried together so they can share the work of walking the spatial indexes.
+CP_EXPORT void cpSpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, int count);
 
 /// Rectangle Query callback function type.
 typedef void (*cpSpaceBBQueryFunc)(cpShape *shape, void *data);
@@ -245,8 +267,33 @@ CP_EXPORT void cpSpaceReindexShape(cpSpace *space, cpShape *shape);
 /// Update the collision detection data for all shapes attached to a body.
 CP_EXPORT void cpSpaceReindexShapesForBody(cpSpace *space, cpBody *body);
 
+/// Rebuild the space's bounding box trees for faster queries using cpBBTreeOptimize().
+/// This is best done after adding a lot of shapes at once, such as when loading a level.
+/// Spatial indexes that aren't bounding box trees are left alone.
+CP_EXPORT void cpSpaceOptimizeSpatialIndexes(cpSpace *space);
+/// Incrementally optimize the space's bounding box trees using cpBBTreeOptimizeIncremental(), with the same @c budget for each tree.
+/// Call it in spare time at the end of each frame to keep the trees optimized without a long pause.
+/// Like cpSpaceOptimizeSpatialIndexes(), spatial indexes that aren't bounding box trees are left alone.
+CP_EXPORT void cpSpaceOptimizeSpatialIndexesIncremental(cpSpace *space, int budget);
+
 /// Switch the space to use a spatial has as it's spatial index.
 CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
+/// Switch the space to use hierarchical hash grids as its spatial indexes.
+/// This works better than a spatial hash when the shapes vary a lot in size. See cpHashGridNew() for the parameters.
+CP_EXPORT void cpSpaceUseHashGrid(cpSpace *space, cpFloat dim, int levels);
+/// Switch the space to keep its static shapes in a cpQBVH, and its dynamic shapes in a bounding box tree.
+/// Snapshots are not supported by the cpQBVH.
+CP_EXPORT void cpSpaceUseStaticQBVH(cpSpace *space);
+
+/// Let the space choose and size its dynamic spatial index at runtime.
+/// The space times the broadphase and tries the bounding box tree, spatial hash, hierarchical hash grid and sort and sweep
+/// whenever the number or sizes of the dynamic shapes change enough to matter, then keeps the fastest.
+/// The spatial hash and hash grid are sized from the shapes, and a spatial hash is resized if it finds too many false positives.
+/// The choice depends on timing, so a space with tuning enabled isn't deterministic from run to run.
+/// Snapshots only work while the dynamic index is a bounding box tree.
+CP_EXPORT void cpSpaceSetSpatialIndexTuning(cpSpace *space, bool enabled);
+/// Returns true if spatial index tuning is enabled.
+CP_EXPORT bool cpSpaceGetSpatialIndexTuning(const cpSpace *space);
 
 
 //MARK: Time Stepping
@@ -255,6 +302,21 @@ CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
 CP_EXPORT void cpSpaceStep(cpSpace *space, cpFloat dt);
 
 
+//MARK: Snapshots
+
+/// Save the simulation state of the space into @c buffer so it can be rolled back with cpSpaceRestore().
+/// This includes the bodies, shapes, constraints, cached arbiters and their contacts, and the spatial indexes.
+/// Returns the size of the snapshot. If it's larger than @c size, the snapshot is incomplete and must be taken again with a larger buffer.
+/// Pass a NULL buffer to just find the size.
+/// Objects are saved by address, so a snapshot can only be restored to the same space in the same process.
+/// Snapshots require the default bounding box tree spatial index and the built in constraint types.
+CP_EXPORT size_t cpSpaceSnapshot(cpSpace *space, void *buffer, size_t size);
+/// Restore the space to the state saved by cpSpaceSnapshot(). Objects are copied back in place without being reallocated.
+/// Returns false and leaves the space untouched if the snapshot is from another space,
+/// or if any bodies, shapes or constraints have been added or removed since it was taken.
+CP_EXPORT bool cpSpaceRestore(cpSpace *space, const void *buffer, size_t size);
+
+
 //MARK: Debug API
 
 #ifndef CP_SPACE_DISABLE_DEBUG_API
@@ -316,4 +378,72 @@ CP_EXPORT void cpSpaceDebugDraw(cpSpace *space, cpSpaceDebugDrawOptions *options
 
 #endif
 
+//MARK: Profiling
+
+#ifdef CP_ENABLE_PROFILER
+
+/// Stages of cpSpaceStep() and cpHastySpaceStep() timed by the profiler.
+typedef enum cpSpaceProfileStage {
+	/// Resetting the arbiters and integrating body positions.
+	CP_PROFILE_INTEGRATE_POSITIONS,
+	/// Updating the bounding boxes of the shapes.
+	CP_PROFILE_UPDATE_SHAPES,
+	/// Reindexing the shapes and finding the broadphase pairs.
+	CP_PROFILE_BROADPHASE,
+	/// Colliding the pairs and calling the begin and pre-solve callbacks.
+	CP_PROFILE_NARROWPHASE,
+	/// cpSpaceProcessComponents(), rebuilding the contact graph and putting bodies to sleep.
+	CP_PROFILE_PROCESS_COMPONENTS,
+	/// Filtering the cached arbiters and calling separate callbacks.
+	CP_PROFILE_FILTER_ARBITERS,
+	/// Prestepping the arbiters and constraints.
+	CP_PROFILE_PRESTEP,
+	/// Integrating body velocities.
+	CP_PROFILE_INTEGRATE_VELOCITIES,
+	/// Applying the cached impulses.
+	CP_PROFILE_CACHED_IMPULSES,
+	/// Running the solver iterations.
+	CP_PROFILE_SOLVER,
+	/// Calling the post-solve and post-step callbacks.
+	CP_PROFILE_POST_SOLVE,
+	CP_PROFILE_NUM_STAGES
+} cpSpaceProfileStage;
+
+/// Timings and counters recorded for a single step.
+typedef struct cpSpaceProfile {
+	/// The space's timestamp for the step.
+	cpTimestamp stamp;
+	/// Wall time of the whole step in seconds.
+	double total;
+	/// Wall time of each stage in seconds.
+	/// The stages are timed back to back, so they add up to the total.
+	double stages[CP_PROFILE_NUM_STAGES];
+	
+	/// Number of pairs found by the broadphase.
+	int pairs;
+	/// Number of colliding pairs that needed a new arbiter.
+	int arbitersCreated;
+	/// Number of colliding pairs that reused their arbiter from a previous step.
+	int arbitersReused;
+	/// Number of contacts passed to the solver.
+	int contacts;
+} cpSpaceProfile;
+
+/// Set how many steps of profiles to keep. Profiling starts when the length is set greater than 0.
+/// Setting it to 0 stops profiling and frees the history.
+CP_EXPORT void cpSpaceSetProfileHistoryLength(cpSpace *space, int length);
+/// Get how many steps of profiles are kept.
+CP_EXPORT int cpSpaceGetProfileHistoryLength(const cpSpace *space);
+/// Get the number of profiles currently in the history.
+CP_EXPORT int cpSpaceGetProfileCount(const cpSpace *space);
+/// Get the profile of a recent step. 0 is the most recent step, 1 the one before it and so on.
+/// Returns NULL if there is no profile for that step.
+CP_EXPORT const cpSpaceProfile *cpSpaceGetProfile(const cpSpace *space, int stepsAgo);
+/// Clear the profile history without stopping profiling.
+CP_EXPORT void cpSpaceResetProfile(cpSpace *space);
+/// Get a readable name for a stage, useful for logging.
+CP_EXPORT const char *cpSpaceProfileStageName(cpSpaceProfileStage stage);
+
+#endif
+
 /// @}
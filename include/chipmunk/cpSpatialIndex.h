@@ -81,6 +81,21 @@ CP_EXPORT cpSpatialIndex* cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIn
 /// Some trial and error is required to find the optimum numbers for efficiency.
 CP_EXPORT void cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells);
 
+//MARK: Hierarchical Hash Grid
+
+typedef struct cpHashGrid cpHashGrid;
+
+/// Allocate a hierarchical hash grid.
+CP_EXPORT cpHashGrid* cpHashGridAlloc(void);
+/// Initialize a hierarchical hash grid.
+CP_EXPORT cpSpatialIndex* cpHashGridInit(cpHashGrid *grid, cpFloat celldim, int levels, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a hierarchical hash grid.
+/// Unlike a spatial hash, it works well with objects of very different sizes.
+/// The smallest cells are @c celldim across and the cell size doubles for each of the @c levels levels (at most 24).
+/// Each object is stored in a single cell of the level that matches its size.
+/// @c celldim should be about the size of the smallest objects and the largest level should be at least as large as the largest objects.
+CP_EXPORT cpSpatialIndex* cpHashGridNew(cpFloat celldim, int levels, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
 //MARK: AABB Tree
 
 typedef struct cpBBTree cpBBTree;
@@ -93,7 +108,17 @@ CP_EXPORT cpSpatialIndex* cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfu
 CP_EXPORT cpSpatialIndex* cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 
 /// Perform a static top down optimization of the tree.
+/// The tree is rebuilt using a binned surface area heuristic. It works for both static and dynamic trees.
 CP_EXPORT void cpBBTreeOptimize(cpSpatialIndex *index);
+/// Spread the work of cpBBTreeOptimize() over many calls to avoid a long pause on large trees.
+/// Each call rebuilds subtrees totalling about @c budget leaves, working through the tree in order.
+/// To fit a time budget, call it repeatedly with a small @c budget until the time runs out.
+/// Returns true when it finishes a pass over the whole tree.
+CP_EXPORT bool cpBBTreeOptimizeIncremental(cpSpatialIndex *index, int budget);
+/// Estimate the cost of querying the tree, useful for comparing tree quality. Lower is better.
+/// This is the sum of the perimeters of all of the nodes relative to the root's perimeter,
+/// or roughly the number of nodes an average query will have to visit.
+CP_EXPORT cpFloat cpBBTreeQueryCost(cpSpatialIndex *index);
 
 /// Bounding box tree velocity callback function.
 /// This function should return an estimate for the object's velocity.
@@ -101,6 +126,19 @@ typedef cpVect (*cpBBTreeVelocityFunc)(void *obj);
 /// Set the velocity function for the bounding box tree to enable temporal coherence.
 CP_EXPORT void cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func);
 
+/// Bounding box tree collision categories callback function.
+/// This function should return the object's collision category bits. (See cpShapeFilter)
+typedef cpBitmask (*cpBBTreeCategoriesFunc)(void *obj);
+/// Set the categories function for the bounding box tree.
+/// Each node of the tree keeps the union of the categories of the objects below it so masked queries can skip whole subtrees.
+CP_EXPORT void cpBBTreeSetCategoriesFunc(cpSpatialIndex *index, cpBBTreeCategoriesFunc func);
+/// Perform a rectangle query like cpSpatialIndexQuery(), but skip objects with no categories in common with @c mask.
+/// Other spatial indexes ignore the mask and call @c func for every potential match.
+CP_EXPORT void cpBBTreeMaskedQuery(cpSpatialIndex *index, void *obj, cpBB bb, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data);
+/// Perform a segment query like cpSpatialIndexSegmentQuery(), but skip objects with no categories in common with @c mask.
+/// Other spatial indexes ignore the mask and call @c func for every potential match.
+CP_EXPORT void cpBBTreeMaskedSegmentQuery(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data);
+
 //MARK: Single Axis Sweep
 
 typedef struct cpSweep1D cpSweep1D;
@@ -112,6 +150,19 @@ CP_EXPORT cpSpatialIndex* cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc b
 /// Allocate and initialize a 1D sort and sweep broadphase.
 CP_EXPORT cpSpatialIndex* cpSweep1DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 
+//MARK: 4-wide Bounding Volume Hierarchy
+
+typedef struct cpQBVH cpQBVH;
+
+/// Allocate a 4-wide bounding volume hierarchy.
+CP_EXPORT cpQBVH* cpQBVHAlloc(void);
+/// Initialize a 4-wide bounding volume hierarchy.
+CP_EXPORT cpSpatialIndex* cpQBVHInit(cpQBVH *bvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a 4-wide bounding volume hierarchy.
+/// It's built all at once and tests four child bounds at a time using SIMD, so it's best suited to static shapes.
+/// Objects added or reindexed afterwards are kept in a small bounding box tree until there are enough to rebuild it.
+CP_EXPORT cpSpatialIndex* cpQBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
 //MARK: Spatial Index Implementation
 
 typedef void (*cpSpatialIndexDestroyImpl)(cpSpatialIndex *index);
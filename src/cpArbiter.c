@@ -412,7 +412,7 @@ cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *space)
 }
 
 void
-cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias)
+cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias, bool speculative)
 {
 	cpBody *a = arb->body_a;
 	cpBody *b = arb->body_b;
@@ -432,7 +432,12 @@ cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias)
 		con->jBias = 0.0f;
 		
 		// Calculate the target bounce velocity.
-		con->bounce = normal_relative_velocity(a, b, con->r1, con->r2, n)*arb->e;
+		if(speculative && dist > 0.0f){
+			// Speculative contact, only stop the shapes from closing the gap faster than they can this step.
+			con->bounce = dist/dt;
+		} else {
+			con->bounce = normal_relative_velocity(a, b, con->r1, con->r2, n)*arb->e;
+		}
 	}
 }
 
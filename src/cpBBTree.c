@@ -28,10 +28,19 @@ static inline cpSpatialIndexClass *Klass(void);
 
 typedef struct Node Node;
 typedef struct Pair Pair;
+typedef struct FlatNode FlatNode;
+
+// Progress of cpBBTreeOptimizeIncremental().
+typedef struct OptimizeCursor {
+	unsigned int path;
+	int depth;
+	bool finished;
+} OptimizeCursor;
 
 struct cpBBTree {
 	cpSpatialIndex spatialIndex;
 	cpBBTreeVelocityFunc velocityFunc;
+	cpBBTreeCategoriesFunc categoriesFunc;
 	
 	cpHashSet *leaves;
 	Node *root;
@@ -41,6 +50,12 @@ struct cpBBTree {
 	cpArray *allocatedBuffers;
 	
 	cpTimestamp stamp;
+	OptimizeCursor optimizeCursor;
+	
+	// Compact copy of the tree made by cpBBTreeOptimize(), valid until the tree is next modified.
+	FlatNode *flatNodes;
+	Node **flatLeaves;
+	int flatCount, flatCapacity;
 };
 
 struct Node {
@@ -48,6 +63,9 @@ struct Node {
 	cpBB bb;
 	Node *parent;
 	
+	// Union of the collision categories of the leaves in the subtree.
+	cpBitmask categories;
+	
 	union {
 		// Internal nodes
 		struct { Node *a, *b; } children;
@@ -77,6 +95,16 @@ struct Pair {
 	cpCollisionID id;
 };
 
+// Flattened nodes are stored in depth first order so the first child of a node is always the next one.
+struct FlatNode {
+	cpBB bb;
+	cpBitmask categories;
+	
+	// Internal nodes: The index of the first node after this subtree.
+	// Leaves: The bitwise complement of the leaf's index in flatLeaves.
+	int skip;
+};
+
 //MARK: Misc Functions
 
 static inline cpBB
@@ -97,6 +125,20 @@ GetBB(cpBBTree *tree, void *obj)
 	}
 }
 
+static inline cpBitmask
+GetCategories(cpBBTree *tree, void *obj)
+{
+	cpBBTreeCategoriesFunc categoriesFunc = tree->categoriesFunc;
+	return (categoriesFunc ? categoriesFunc(obj) : CP_ALL_CATEGORIES);
+}
+
+// Queries that aren't filtered by category pass a mask of 0.
+static inline bool
+CategoriesMatch(cpBitmask categories, cpBitmask mask)
+{
+	return ((categories & mask) || !mask);
+}
+
 static inline cpBBTree *
 GetTree(cpSpatialIndex *index)
 {
@@ -275,6 +317,7 @@ NodeNew(cpBBTree *tree, Node *a, Node *b)
 	
 	node->obj = NULL;
 	node->bb = cpBBMerge(a->bb, b->bb);
+	node->categories = (a->categories | b->categories);
 	node->parent = NULL;
 	
 	NodeSetA(node, a);
@@ -311,6 +354,7 @@ NodeReplaceChild(Node *parent, Node *child, Node *value, cpBBTree *tree)
 	
 	for(Node *node=parent; node; node = node->parent){
 		node->bb = cpBBMerge(node->A->bb, node->B->bb);
+		node->categories = (node->A->categories | node->B->categories);
 	}
 }
 
@@ -322,6 +366,19 @@ cpBBProximity(cpBB a, cpBB b)
 	return cpfabs(a.l + a.r - b.l - b.r) + cpfabs(a.b + a.t - b.b - b.t);
 }
 
+// The 2D equivalent of surface area is the perimeter, which unlike the area doesn't vanish for thin shapes like segments.
+static inline cpFloat
+cpBBHalfPerimeter(cpBB bb)
+{
+	return (bb.r - bb.l) + (bb.t - bb.b);
+}
+
+static inline cpFloat
+cpBBMergedHalfPerimeter(cpBB a, cpBB b)
+{
+	return (cpfmax(a.r, b.r) - cpfmin(a.l, b.l)) + (cpfmax(a.t, b.t) - cpfmin(a.b, b.b));
+}
+
 static Node *
 SubtreeInsert(Node *subtree, Node *leaf, cpBBTree *tree)
 {
@@ -345,39 +402,45 @@ SubtreeInsert(Node *subtree, Node *leaf, cpBBTree *tree)
 		}
 		
 		subtree->bb = cpBBMerge(subtree->bb, leaf->bb);
+		subtree->categories |= leaf->categories;
 		return subtree;
 	}
 }
 
 static void
-SubtreeQuery(Node *subtree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+SubtreeQuery(Node *subtree, void *obj, cpBB bb, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(cpBBIntersects(subtree->bb, bb)){
+	if(cpBBIntersects(subtree->bb, bb) && CategoriesMatch(subtree->categories, mask)){
 		if(NodeIsLeaf(subtree)){
 			func(obj, subtree->obj, 0, data);
 		} else {
-			SubtreeQuery(subtree->A, obj, bb, func, data);
-			SubtreeQuery(subtree->B, obj, bb, func, data);
+			SubtreeQuery(subtree->A, obj, bb, mask, func, data);
+			SubtreeQuery(subtree->B, obj, bb, mask, func, data);
 		}
 	}
 }
 
+static inline cpFloat
+NodeSegmentQuery(Node *node, cpVect a, cpVect b, cpBitmask mask)
+{
+	return (CategoriesMatch(node->categories, mask) ? cpBBSegmentQuery(node->bb, a, b) : INFINITY);
+}
 
 static cpFloat
-SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	if(NodeIsLeaf(subtree)){
 		return func(obj, subtree->obj, data);
 	} else {
-		cpFloat t_a = cpBBSegmentQuery(subtree->A->bb, a, b);
-		cpFloat t_b = cpBBSegmentQuery(subtree->B->bb, a, b);
+		cpFloat t_a = NodeSegmentQuery(subtree->A, a, b, mask);
+		cpFloat t_b = NodeSegmentQuery(subtree->B, a, b, mask);
 		
 		if(t_a < t_b){
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, mask, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, mask, func, data));
 		} else {
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, mask, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, mask, func, data));
 		}
 		
 		return t_exit;
@@ -413,11 +476,185 @@ SubtreeRemove(Node *subtree, Node *leaf, cpBBTree *tree)
 	}
 }
 
+//MARK: Tree Rotations
+
+// Swap two nodes from different branches of the tree and refit their new parents.
+static void
+NodeSwap(Node *x, Node *y)
+{
+	Node *px = x->parent, *py = y->parent;
+	
+	if(px->A == x) NodeSetA(px, y); else NodeSetB(px, y);
+	if(py->A == y) NodeSetA(py, x); else NodeSetB(py, x);
+	
+	// py is either a child of px or on another branch, so refit it first.
+	py->bb = cpBBMerge(py->A->bb, py->B->bb);
+	py->categories = (py->A->categories | py->B->categories);
+	px->bb = cpBBMerge(px->A->bb, px->B->bb);
+	px->categories = (px->A->categories | px->B->categories);
+}
+
+// Swap a child of the node with one of its grandchildren, or two of its grandchildren,
+// if it makes the children's bounds smaller. The node's own bounds are left unchanged.
+// Based on "Fast, Effective BVH Updates for Animated Scenes" by Kopta et al.
+static void
+NodeRotate(Node *node)
+{
+	Node *a = node->A, *b = node->B;
+	cpFloat bestGain = 0.0f;
+	Node *x = NULL, *y = NULL;
+	
+	if(!NodeIsLeaf(b)){
+		cpFloat cost = cpBBHalfPerimeter(b->bb);
+		cpFloat gain_a = cost - cpBBMergedHalfPerimeter(a->bb, b->B->bb);
+		cpFloat gain_b = cost - cpBBMergedHalfPerimeter(a->bb, b->A->bb);
+		
+		if(gain_a > bestGain){bestGain = gain_a; x = a; y = b->A;}
+		if(gain_b > bestGain){bestGain = gain_b; x = a; y = b->B;}
+	}
+	
+	if(!NodeIsLeaf(a)){
+		cpFloat cost = cpBBHalfPerimeter(a->bb);
+		cpFloat gain_a = cost - cpBBMergedHalfPerimeter(b->bb, a->B->bb);
+		cpFloat gain_b = cost - cpBBMergedHalfPerimeter(b->bb, a->A->bb);
+		
+		if(gain_a > bestGain){bestGain = gain_a; x = b; y = a->A;}
+		if(gain_b > bestGain){bestGain = gain_b; x = b; y = a->B;}
+	}
+	
+	if(!NodeIsLeaf(a) && !NodeIsLeaf(b)){
+		cpFloat cost = cpBBHalfPerimeter(a->bb) + cpBBHalfPerimeter(b->bb);
+		cpFloat gain_a = cost - cpBBMergedHalfPerimeter(b->A->bb, a->B->bb) - cpBBMergedHalfPerimeter(a->A->bb, b->B->bb);
+		cpFloat gain_b = cost - cpBBMergedHalfPerimeter(b->B->bb, a->B->bb) - cpBBMergedHalfPerimeter(b->A->bb, a->A->bb);
+		
+		if(gain_a > bestGain){bestGain = gain_a; x = a->A; y = b->A;}
+		if(gain_b > bestGain){bestGain = gain_b; x = a->A; y = b->B;}
+	}
+	
+	if(x) NodeSwap(x, y);
+}
+
+// Only the nodes closest to a reinserted leaf are rotated.
+// That's where nearly all of the benefit is, and it keeps the cost of each update bounded.
+#define ROTATION_DEPTH 5
+
+// Insert a leaf and then rotate the nodes above it to keep the tree from degrading as leaves move.
+static void
+TreeInsertLeaf(cpBBTree *tree, Node *leaf)
+{
+	tree->root = SubtreeInsert(tree->root, leaf, tree);
+	
+	Node *node = leaf->parent;
+	for(int i=0; node && i<ROTATION_DEPTH; i++, node = node->parent) NodeRotate(node);
+}
+
+//MARK: Flattened Trees
+
+static void
+SubtreeFlatten(Node *subtree, cpBBTree *tree, int *leafCount)
+{
+	int index = tree->flatCount++;
+	tree->flatNodes[index].bb = subtree->bb;
+	tree->flatNodes[index].categories = subtree->categories;
+	
+	if(NodeIsLeaf(subtree)){
+		tree->flatLeaves[*leafCount] = subtree;
+		tree->flatNodes[index].skip = ~(*leafCount)++;
+	} else {
+		SubtreeFlatten(subtree->A, tree, leafCount);
+		SubtreeFlatten(subtree->B, tree, leafCount);
+		tree->flatNodes[index].skip = tree->flatCount;
+	}
+}
+
+static void
+TreeFlatten(cpBBTree *tree)
+{
+	tree->flatCount = 0;
+	if(!tree->root) return;
+	
+	int leafCount = cpHashSetCount(tree->leaves);
+	int capacity = 2*leafCount - 1;
+	if(tree->flatCapacity < capacity){
+		tree->flatCapacity = capacity;
+		tree->flatNodes = (FlatNode *)cprealloc(tree->flatNodes, capacity*sizeof(FlatNode));
+		tree->flatLeaves = (Node **)cprealloc(tree->flatLeaves, leafCount*sizeof(Node *));
+	}
+	
+	leafCount = 0;
+	SubtreeFlatten(tree->root, tree, &leafCount);
+}
+
+// Must be called whenever the structure of the tree or the bounds of a leaf changes.
+static inline void
+TreeInvalidateFlat(cpBBTree *tree)
+{
+	tree->flatCount = 0;
+}
+
+static inline int
+FlatNext(FlatNode *nodes, int index)
+{
+	int skip = nodes[index].skip;
+	return (skip < 0 ? index + 1 : skip);
+}
+
+static void
+FlatQuery(cpBBTree *tree, void *obj, cpBB bb, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data)
+{
+	FlatNode *nodes = tree->flatNodes;
+	Node **leaves = tree->flatLeaves;
+	int count = tree->flatCount;
+	
+	for(int i=0; i<count;){
+		FlatNode *node = nodes + i;
+		
+		if(cpBBIntersects(node->bb, bb) && CategoriesMatch(node->categories, mask)){
+			if(node->skip < 0) func(obj, leaves[~node->skip]->obj, 0, data);
+			i++;
+		} else {
+			i = FlatNext(nodes, i);
+		}
+	}
+}
+
+static inline cpFloat
+FlatNodeSegmentQuery(FlatNode *node, cpVect a, cpVect b, cpBitmask mask)
+{
+	return (CategoriesMatch(node->categories, mask) ? cpBBSegmentQuery(node->bb, a, b) : INFINITY);
+}
+
+static cpFloat
+FlatSegmentQuery(cpBBTree *tree, int index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	FlatNode *nodes = tree->flatNodes;
+	int skip = nodes[index].skip;
+	
+	if(skip < 0){
+		return func(obj, tree->flatLeaves[~skip]->obj, data);
+	} else {
+		int index_a = index + 1;
+		int index_b = FlatNext(nodes, index_a);
+		cpFloat t_a = FlatNodeSegmentQuery(nodes + index_a, a, b, mask);
+		cpFloat t_b = FlatNodeSegmentQuery(nodes + index_b, a, b, mask);
+		
+		if(t_a < t_b){
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, FlatSegmentQuery(tree, index_a, obj, a, b, t_exit, mask, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, FlatSegmentQuery(tree, index_b, obj, a, b, t_exit, mask, func, data));
+		} else {
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, FlatSegmentQuery(tree, index_b, obj, a, b, t_exit, mask, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, FlatSegmentQuery(tree, index_a, obj, a, b, t_exit, mask, func, data));
+		}
+		
+		return t_exit;
+	}
+}
+
 //MARK: Marking Functions
 
 typedef struct MarkContext {
 	cpBBTree *tree;
-	Node *staticRoot;
+	cpBBTree *staticTree;
 	cpSpatialIndexQueryFunc func;
 	void *data;
 } MarkContext;
@@ -440,13 +677,53 @@ MarkLeafQuery(Node *subtree, Node *leaf, bool left, MarkContext *context)
 	}
 }
 
+// Same as MarkLeafQuery(), but walks the flattened copy of a tree.
+static void
+FlatMarkLeafQuery(cpBBTree *queryTree, Node *leaf, bool left, MarkContext *context)
+{
+	FlatNode *nodes = queryTree->flatNodes;
+	Node **leaves = queryTree->flatLeaves;
+	int count = queryTree->flatCount;
+	
+	for(int i=0; i<count;){
+		FlatNode *node = nodes + i;
+		
+		if(cpBBIntersects(leaf->bb, node->bb)){
+			if(node->skip < 0){
+				Node *subtree = leaves[~node->skip];
+				
+				if(left){
+					PairInsert(leaf, subtree, context->tree);
+				} else {
+					if(subtree->STAMP < leaf->STAMP) PairInsert(subtree, leaf, context->tree);
+					context->func(leaf->obj, subtree->obj, 0, context->data);
+				}
+			}
+			
+			i++;
+		} else {
+			i = FlatNext(nodes, i);
+		}
+	}
+}
+
+static inline void
+TreeMarkLeafQuery(cpBBTree *queryTree, Node *leaf, bool left, MarkContext *context)
+{
+	if(queryTree->flatCount){
+		FlatMarkLeafQuery(queryTree, leaf, left, context);
+	} else if(queryTree->root){
+		MarkLeafQuery(queryTree->root, leaf, left, context);
+	}
+}
+
 static void
 MarkLeaf(Node *leaf, MarkContext *context)
 {
 	cpBBTree *tree = context->tree;
 	if(leaf->STAMP == GetMasterTree(tree)->stamp){
-		Node *staticRoot = context->staticRoot;
-		if(staticRoot) MarkLeafQuery(staticRoot, leaf, false, context);
+		cpBBTree *staticTree = context->staticTree;
+		if(staticTree) TreeMarkLeafQuery(staticTree, leaf, false, context);
 		
 		for(Node *node = leaf; node->parent; node = node->parent){
 			if(node == node->parent->A){
@@ -487,6 +764,7 @@ LeafNew(cpBBTree *tree, void *obj, cpBB bb)
 	Node *node = NodeFromPool(tree);
 	node->obj = obj;
 	node->bb = GetBB(tree, obj);
+	node->categories = GetCategories(tree, obj);
 	
 	node->parent = NULL;
 	node->STAMP = 0;
@@ -503,9 +781,10 @@ LeafUpdate(Node *leaf, cpBBTree *tree)
 	
 	if(!cpBBContainsBB(leaf->bb, bb)){
 		leaf->bb = GetBB(tree, leaf->obj);
+		TreeInvalidateFlat(tree);
 		
-		root = SubtreeRemove(root, leaf, tree);
-		tree->root = SubtreeInsert(root, leaf, tree);
+		tree->root = SubtreeRemove(root, leaf, tree);
+		TreeInsertLeaf(tree, leaf);
 		
 		PairsClear(leaf, tree);
 		leaf->STAMP = GetMasterTree(tree)->stamp;
@@ -523,15 +802,13 @@ LeafAddPairs(Node *leaf, cpBBTree *tree)
 {
 	cpSpatialIndex *dynamicIndex = tree->spatialIndex.dynamicIndex;
 	if(dynamicIndex){
-		Node *dynamicRoot = GetRootIfTree(dynamicIndex);
-		if(dynamicRoot){
-			cpBBTree *dynamicTree = GetTree(dynamicIndex);
+		cpBBTree *dynamicTree = GetTree(dynamicIndex);
+		if(dynamicTree){
 			MarkContext context = {dynamicTree, NULL, NULL, NULL};
-			MarkLeafQuery(dynamicRoot, leaf, true, &context);
+			TreeMarkLeafQuery(dynamicTree, leaf, true, &context);
 		}
 	} else {
-		Node *staticRoot = GetRootIfTree(tree->spatialIndex.staticIndex);
-		MarkContext context = {tree, staticRoot, VoidQueryFunc, NULL};
+		MarkContext context = {tree, GetTree(tree->spatialIndex.staticIndex), VoidQueryFunc, NULL};
 		MarkLeaf(leaf, &context);
 	}
 }
@@ -562,6 +839,7 @@ cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *static
 	cpSpatialIndexInit((cpSpatialIndex *)tree, Klass(), bbfunc, staticIndex);
 	
 	tree->velocityFunc = NULL;
+	tree->categoriesFunc = NULL;
 	
 	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
 	tree->root = NULL;
@@ -570,6 +848,12 @@ cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *static
 	tree->allocatedBuffers = cpArrayNew(0);
 	
 	tree->stamp = 0;
+	OptimizeCursor cursor = {0, 0, true};
+	tree->optimizeCursor = cursor;
+	
+	tree->flatNodes = NULL;
+	tree->flatLeaves = NULL;
+	tree->flatCount = tree->flatCapacity = 0;
 	
 	return (cpSpatialIndex *)tree;
 }
@@ -585,6 +869,60 @@ cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func)
 	((cpBBTree *)index)->velocityFunc = func;
 }
 
+static void
+LeafUpdateCategories(Node *leaf, cpBBTree *tree)
+{
+	leaf->categories = GetCategories(tree, leaf->obj);
+}
+
+static cpBitmask
+SubtreeRefitCategories(Node *subtree)
+{
+	if(!NodeIsLeaf(subtree)){
+		subtree->categories = (SubtreeRefitCategories(subtree->A) | SubtreeRefitCategories(subtree->B));
+	}
+	
+	return subtree->categories;
+}
+
+void
+cpBBTreeSetCategoriesFunc(cpSpatialIndex *index, cpBBTreeCategoriesFunc func)
+{
+	cpBBTree *tree = GetTree(index);
+	if(!tree){
+		cpAssertWarn(false, "Ignoring cpBBTreeSetCategoriesFunc() call to non-tree spatial index.");
+		return;
+	}
+	
+	tree->categoriesFunc = func;
+	
+	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)LeafUpdateCategories, tree);
+	if(tree->root) SubtreeRefitCategories(tree->root);
+	if(tree->flatCount) TreeFlatten(tree);
+}
+
+bool
+cpSpatialIndexIsBBTree(cpSpatialIndex *index)
+{
+	return (GetTree(index) != NULL);
+}
+
+void
+cpBBTreeUpdateCategories(cpSpatialIndex *index, void *obj, cpHashValue hashid)
+{
+	cpBBTree *tree = GetTree(index);
+	Node *leaf = (tree ? (Node *)cpHashSetFind(tree->leaves, hashid, obj) : NULL);
+	if(!leaf) return;
+	
+	LeafUpdateCategories(leaf, tree);
+	for(Node *node = leaf->parent; node; node = node->parent){
+		node->categories = (node->A->categories | node->B->categories);
+	}
+	
+	// This can be called from a query callback, but the layout of the flattened nodes can't change so it's safe to rewrite them.
+	if(tree->flatCount) TreeFlatten(tree);
+}
+
 cpSpatialIndex *
 cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
 {
@@ -598,6 +936,9 @@ cpBBTreeDestroy(cpBBTree *tree)
 	
 	if(tree->allocatedBuffers) cpArrayFreeEach(tree->allocatedBuffers, cpfree);
 	cpArrayFree(tree->allocatedBuffers);
+	
+	cpfree(tree->flatNodes);
+	cpfree(tree->flatLeaves);
 }
 
 //MARK: Insert/Remove
@@ -607,8 +948,8 @@ cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
 {
 	Node *leaf = (Node *)cpHashSetInsert(tree->leaves, hashid, obj, (cpHashSetTransFunc)leafSetTrans, tree);
 	
-	Node *root = tree->root;
-	tree->root = SubtreeInsert(root, leaf, tree);
+	TreeInsertLeaf(tree, leaf);
+	TreeInvalidateFlat(tree);
 	
 	leaf->STAMP = GetMasterTree(tree)->stamp;
 	LeafAddPairs(leaf, tree);
@@ -621,6 +962,7 @@ cpBBTreeRemove(cpBBTree *tree, void *obj, cpHashValue hashid)
 	Node *leaf = (Node *)cpHashSetRemove(tree->leaves, hashid, obj);
 	
 	tree->root = SubtreeRemove(tree->root, leaf, tree);
+	TreeInvalidateFlat(tree);
 	PairsClear(leaf, tree);
 	NodeRecycle(tree, leaf);
 }
@@ -644,11 +986,11 @@ cpBBTreeReindexQuery(cpBBTree *tree, cpSpatialIndexQueryFunc func, void *data)
 	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
 	
 	cpSpatialIndex *staticIndex = tree->spatialIndex.staticIndex;
-	Node *staticRoot = (staticIndex && staticIndex->klass == Klass() ? ((cpBBTree *)staticIndex)->root : NULL);
+	cpBBTree *staticTree = GetTree(staticIndex);
 	
-	MarkContext context = {tree, staticRoot, func, data};
+	MarkContext context = {tree, staticTree, func, data};
 	MarkSubtree(tree->root, &context);
-	if(staticIndex && !staticRoot) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
+	if(staticIndex && !staticTree) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
 	
 	IncrementStamp(tree);
 }
@@ -672,16 +1014,226 @@ cpBBTreeReindexObject(cpBBTree *tree, void *obj, cpHashValue hashid)
 //MARK: Query
 
 static void
-cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+TreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	Node *root = tree->root;
-	if(root) SubtreeSegmentQuery(root, obj, a, b, t_exit, func, data);
+	if(tree->flatCount){
+		if(CategoriesMatch(tree->flatNodes[0].categories, mask)) FlatSegmentQuery(tree, 0, obj, a, b, t_exit, mask, func, data);
+	} else if(root){
+		if(CategoriesMatch(root->categories, mask)) SubtreeSegmentQuery(root, obj, a, b, t_exit, mask, func, data);
+	}
+}
+
+static void
+TreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(tree->flatCount){
+		FlatQuery(tree, obj, bb, mask, func, data);
+	} else if(tree->root){
+		SubtreeQuery(tree->root, obj, bb, mask, func, data);
+	}
+}
+
+static void
+cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	TreeSegmentQuery(tree, obj, a, b, t_exit, 0, func, data);
 }
 
 static void
 cpBBTreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(tree->root) SubtreeQuery(tree->root, obj, bb, func, data);
+	TreeQuery(tree, obj, bb, 0, func, data);
+}
+
+void
+cpBBTreeMaskedQuery(cpSpatialIndex *index, void *obj, cpBB bb, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data)
+{
+	cpBBTree *tree = GetTree(index);
+	if(tree){
+		if(mask) TreeQuery(tree, obj, bb, mask, func, data);
+	} else {
+		cpSpatialIndexQuery(index, obj, bb, func, data);
+	}
+}
+
+void
+cpBBTreeMaskedSegmentQuery(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	cpBBTree *tree = GetTree(index);
+	if(tree){
+		if(mask) TreeSegmentQuery(tree, obj, a, b, t_exit, mask, func, data);
+	} else {
+		cpSpatialIndexSegmentQuery(index, obj, a, b, t_exit, func, data);
+	}
+}
+
+//MARK: Segment Packets
+
+typedef struct SegmentPacket {
+	const cpVect *a, *b;
+	cpFloat *t_exit;
+	cpBitmask mask;
+	cpBBTreePacketQueryFunc func;
+	void *data;
+} SegmentPacket;
+
+// Index of the lowest set bit.
+static inline int
+LowestBit(unsigned int bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(bits);
+#else
+	int i = 0;
+	while(!(bits&1)){bits >>= 1; i++;}
+	return i;
+#endif
+}
+
+// Returns the active segments that hit the bounding box before their exit time.
+static inline unsigned int
+PacketFilter(SegmentPacket *packet, cpBB bb, cpBitmask categories, unsigned int active)
+{
+	if(!CategoriesMatch(categories, packet->mask)) return 0;
+	
+	unsigned int hits = 0;
+	for(unsigned int bits = active; bits; bits &= bits - 1){
+		int i = LowestBit(bits);
+		if(cpBBSegmentQuery(bb, packet->a[i], packet->b[i]) < packet->t_exit[i]) hits |= 1u<<i;
+	}
+	
+	return hits;
+}
+
+// Finds the active segments that hit each of two sibling nodes.
+// Returns the segments that should visit the second node first.
+static inline unsigned int
+PacketTest(SegmentPacket *packet, cpBB bb_a, cpBitmask categories_a, cpBB bb_b, cpBitmask categories_b, unsigned int active, unsigned int *hits_a, unsigned int *hits_b)
+{
+	bool match_a = CategoriesMatch(categories_a, packet->mask);
+	bool match_b = CategoriesMatch(categories_b, packet->mask);
+	
+	unsigned int b_first = 0;
+	(*hits_a) = (*hits_b) = 0;
+	
+	for(unsigned int bits = active; bits; bits &= bits - 1){
+		int i = LowestBit(bits);
+		cpFloat t_exit = packet->t_exit[i];
+		cpFloat t_a = (match_a ? cpBBSegmentQuery(bb_a, packet->a[i], packet->b[i]) : INFINITY);
+		cpFloat t_b = (match_b ? cpBBSegmentQuery(bb_b, packet->a[i], packet->b[i]) : INFINITY);
+		
+		if(t_a < t_exit) (*hits_a) |= 1u<<i;
+		if(t_b < t_exit) (*hits_b) |= 1u<<i;
+		if(!(t_a < t_b)) b_first |= 1u<<i;
+	}
+	
+	return b_first;
+}
+
+static inline void
+PacketLeaf(SegmentPacket *packet, void *obj, unsigned int active)
+{
+	for(unsigned int bits = active; bits; bits &= bits - 1){
+		int i = LowestBit(bits);
+		packet->t_exit[i] = cpfmin(packet->t_exit[i], packet->func(i, obj, packet->data));
+	}
+}
+
+// Each segment visits the children in the same order as SubtreeSegmentQuery() would, so it finds the same hits.
+// Segments that visit the first child first go first. Then the second child is visited by the segments that either reach it first,
+// or still reach it after visiting the first child. Lastly, the remaining segments visit the first child.
+static void
+SubtreeSegmentPacket(Node *subtree, SegmentPacket *packet, unsigned int active)
+{
+	if(NodeIsLeaf(subtree)){
+		PacketLeaf(packet, subtree->obj, active);
+	} else {
+		Node *a = subtree->A, *b = subtree->B;
+		unsigned int hits_a, hits_b;
+		unsigned int b_first = PacketTest(packet, a->bb, a->categories, b->bb, b->categories, active, &hits_a, &hits_b);
+		
+		unsigned int visit_a = hits_a & ~b_first;
+		if(visit_a) SubtreeSegmentPacket(a, packet, visit_a);
+		
+		unsigned int visit_b = (hits_b & ~visit_a) | PacketFilter(packet, b->bb, b->categories, hits_b & visit_a);
+		if(visit_b) SubtreeSegmentPacket(b, packet, visit_b);
+		
+		unsigned int late_a = hits_a & b_first;
+		late_a = (late_a & ~visit_b) | PacketFilter(packet, a->bb, a->categories, late_a & visit_b);
+		if(late_a) SubtreeSegmentPacket(a, packet, late_a);
+	}
+}
+
+// Same as SubtreeSegmentPacket(), but walks the flattened copy of the tree.
+static void
+FlatSegmentPacket(cpBBTree *tree, int index, SegmentPacket *packet, unsigned int active)
+{
+	FlatNode *nodes = tree->flatNodes;
+	int skip = nodes[index].skip;
+	
+	if(skip < 0){
+		PacketLeaf(packet, tree->flatLeaves[~skip]->obj, active);
+	} else {
+		int index_a = index + 1, index_b = FlatNext(nodes, index_a);
+		FlatNode *a = nodes + index_a, *b = nodes + index_b;
+		unsigned int hits_a, hits_b;
+		unsigned int b_first = PacketTest(packet, a->bb, a->categories, b->bb, b->categories, active, &hits_a, &hits_b);
+		
+		unsigned int visit_a = hits_a & ~b_first;
+		if(visit_a) FlatSegmentPacket(tree, index_a, packet, visit_a);
+		
+		unsigned int visit_b = (hits_b & ~visit_a) | PacketFilter(packet, b->bb, b->categories, hits_b & visit_a);
+		if(visit_b) FlatSegmentPacket(tree, index_b, packet, visit_b);
+		
+		unsigned int late_a = hits_a & b_first;
+		late_a = (late_a & ~visit_b) | PacketFilter(packet, a->bb, a->categories, late_a & visit_b);
+		if(late_a) FlatSegmentPacket(tree, index_a, packet, late_a);
+	}
+}
+
+typedef struct PacketFallbackContext {
+	int ray;
+	cpFloat *t_exit;
+	cpBBTreePacketQueryFunc func;
+	void *data;
+} PacketFallbackContext;
+
+static cpFloat
+PacketFallbackQuery(PacketFallbackContext *context, void *obj, void *unused)
+{
+	cpFloat t = context->func(context->ray, obj, context->data);
+	(*context->t_exit) = cpfmin(*context->t_exit, t);
+	return t;
+}
+
+void
+cpBBTreeSegmentQueryPacket(cpSpatialIndex *index, const cpVect *a, const cpVect *b, cpFloat *t_exit, int count, cpBitmask mask, cpBBTreePacketQueryFunc func, void *data)
+{
+	cpAssertHard(0 <= count && count <= CP_BBTREE_PACKET_SIZE, "Too many segments for a packet.");
+	
+	cpBBTree *tree = GetTree(index);
+	if(!tree){
+		for(int i=0; i<count; i++){
+			PacketFallbackContext context = {i, t_exit + i, func, data};
+			cpSpatialIndexSegmentQuery(index, &context, a[i], b[i], t_exit[i], (cpSpatialIndexSegmentQueryFunc)PacketFallbackQuery, NULL);
+		}
+		
+		return;
+	}
+	
+	if(!mask || count == 0) return;
+	
+	SegmentPacket packet = {a, b, t_exit, mask, func, data};
+	unsigned int active = (count < (int)(8*sizeof(unsigned int)) ? (1u<<count) - 1 : ~0u);
+	
+	if(tree->flatCount){
+		active = PacketFilter(&packet, tree->flatNodes[0].bb, tree->flatNodes[0].categories, active);
+		if(active) FlatSegmentPacket(tree, 0, &packet, active);
+	} else if(tree->root){
+		active = PacketFilter(&packet, tree->root->bb, tree->root->categories, active);
+		if(active) SubtreeSegmentPacket(tree->root, &packet, active);
+	}
 }
 
 //MARK: Misc
@@ -729,17 +1281,34 @@ static inline cpSpatialIndexClass *Klass(void){return &klass;}
 
 //MARK: Tree Optimization
 
-static int
-cpfcompare(const cpFloat *a, const cpFloat *b){
-	return (*a < *b ? -1 : (*b < *a ? 1 : 0));
-}
-
 static void
 fillNodeArray(Node *node, Node ***cursor){
 	(**cursor) = node;
 	(*cursor)++;
 }
 
+// The trees are built using a binned surface area heuristic.
+#define SAH_BINS 16
+
+static inline cpFloat
+NodeCenter(Node *node, int axis)
+{
+	// Doubled to save a multiply, only the relative positions matter.
+	return (axis ? node->bb.b + node->bb.t : node->bb.l + node->bb.r);
+}
+
+static inline int
+BinIndex(cpFloat center, cpFloat min, cpFloat scale)
+{
+	int bin = (int)((center - min)*scale);
+	return (bin < SAH_BINS ? bin : SAH_BINS - 1);
+}
+
+typedef struct SAHBin {
+	cpBB bb;
+	int count;
+} SAHBin;
+
 static Node *
 partitionNodes(cpBBTree *tree, Node **nodes, int count)
 {
@@ -749,55 +1318,88 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 		return NodeNew(tree, nodes[0], nodes[1]);
 	}
 	
-	// Find the AABB for these nodes
-	cpBB bb = nodes[0]->bb;
-	for(int i=1; i<count; i++) bb = cpBBMerge(bb, nodes[i]->bb);
+	// Find the bounds of the node centers.
+	cpFloat min[2], max[2];
+	for(int axis=0; axis<2; axis++){
+		min[axis] = max[axis] = NodeCenter(nodes[0], axis);
+		
+		for(int i=1; i<count; i++){
+			cpFloat center = NodeCenter(nodes[i], axis);
+			min[axis] = cpfmin(min[axis], center);
+			max[axis] = cpfmax(max[axis], center);
+		}
+	}
 	
-	// Split it on it's longest axis
-	bool splitWidth = (bb.r - bb.l > bb.t - bb.b);
+	// Bin the nodes along each axis and find the split between bins with the lowest cost.
+	cpFloat bestCost = INFINITY;
+	int bestAxis = -1, bestSplit = 0;
 	
-	// Sort the bounds and use the median as the splitting point
-	cpFloat *bounds = (cpFloat *)cpcalloc(count*2, sizeof(cpFloat));
-	if(splitWidth){
+	for(int axis=0; axis<2; axis++){
+		if(max[axis] <= min[axis]) continue;
+		cpFloat scale = SAH_BINS/(max[axis] - min[axis]);
+		
+		SAHBin bins[SAH_BINS];
+		for(int i=0; i<SAH_BINS; i++) bins[i].count = 0;
+		
 		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.l;
-			bounds[2*i + 1] = nodes[i]->bb.r;
+			Node *node = nodes[i];
+			SAHBin *bin = bins + BinIndex(NodeCenter(node, axis), min[axis], scale);
+			bin->bb = (bin->count ? cpBBMerge(bin->bb, node->bb) : node->bb);
+			bin->count++;
 		}
-	} else {
-		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.b;
-			bounds[2*i + 1] = nodes[i]->bb.t;
+		
+		// Sweep from the right to find the cost of everything right of each split.
+		cpFloat rightCost[SAH_BINS];
+		cpBB bb = bins[SAH_BINS - 1].bb;
+		int n = 0;
+		
+		for(int i=SAH_BINS - 1; i>0; i--){
+			if(bins[i].count){
+				bb = (n ? cpBBMerge(bb, bins[i].bb) : bins[i].bb);
+				n += bins[i].count;
+			}
+			
+			rightCost[i] = (n ? cpBBHalfPerimeter(bb)*n : 0.0f);
+		}
+		
+		// Then sweep from the left to add the cost of the left side.
+		n = 0;
+		for(int i=0; i<SAH_BINS - 1; i++){
+			if(bins[i].count){
+				bb = (n ? cpBBMerge(bb, bins[i].bb) : bins[i].bb);
+				n += bins[i].count;
+			}
+			
+			if(0 < n && n < count){
+				cpFloat cost = cpBBHalfPerimeter(bb)*n + rightCost[i + 1];
+				if(cost < bestCost){
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i + 1;
+				}
+			}
 		}
 	}
 	
-	qsort(bounds, count*2, sizeof(cpFloat), (int (*)(const void *, const void *))cpfcompare);
-	cpFloat split = (bounds[count - 1] + bounds[count])*0.5f; // use the medain as the split
-	cpfree(bounds);
-
-	// Generate the child BBs
-	cpBB a = bb, b = bb;
-	if(splitWidth) a.r = b.l = split; else a.t = b.b = split;
-	
-	// Partition the nodes
 	int right = count;
-	for(int left=0; left < right;){
-		Node *node = nodes[left];
-		if(cpBBMergedArea(node->bb, b) < cpBBMergedArea(node->bb, a)){
-//		if(cpBBProximity(node->bb, b) < cpBBProximity(node->bb, a)){
-			right--;
-			nodes[left] = nodes[right];
-			nodes[right] = node;
-		} else {
-			left++;
+	if(bestAxis < 0){
+		// All of the nodes have the same center, so split them in half.
+		right = count/2;
+	} else {
+		cpFloat scale = SAH_BINS/(max[bestAxis] - min[bestAxis]);
+		
+		for(int left=0; left < right;){
+			Node *node = nodes[left];
+			if(BinIndex(NodeCenter(node, bestAxis), min[bestAxis], scale) >= bestSplit){
+				right--;
+				nodes[left] = nodes[right];
+				nodes[right] = node;
+			} else {
+				left++;
+			}
 		}
 	}
 	
-	if(right == count){
-		Node *node = NULL;
-		for(int i=0; i<count; i++) node = SubtreeInsert(node, nodes[i], tree);
-		return node;
-	}
-	
 	// Recurse and build the node!
 	return NodeNew(tree,
 		partitionNodes(tree, nodes, right),
@@ -805,25 +1407,6 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 	);
 }
 
-//static void
-//cpBBTreeOptimizeIncremental(cpBBTree *tree, int passes)
-//{
-//	for(int i=0; i<passes; i++){
-//		Node *root = tree->root;
-//		Node *node = root;
-//		int bit = 0;
-//		unsigned int path = tree->opath;
-//		
-//		while(!NodeIsLeaf(node)){
-//			node = (path&(1<<bit) ? node->a : node->b);
-//			bit = (bit + 1)&(sizeof(unsigned int)*8 - 1);
-//		}
-//		
-//		root = subtreeRemove(root, node, tree);
-//		tree->root = subtreeInsert(root, node, tree);
-//	}
-//}
-
 void
 cpBBTreeOptimize(cpSpatialIndex *index)
 {
@@ -845,6 +1428,277 @@ cpBBTreeOptimize(cpSpatialIndex *index)
 	SubtreeRecycle(tree, root);
 	tree->root = partitionNodes(tree, nodes, count);
 	cpfree(nodes);
+	
+	// Compact the new tree so queries don't have to chase pointers.
+	TreeFlatten(tree);
+}
+
+// Count the leaves in a subtree, giving up once there are more than max.
+static int
+SubtreeCountLeaves(Node *subtree, int max)
+{
+	if(NodeIsLeaf(subtree)) return 1;
+	
+	int count = SubtreeCountLeaves(subtree->A, max);
+	return (count > max ? count : count + SubtreeCountLeaves(subtree->B, max - count));
+}
+
+// Gather the nodes at the given depth, or leaves above it, and recycle the nodes above them.
+static void
+SubtreeTakeFrontier(cpBBTree *tree, Node *subtree, int depth, Node ***cursor)
+{
+	if(depth == 0 || NodeIsLeaf(subtree)){
+		fillNodeArray(subtree, cursor);
+	} else {
+		SubtreeTakeFrontier(tree, subtree->A, depth - 1, cursor);
+		SubtreeTakeFrontier(tree, subtree->B, depth - 1, cursor);
+		NodeRecycle(tree, subtree);
+	}
+}
+
+// Rebuild the nodes of a subtree above the given depth.
+static void
+SubtreeRebuild(cpBBTree *tree, Node *subtree, int depth, int count)
+{
+	Node *parent = subtree->parent;
+	bool isA = (parent && parent->A == subtree);
+	
+	Node **nodes = (Node **)cpcalloc(count, sizeof(Node *));
+	Node **cursor = nodes;
+	SubtreeTakeFrontier(tree, subtree, depth, &cursor);
+	
+	Node *value = partitionNodes(tree, nodes, (int)(cursor - nodes));
+	cpfree(nodes);
+	
+	if(!parent){
+		tree->root = value;
+		value->parent = NULL;
+	} else if(isA){
+		NodeSetA(parent, value);
+	} else {
+		NodeSetB(parent, value);
+	}
+}
+
+#define OPTIMIZE_MAX_DEPTH 31
+
+// Each pass of the incremental optimizer visits every node at the cursor's depth in order, rebuilding either the whole subtree under it,
+// or the top of the subtree if it's too big. Those "treelets" are rebuilt using their lower nodes as if they were leaves.
+// Treelets from consecutive passes overlap by half, so leaves can move between subtrees until it reaches the bottom of the tree.
+bool
+cpBBTreeOptimizeIncremental(cpSpatialIndex *index, int budget)
+{
+	if(index->klass != &klass){
+		cpAssertWarn(false, "Ignoring cpBBTreeOptimizeIncremental() call to non-tree spatial index.");
+		return true;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	if(!tree->root) return true;
+	
+	if(budget < 2) budget = 2;
+	TreeInvalidateFlat(tree);
+	
+	// Depth of the treelets that fit in the budget, and how far to move down between passes.
+	int treeletDepth = 1;
+	while((2<<treeletDepth) <= budget && treeletDepth < OPTIMIZE_MAX_DEPTH) treeletDepth++;
+	int stride = (treeletDepth > 1 ? treeletDepth/2 : 1);
+	
+	OptimizeCursor *cursor = &tree->optimizeCursor;
+	
+	for(int work = 0; work < budget;){
+		// Follow the cursor's path down to the next node. Bit n of the path chooses the child at depth n.
+		unsigned int path = cursor->path;
+		Node *node = tree->root;
+		int depth = 0;
+		
+		while(depth < cursor->depth && !NodeIsLeaf(node)){
+			node = ((path>>depth)&1 ? node->B : node->A);
+			depth++;
+		}
+		
+		if(NodeIsLeaf(node)){
+			work++;
+		} else {
+			int count = SubtreeCountLeaves(node, budget);
+			if(count <= budget){
+				SubtreeRebuild(tree, node, OPTIMIZE_MAX_DEPTH, count);
+				work += count;
+			} else {
+				SubtreeRebuild(tree, node, treeletDepth, 1<<treeletDepth);
+				work += budget;
+				
+				// There is more of the tree left under this node for the next pass.
+				cursor->finished = false;
+			}
+		}
+		
+		// Advance the path to the next node in depth first order.
+		int bit = depth - 1;
+		while(bit >= 0 && (path>>bit)&1) bit--;
+		
+		if(bit >= 0){
+			cursor->path = (path & ((1u<<bit) - 1)) | (1u<<bit);
+		} else {
+			// Finished a pass. Move down for the next one, or start over if this one reached the bottom of the tree.
+			bool finished = (cursor->finished || cursor->depth + stride > OPTIMIZE_MAX_DEPTH);
+			
+			cursor->path = 0;
+			cursor->depth = (finished ? 0 : cursor->depth + stride);
+			cursor->finished = true;
+			
+			if(finished) return true;
+		}
+	}
+	
+	return false;
+}
+
+static cpFloat
+SubtreeCost(Node *subtree)
+{
+	cpFloat cost = cpBBHalfPerimeter(subtree->bb);
+	if(!NodeIsLeaf(subtree)) cost += SubtreeCost(subtree->A) + SubtreeCost(subtree->B);
+	
+	return cost;
+}
+
+cpFloat
+cpBBTreeQueryCost(cpSpatialIndex *index)
+{
+	if(index->klass != &klass){
+		cpAssertWarn(false, "Ignoring cpBBTreeQueryCost() call to non-tree spatial index.");
+		return 0.0f;
+	}
+	
+	Node *root = ((cpBBTree *)index)->root;
+	if(!root) return 0.0f;
+	
+	cpFloat perimeter = cpBBHalfPerimeter(root->bb);
+	return (perimeter > 0.0f ? SubtreeCost(root)/perimeter : 0.0f);
+}
+
+//MARK: Snapshots
+
+static void
+SubtreeSnapshot(Node *subtree, cpSnapshotWriter *writer)
+{
+	cpSnapshotWriteObject(writer, subtree, sizeof(Node));
+	
+	if(!NodeIsLeaf(subtree)){
+		SubtreeSnapshot(subtree->A, writer);
+		SubtreeSnapshot(subtree->B, writer);
+	}
+}
+
+// Pairs are only ever created with a dynamic leaf as b, so each one is visited once from its b leaf.
+static void
+PairsSnapshot(Node *leaf, cpSnapshotWriter *writer)
+{
+	for(Pair *pair = leaf->PAIRS; pair;){
+		if(leaf == pair->b.leaf){
+			cpSnapshotWriteObject(writer, pair, sizeof(Pair));
+			pair = pair->b.next;
+		} else {
+			pair = pair->a.next;
+		}
+	}
+}
+
+void
+cpBBTreeSnapshot(cpSpatialIndex *index, cpSnapshotWriter *writer)
+{
+	cpBBTree *tree = GetTree(index);
+	cpAssertHard(tree, "Snapshots are only supported by the bounding box tree spatial index.");
+	
+	cpSnapshotWrite(writer, &tree->root, sizeof(tree->root));
+	cpSnapshotWrite(writer, &tree->stamp, sizeof(tree->stamp));
+	cpSnapshotWrite(writer, &tree->optimizeCursor, sizeof(tree->optimizeCursor));
+	cpHashSetSnapshot(tree->leaves, writer);
+	
+	if(tree->root) SubtreeSnapshot(tree->root, writer);
+	cpSnapshotEndList(writer);
+	
+	// The pairs are owned by the master tree.
+	if(GetMasterTree(tree) == tree) cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)PairsSnapshot, writer);
+	cpSnapshotEndList(writer);
+}
+
+static void
+SubtreeGather(Node *subtree, cpArray *nodes)
+{
+	cpArrayPush(nodes, subtree);
+	
+	if(!NodeIsLeaf(subtree)){
+		SubtreeGather(subtree->A, nodes);
+		SubtreeGather(subtree->B, nodes);
+	}
+}
+
+static void
+PairsGather(Node *leaf, cpArray *pairs)
+{
+	for(Pair *pair = leaf->PAIRS; pair;){
+		if(leaf == pair->b.leaf){
+			cpArrayPush(pairs, pair);
+			pair = pair->b.next;
+		} else {
+			pair = pair->a.next;
+		}
+	}
+}
+
+static Node RestoreMark;
+
+void
+cpBBTreeRestore(cpSpatialIndex *index, cpSnapshotReader *reader, cpArray *scratch)
+{
+	cpBBTree *tree = GetTree(index);
+	cpAssertHard(tree, "Snapshots are only supported by the bounding box tree spatial index.");
+	bool ownsPairs = (GetMasterTree(tree) == tree);
+	
+	// Gather every node and pair, used or pooled, before anything is overwritten.
+	scratch->num = 0;
+	if(tree->root) SubtreeGather(tree->root, scratch);
+	for(Node *node = tree->pooledNodes; node; node = node->parent) cpArrayPush(scratch, node);
+	int nodeCount = scratch->num;
+	
+	if(ownsPairs){
+		cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)PairsGather, scratch);
+		for(Pair *pair = tree->pooledPairs; pair; pair = pair->a.next) cpArrayPush(scratch, pair);
+	}
+	
+	cpSnapshotRead(reader, &tree->root, sizeof(tree->root));
+	cpSnapshotRead(reader, &tree->stamp, sizeof(tree->stamp));
+	cpSnapshotRead(reader, &tree->optimizeCursor, sizeof(tree->optimizeCursor));
+	cpHashSetRestore(tree->leaves, reader);
+	
+	// Mark the nodes and pairs in the snapshot and put all of the others back in the pools.
+	cpSnapshotReader nodes = *reader;
+	for(Node *node; (node = (Node *)cpSnapshotNextObject(reader, NULL));) node->parent = &RestoreMark;
+	
+	cpSnapshotReader pairs = *reader;
+	for(Pair *pair; (pair = (Pair *)cpSnapshotNextObject(reader, NULL));) pair->a.leaf = &RestoreMark;
+	
+	tree->pooledNodes = NULL;
+	for(int i=0; i<nodeCount; i++){
+		Node *node = (Node *)scratch->arr[i];
+		if(node->parent != &RestoreMark) NodeRecycle(tree, node);
+	}
+	
+	if(ownsPairs){
+		tree->pooledPairs = NULL;
+		for(int i=nodeCount; i<scratch->num; i++){
+			Pair *pair = (Pair *)scratch->arr[i];
+			if(pair->a.leaf != &RestoreMark) PairRecycle(tree, pair);
+		}
+	}
+	
+	while(cpSnapshotRestoreObject(&nodes));
+	while(cpSnapshotRestoreObject(&pairs));
+	
+	// Keep the tree flattened if it was before.
+	if(tree->flatCount) TreeFlatten(tree);
 }
 
 //MARK: Debug Draw
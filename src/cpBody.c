@@ -45,6 +45,11 @@ cpBodyInit(cpBody *body, cpFloat mass, cpFloat moment)
 	body->sleeping.next = NULL;
 	body->sleeping.idleTime = 0.0f;
 	
+	body->bullet.enabled = false;
+	body->bullet.p = cpvzero;
+	body->bullet.a = 0.0f;
+	body->bullet.toi = 1.0f;
+	
 	body->p = cpvzero;
 	body->v = cpvzero;
 	body->f = cpvzero;
@@ -244,6 +249,33 @@ cpBodyGetSpace(const cpBody *body)
 	return body->space;
 }
 
+bool
+cpBodyIsBullet(const cpBody *body)
+{
+	return body->bullet.enabled;
+}
+
+void
+cpBodySetBullet(cpBody *body, bool bullet)
+{
+	if(body->bullet.enabled == bullet) return;
+	body->bullet.enabled = bullet;
+	
+	// If the body is added to a space already, the space's list of bullets needs to be updated.
+	cpSpace *space = cpBodyGetSpace(body);
+	if(space != NULL){
+		cpAssertSpaceUnlocked(space);
+		
+		if(bullet){
+			cpArrayPush(space->bulletBodies, body);
+		} else {
+			cpArrayDeleteObj(space->bulletBodies, body);
+		}
+		
+		space->topologyStamp++;
+	}
+}
+
 cpFloat
 cpBodyGetMass(const cpBody *body)
 {
@@ -344,18 +376,24 @@ cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint)
 }
 
 // 'p' is the position of the CoG
-static void
-SetTransform(cpBody *body, cpVect p, cpFloat a)
+static inline cpTransform
+BodyTransform(const cpBody *body, cpVect p, cpFloat a)
 {
 	cpVect rot = cpvforangle(a);
 	cpVect c = body->cog;
 	
-	body->transform = cpTransformNewTranspose(
+	return cpTransformNewTranspose(
 		rot.x, -rot.y, p.x - (c.x*rot.x - c.y*rot.y),
 		rot.y,  rot.x, p.y - (c.x*rot.y + c.y*rot.x)
 	);
 }
 
+static void
+SetTransform(cpBody *body, cpVect p, cpFloat a)
+{
+	body->transform = BodyTransform(body, p, a);
+}
+
 static inline cpFloat
 SetAngle(cpBody *body, cpFloat a)
 {
@@ -521,6 +559,29 @@ cpBodyUpdatePosition(cpBody *body, cpFloat dt)
 	cpAssertSaneBody(body);
 }
 
+void
+cpBodyBeginSweep(cpBody *body)
+{
+	body->bullet.p = body->p;
+	body->bullet.a = body->a;
+	body->bullet.toi = 1.0f;
+}
+
+cpTransform
+cpBodyGetSweepTransform(const cpBody *body, cpFloat t)
+{
+	cpFloat a = body->bullet.a + (body->a - body->bullet.a)*t;
+	return BodyTransform(body, cpvlerp(body->bullet.p, body->p, t), a);
+}
+
+void
+cpBodyRewindSweep(cpBody *body, cpFloat t)
+{
+	cpVect p = body->p = cpvlerp(body->bullet.p, body->p, t);
+	cpFloat a = SetAngle(body, body->bullet.a + (body->a - body->bullet.a)*t);
+	SetTransform(body, p, a);
+}
+
 cpVect
 cpBodyLocalToWorld(const cpBody *body, const cpVect point)
 {
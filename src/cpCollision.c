@@ -477,7 +477,8 @@ GJK(const struct SupportContext *ctx, cpCollisionID *id)
 static inline void
 ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPoints points, struct cpCollisionInfo *info)
 {
-	cpFloat mindist = e1.r + e2.r;
+	cpFloat margin = info->margin;
+	cpFloat mindist = e1.r + e2.r + margin;
 	if(points.d <= mindist){
 #ifdef DRAW_CLIP
 	ChipmunkDebugDrawFatSegment(e1.a.p, e1.b.p, e1.r, RGBAColor(0, 1, 0, 1), LAColor(0, 0));
@@ -501,7 +502,7 @@ ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPo
 			cpVect p1 = cpvadd(cpvmult(n,  e1.r), cpvlerp(e1.a.p, e1.b.p, cpfclamp01((d_e2_b - d_e1_a)*e1_denom)));
 			cpVect p2 = cpvadd(cpvmult(n, -e2.r), cpvlerp(e2.a.p, e2.b.p, cpfclamp01((d_e1_a - d_e2_a)*e2_denom)));
 			cpFloat dist = cpvdot(cpvsub(p2, p1), n);
-			if(dist <= 0.0f){
+			if(dist <= margin){
 				cpHashValue hash_1a2b = CP_HASH_PAIR(e1.a.hash, e2.b.hash);
 				cpCollisionInfoPushContact(info, p1, p2, hash_1a2b);
 			}
@@ -509,7 +510,7 @@ ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPo
 			cpVect p1 = cpvadd(cpvmult(n,  e1.r), cpvlerp(e1.a.p, e1.b.p, cpfclamp01((d_e2_a - d_e1_a)*e1_denom)));
 			cpVect p2 = cpvadd(cpvmult(n, -e2.r), cpvlerp(e2.a.p, e2.b.p, cpfclamp01((d_e1_b - d_e2_a)*e2_denom)));
 			cpFloat dist = cpvdot(cpvsub(p2, p1), n);
-			if(dist <= 0.0f){
+			if(dist <= margin){
 				cpHashValue hash_1b2a = CP_HASH_PAIR(e1.b.hash, e2.a.hash);
 				cpCollisionInfoPushContact(info, p1, p2, hash_1b2a);
 			}
@@ -525,7 +526,7 @@ typedef void (*CollisionFunc)(const cpShape *a, const cpShape *b, struct cpColli
 static void
 CircleToCircle(const cpCircleShape *c1, const cpCircleShape *c2, struct cpCollisionInfo *info)
 {
-	cpFloat mindist = c1->r + c2->r;
+	cpFloat mindist = c1->r + c2->r + info->margin;
 	cpVect delta = cpvsub(c2->tc, c1->tc);
 	cpFloat distsq = cpvlengthsq(delta);
 	
@@ -549,7 +550,7 @@ CircleToSegment(const cpCircleShape *circle, const cpSegmentShape *segment, stru
 	cpVect closest = cpvadd(seg_a, cpvmult(seg_delta, closest_t));
 	
 	// Compare the radii of the two shapes to see if they are colliding.
-	cpFloat mindist = circle->r + segment->r;
+	cpFloat mindist = circle->r + segment->r + info->margin;
 	cpVect delta = cpvsub(closest, center);
 	cpFloat distsq = cpvlengthsq(delta);
 	if(distsq < mindist*mindist){
@@ -591,7 +592,7 @@ SegmentToSegment(const cpSegmentShape *seg1, const cpSegmentShape *seg2, struct
 	
 	// If the closest points are nearer than the sum of the radii...
 	if(
-		points.d <= (seg1->r + seg2->r) && (
+		points.d <= seg1->r + seg2->r + info->margin && (
 			// Reject endcap collisions if tangents are provided.
 			(!cpveql(points.a, seg1->ta) || cpvdot(n, cpvrotate(seg1->a_tangent, rot1)) <= 0.0) &&
 			(!cpveql(points.a, seg1->tb) || cpvdot(n, cpvrotate(seg1->b_tangent, rot1)) <= 0.0) &&
@@ -621,7 +622,7 @@ PolyToPoly(const cpPolyShape *poly1, const cpPolyShape *poly2, struct cpCollisio
 #endif
 	
 	// If the closest points are nearer than the sum of the radii...
-	if(points.d - poly1->r - poly2->r <= 0.0){
+	if(points.d - poly1->r - poly2->r <= info->margin){
 		ContactPoints(SupportEdgeForPoly(poly1, points.n), SupportEdgeForPoly(poly2, cpvneg(points.n)), points, info);
 	}
 }
@@ -648,7 +649,7 @@ SegmentToPoly(const cpSegmentShape *seg, const cpPolyShape *poly, struct cpColli
 	
 	if(
 		// If the closest points are nearer than the sum of the radii...
-		points.d - seg->r - poly->r <= 0.0 && (
+		points.d - seg->r - poly->r <= info->margin && (
 			// Reject endcap collisions if tangents are provided.
 			(!cpveql(points.a, seg->ta) || cpvdot(n, cpvrotate(seg->a_tangent, rot)) <= 0.0) &&
 			(!cpveql(points.a, seg->tb) || cpvdot(n, cpvrotate(seg->b_tangent, rot)) <= 0.0)
@@ -672,7 +673,7 @@ CircleToPoly(const cpCircleShape *circle, const cpPolyShape *poly, struct cpColl
 #endif
 	
 	// If the closest points are nearer than the sum of the radii...
-	if(points.d <= circle->r + poly->r){
+	if(points.d <= circle->r + poly->r + info->margin){
 		cpVect n = info->n = points.n;
 		cpCollisionInfoPushContact(info, cpvadd(points.a, cpvmult(n, circle->r)), cpvadd(points.b, cpvmult(n, -poly->r)), 0);
 	}
@@ -701,7 +702,7 @@ static const CollisionFunc *CollisionFuncs = BuiltinCollisionFuncs;
 struct cpCollisionInfo
 cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact *contacts)
 {
-	struct cpCollisionInfo info = {a, b, id, cpvzero, 0, contacts};
+	struct cpCollisionInfo info = {a, b, id, cpvzero, 0, contacts, 0.0f};
 	
 	// Make sure the shape types are in order.
 	if(a->klass->type > b->klass->type){
@@ -724,3 +725,242 @@ cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact
 	
 	return info;
 }
+
+//MARK: Distance Queries
+
+static inline cpFloat
+ShapeRadius(const cpShape *shape)
+{
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: return ((cpCircleShape *)shape)->r;
+		case CP_SEGMENT_SHAPE: return ((cpSegmentShape *)shape)->r;
+		case CP_POLY_SHAPE: return ((cpPolyShape *)shape)->r;
+		default: return 0.0f;
+	}
+}
+
+static const SupportPointFunc SupportPointFuncs[CP_NUM_SHAPES] = {
+	(SupportPointFunc)CircleSupportPoint,
+	(SupportPointFunc)SegmentSupportPoint,
+	(SupportPointFunc)PolySupportPoint,
+};
+
+cpFloat
+cpCollideDistance(const cpShape *a, const cpShape *b, cpCollisionID *id)
+{
+	// Make sure the shape types are in order.
+	if(a->klass->type > b->klass->type){
+		const cpShape *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	
+	// The minkowski difference of a circle and a circle or segment is degenerate, so find their closest points directly.
+	if(a->klass->type == CP_CIRCLE_SHAPE && b->klass->type != CP_POLY_SHAPE){
+		cpVect center = ((cpCircleShape *)a)->tc;
+		
+		cpVect closest;
+		if(b->klass->type == CP_CIRCLE_SHAPE){
+			closest = ((cpCircleShape *)b)->tc;
+		} else {
+			const cpSegmentShape *seg = (cpSegmentShape *)b;
+			closest = cpClosetPointOnSegment(center, seg->ta, seg->tb);
+		}
+		
+		return cpvdist(center, closest) - ShapeRadius(a) - ShapeRadius(b);
+	}
+	
+	struct SupportContext context = {a, b, SupportPointFuncs[a->klass->type], SupportPointFuncs[b->klass->type]};
+	struct ClosestPoints points = GJK(&context, id);
+	return points.d - ShapeRadius(a) - ShapeRadius(b);
+}
+
+//MARK: Batched Collision Functions
+
+// The circle to circle and circle to segment pairs are the most common and simplest to collide.
+// They are done several pairs at a time using SSE2, in exactly the same order as the scalar functions to give the same rounding.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define BATCH_SSE2 1
+	#include <emmintrin.h>
+	
+	#if CP_USE_DOUBLES
+		typedef __m128d batch_float;
+		#define BATCH_LANES 2
+		#define batch_load _mm_loadu_pd
+		#define batch_store _mm_storeu_pd
+		#define batch_set1 _mm_set1_pd
+		#define batch_add _mm_add_pd
+		#define batch_sub _mm_sub_pd
+		#define batch_mul _mm_mul_pd
+		#define batch_div _mm_div_pd
+		#define batch_sqrt _mm_sqrt_pd
+		#define batch_min _mm_min_pd
+		#define batch_max _mm_max_pd
+		#define batch_lt_mask(a, b) _mm_movemask_pd(_mm_cmplt_pd(a, b))
+	#else
+		typedef __m128 batch_float;
+		#define BATCH_LANES 4
+		#define batch_load _mm_loadu_ps
+		#define batch_store _mm_storeu_ps
+		#define batch_set1 _mm_set1_ps
+		#define batch_add _mm_add_ps
+		#define batch_sub _mm_sub_ps
+		#define batch_mul _mm_mul_ps
+		#define batch_div _mm_div_ps
+		#define batch_sqrt _mm_sqrt_ps
+		#define batch_min _mm_min_ps
+		#define batch_max _mm_max_ps
+		#define batch_lt_mask(a, b) _mm_movemask_ps(_mm_cmplt_ps(a, b))
+	#endif
+#endif
+
+static void
+CircleToCircleBatch(struct cpCollisionPair *pairs, const int *order, int count)
+{
+	int i = 0;
+	
+#if BATCH_SSE2
+	for(; i + BATCH_LANES <= count; i += BATCH_LANES){
+		cpFloat x1[BATCH_LANES], y1[BATCH_LANES], r1[BATCH_LANES];
+		cpFloat x2[BATCH_LANES], y2[BATCH_LANES], r2[BATCH_LANES], margin[BATCH_LANES];
+		for(int j=0; j<BATCH_LANES; j++){
+			const struct cpCollisionInfo *info = &pairs[order[i + j]].info;
+			const cpCircleShape *c1 = (cpCircleShape *)info->a, *c2 = (cpCircleShape *)info->b;
+			x1[j] = c1->tc.x; y1[j] = c1->tc.y; r1[j] = c1->r;
+			x2[j] = c2->tc.x; y2[j] = c2->tc.y; r2[j] = c2->r;
+			margin[j] = info->margin;
+		}
+		
+		batch_float mindist = batch_add(batch_add(batch_load(r1), batch_load(r2)), batch_load(margin));
+		batch_float delta_x = batch_sub(batch_load(x2), batch_load(x1));
+		batch_float delta_y = batch_sub(batch_load(y2), batch_load(y1));
+		batch_float distsq = batch_add(batch_mul(delta_x, delta_x), batch_mul(delta_y, delta_y));
+		
+		int hits = batch_lt_mask(distsq, batch_mul(mindist, mindist));
+		if(!hits) continue;
+		
+		batch_float dist = batch_sqrt(distsq);
+		batch_float inv = batch_div(batch_set1(1.0f), dist);
+		
+		cpFloat d[BATCH_LANES], n_x[BATCH_LANES], n_y[BATCH_LANES];
+		batch_store(d, dist);
+		batch_store(n_x, batch_mul(delta_x, inv));
+		batch_store(n_y, batch_mul(delta_y, inv));
+		
+		for(int j=0; j<BATCH_LANES; j++){
+			if(!(hits & (1 << j))) continue;
+			
+			struct cpCollisionInfo *info = &pairs[order[i + j]].info;
+			const cpCircleShape *c1 = (cpCircleShape *)info->a, *c2 = (cpCircleShape *)info->b;
+			cpVect n = info->n = (d[j] ? cpv(n_x[j], n_y[j]) : cpv(1.0f, 0.0f));
+			cpCollisionInfoPushContact(info, cpvadd(c1->tc, cpvmult(n, c1->r)), cpvadd(c2->tc, cpvmult(n, -c2->r)), 0);
+		}
+	}
+#endif
+	
+	for(; i<count; i++){
+		struct cpCollisionInfo *info = &pairs[order[i]].info;
+		CircleToCircle((cpCircleShape *)info->a, (cpCircleShape *)info->b, info);
+	}
+}
+
+static void
+CircleToSegmentBatch(struct cpCollisionPair *pairs, const int *order, int count)
+{
+	int i = 0;
+	
+#if BATCH_SSE2
+	for(; i + BATCH_LANES <= count; i += BATCH_LANES){
+		cpFloat center_x[BATCH_LANES], center_y[BATCH_LANES], circle_r[BATCH_LANES];
+		cpFloat a_x[BATCH_LANES], a_y[BATCH_LANES], b_x[BATCH_LANES], b_y[BATCH_LANES], segment_r[BATCH_LANES];
+		cpFloat margin[BATCH_LANES];
+		for(int j=0; j<BATCH_LANES; j++){
+			const struct cpCollisionInfo *info = &pairs[order[i + j]].info;
+			const cpCircleShape *circle = (cpCircleShape *)info->a;
+			const cpSegmentShape *segment = (cpSegmentShape *)info->b;
+			center_x[j] = circle->tc.x; center_y[j] = circle->tc.y; circle_r[j] = circle->r;
+			a_x[j] = segment->ta.x; a_y[j] = segment->ta.y;
+			b_x[j] = segment->tb.x; b_y[j] = segment->tb.y; segment_r[j] = segment->r;
+			margin[j] = info->margin;
+		}
+		
+		batch_float seg_ax = batch_load(a_x), seg_ay = batch_load(a_y);
+		batch_float cx = batch_load(center_x), cy = batch_load(center_y);
+		
+		// Find the closest point on the segment to the circle.
+		batch_float seg_dx = batch_sub(batch_load(b_x), seg_ax);
+		batch_float seg_dy = batch_sub(batch_load(b_y), seg_ay);
+		batch_float dot = batch_add(batch_mul(seg_dx, batch_sub(cx, seg_ax)), batch_mul(seg_dy, batch_sub(cy, seg_ay)));
+		batch_float lengthsq = batch_add(batch_mul(seg_dx, seg_dx), batch_mul(seg_dy, seg_dy));
+		batch_float t = batch_max(batch_set1(0.0f), batch_min(batch_div(dot, lengthsq), batch_set1(1.0f)));
+		batch_float closest_x = batch_add(seg_ax, batch_mul(seg_dx, t));
+		batch_float closest_y = batch_add(seg_ay, batch_mul(seg_dy, t));
+		
+		// Compare the radii of the two shapes to see if they are colliding.
+		batch_float mindist = batch_add(batch_add(batch_load(circle_r), batch_load(segment_r)), batch_load(margin));
+		batch_float delta_x = batch_sub(closest_x, cx);
+		batch_float delta_y = batch_sub(closest_y, cy);
+		batch_float distsq = batch_add(batch_mul(delta_x, delta_x), batch_mul(delta_y, delta_y));
+		
+		int hits = batch_lt_mask(distsq, batch_mul(mindist, mindist));
+		if(!hits) continue;
+		
+		batch_float dist = batch_sqrt(distsq);
+		batch_float inv = batch_div(batch_set1(1.0f), dist);
+		
+		cpFloat d[BATCH_LANES], n_x[BATCH_LANES], n_y[BATCH_LANES];
+		cpFloat closest_t[BATCH_LANES], p_x[BATCH_LANES], p_y[BATCH_LANES];
+		batch_store(d, dist);
+		batch_store(n_x, batch_mul(delta_x, inv));
+		batch_store(n_y, batch_mul(delta_y, inv));
+		batch_store(closest_t, t);
+		batch_store(p_x, closest_x);
+		batch_store(p_y, closest_y);
+		
+		// The endcap checks and contacts are rare enough to leave them scalar.
+		for(int j=0; j<BATCH_LANES; j++){
+			if(!(hits & (1 << j))) continue;
+			
+			struct cpCollisionInfo *info = &pairs[order[i + j]].info;
+			const cpCircleShape *circle = (cpCircleShape *)info->a;
+			const cpSegmentShape *segment = (cpSegmentShape *)info->b;
+			cpVect closest = cpv(p_x[j], p_y[j]);
+			cpVect n = info->n = (d[j] ? cpv(n_x[j], n_y[j]) : segment->tn);
+			
+			cpVect rot = cpBodyGetRotation(segment->shape.body);
+			if(
+				(closest_t[j] != 0.0f || cpvdot(n, cpvrotate(segment->a_tangent, rot)) >= 0.0) &&
+				(closest_t[j] != 1.0f || cpvdot(n, cpvrotate(segment->b_tangent, rot)) >= 0.0)
+			){
+				cpCollisionInfoPushContact(info, cpvadd(circle->tc, cpvmult(n, circle->r)), cpvadd(closest, cpvmult(n, -segment->r)), 0);
+			}
+		}
+	}
+#endif
+	
+	for(; i<count; i++){
+		struct cpCollisionInfo *info = &pairs[order[i]].info;
+		CircleToSegment((cpCircleShape *)info->a, (cpSegmentShape *)info->b, info);
+	}
+}
+
+void
+cpCollideBatch(struct cpCollisionPair *pairs, const int *order, int count)
+{
+	if(count == 0) return;
+	
+	const struct cpCollisionInfo *first = &pairs[order[0]].info;
+	int type = first->a->klass->type + first->b->klass->type*CP_NUM_SHAPES;
+	
+	if(type == CP_CIRCLE_SHAPE + CP_CIRCLE_SHAPE*CP_NUM_SHAPES){
+		CircleToCircleBatch(pairs, order, count);
+	} else if(type == CP_CIRCLE_SHAPE + CP_SEGMENT_SHAPE*CP_NUM_SHAPES){
+		CircleToSegmentBatch(pairs, order, count);
+	} else {
+		CollisionFunc func = CollisionFuncs[type];
+		for(int i=0; i<count; i++){
+			struct cpCollisionInfo *info = &pairs[order[i]].info;
+			func(info->a, info->b, info);
+		}
+	}
+}
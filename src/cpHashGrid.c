@@ -0,0 +1,644 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+// A hierarchy of spatial hash grids, with the cell size doubling at each level.
+// Each object is stored in exactly one cell, the one containing its center in the level whose cells are at least as large as it is.
+// Queries check each level that has objects in it, widening the range of cells by the size of the largest object in that level.
+// The cells are rebuilt from scratch and stored in an open addressed table, with the objects for each cell packed together in one array.
+// Objects added or changed after it was built are kept in a list until there are enough of them to make rebuilding worthwhile.
+
+#define HASH_GRID_MAX_LEVELS 24
+
+//MARK: Basic Structures
+
+typedef struct Handle {
+	void *obj;
+	cpHashValue hashid;
+	cpBB bb;
+	int level;
+	
+	// Index into the grid's entries if non-negative, or the bitwise complement of an index into the pending list.
+	int index;
+	struct Handle *next;
+} Handle;
+
+typedef struct Entry {
+	cpBB bb;
+	// NULL if the object was removed or changed since the grid was built.
+	void *obj;
+} Entry;
+
+typedef struct Cell {
+	int level, x, y;
+	
+	// The cell's entries, or an unused slot in the table if count is 0.
+	int start, count;
+} Cell;
+
+typedef struct Level {
+	cpFloat dim, inv;
+	// Largest distance an object in the level extends from its center, in either direction.
+	cpFloat reach;
+	
+	// The level's entries are stored together.
+	int start, count;
+} Level;
+
+struct cpHashGrid {
+	cpSpatialIndex spatialIndex;
+	
+	int levelCount;
+	Level levels[HASH_GRID_MAX_LEVELS];
+	
+	cpHashSet *handleSet;
+	Handle *pooledHandles;
+	cpArray *allocatedBuffers;
+	
+	// Open addressed with linear probing. The capacity is a power of two.
+	Cell *cells;
+	int cellCapacity;
+	
+	Entry *entries;
+	int entryCount, entryCapacity;
+	int removedCount;
+	
+	cpArray *pending;
+};
+
+//MARK: Handle Functions
+
+static void
+HandleRecycle(cpHashGrid *grid, Handle *hand)
+{
+	hand->next = grid->pooledHandles;
+	grid->pooledHandles = hand;
+}
+
+static Handle *
+HandleFromPool(cpHashGrid *grid)
+{
+	Handle *hand = grid->pooledHandles;
+	
+	if(hand){
+		grid->pooledHandles = hand->next;
+		return hand;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Handle);
+		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		
+		Handle *buffer = (Handle *)cpcalloc(1, CP_BUFFER_BYTES);
+		cpArrayPush(grid->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++) HandleRecycle(grid, buffer + i);
+		return buffer;
+	}
+}
+
+// Find the smallest level with cells at least as large as the bounding box.
+static void
+HandleUpdate(Handle *hand, cpHashGrid *grid)
+{
+	cpBB bb = grid->spatialIndex.bbfunc(hand->obj);
+	cpFloat size = cpfmax(bb.r - bb.l, bb.t - bb.b);
+	
+	int level = 0;
+	while(level < grid->levelCount - 1 && size > grid->levels[level].dim) level++;
+	
+	hand->bb = bb;
+	hand->level = level;
+}
+
+static int
+handleSetEql(void *obj, Handle *hand)
+{
+	return (obj == hand->obj);
+}
+
+typedef struct HandleContext {
+	cpHashGrid *grid;
+	cpHashValue hashid;
+} HandleContext;
+
+static void *
+handleSetTrans(void *obj, HandleContext *context)
+{
+	Handle *hand = HandleFromPool(context->grid);
+	hand->obj = obj;
+	hand->hashid = context->hashid;
+	hand->index = 0;
+	hand->next = NULL;
+	HandleUpdate(hand, context->grid);
+	
+	return hand;
+}
+
+static void
+PendingPush(cpHashGrid *grid, Handle *hand)
+{
+	hand->index = ~grid->pending->num;
+	cpArrayPush(grid->pending, hand);
+}
+
+// Take a handle out of the grid or the pending list.
+static void
+HandleDetach(cpHashGrid *grid, Handle *hand)
+{
+	if(hand->index >= 0){
+		grid->entries[hand->index].obj = NULL;
+		grid->removedCount++;
+	} else {
+		// Move the last pending handle into its place.
+		cpArray *pending = grid->pending;
+		Handle *last = (Handle *)pending->arr[--pending->num];
+		pending->arr[~hand->index] = last;
+		last->index = hand->index;
+	}
+}
+
+//MARK: Building
+
+// Much faster than (int)floor(f)
+// Profiling showed floor() to be a sizable performance hog
+static inline int
+floor_int(cpFloat f)
+{
+	int i = (int)f;
+	return (f < 0.0f && f != i ? i - 1 : i);
+}
+
+static inline cpHashValue
+CellHash(int level, int x, int y)
+{
+	return ((cpHashValue)x*1640531513ul ^ (cpHashValue)y*2654435789ul ^ (cpHashValue)level*2246822519ul);
+}
+
+static inline Cell *
+FindCell(cpHashGrid *grid, int level, int x, int y)
+{
+	cpHashValue mask = grid->cellCapacity - 1;
+	
+	for(cpHashValue i = CellHash(level, x, y);; i++){
+		Cell *cell = grid->cells + (i&mask);
+		if(cell->count == 0) return NULL;
+		if(cell->x == x && cell->y == y && cell->level == level) return cell;
+	}
+}
+
+// Find the cell, or claim an unused slot for it.
+static inline Cell *
+ClaimCell(cpHashGrid *grid, int level, int x, int y)
+{
+	cpHashValue mask = grid->cellCapacity - 1;
+	
+	for(cpHashValue i = CellHash(level, x, y);; i++){
+		Cell *cell = grid->cells + (i&mask);
+		
+		if(cell->count == 0){
+			cell->level = level;
+			cell->x = x;
+			cell->y = y;
+			cell->start = -1;
+			return cell;
+		} else if(cell->x == x && cell->y == y && cell->level == level){
+			return cell;
+		}
+	}
+}
+
+static void
+GatherHandle(Handle *hand, Handle ***cursor)
+{
+	(**cursor) = hand;
+	(*cursor)++;
+}
+
+static void
+Rebuild(cpHashGrid *grid)
+{
+	int count = cpHashSetCount(grid->handleSet);
+	
+	grid->entryCount = count;
+	grid->removedCount = 0;
+	grid->pending->num = 0;
+	
+	if(grid->entryCapacity < count){
+		grid->entryCapacity = count;
+		grid->entries = (Entry *)cprealloc(grid->entries, count*sizeof(Entry));
+	}
+	
+	// Keep the table at most half full.
+	int capacity = 16;
+	while(capacity < 2*count) capacity *= 2;
+	
+	if(grid->cellCapacity != capacity){
+		cpfree(grid->cells);
+		grid->cellCapacity = capacity;
+		grid->cells = (Cell *)cpcalloc(capacity, sizeof(Cell));
+	} else {
+		memset(grid->cells, 0, capacity*sizeof(Cell));
+	}
+	
+	Level *levels = grid->levels;
+	for(int i=0; i<grid->levelCount; i++){
+		levels[i].reach = 0.0f;
+		levels[i].count = 0;
+	}
+	
+	if(count == 0) return;
+	
+	Handle **handles = (Handle **)cpcalloc(count, sizeof(Handle *));
+	Cell **handleCells = (Cell **)cpcalloc(count, sizeof(Cell *));
+	
+	Handle **cursor = handles;
+	cpHashSetEach(grid->handleSet, (cpHashSetIteratorFunc)GatherHandle, &cursor);
+	
+	// Count the objects in each cell and level.
+	for(int i=0; i<count; i++){
+		Handle *hand = handles[i];
+		cpBB bb = hand->bb;
+		Level *level = levels + hand->level;
+		
+		level->reach = cpfmax(level->reach, 0.5f*cpfmax(bb.r - bb.l, bb.t - bb.b));
+		level->count++;
+		
+		int x = floor_int(0.5f*(bb.l + bb.r)*level->inv);
+		int y = floor_int(0.5f*(bb.b + bb.t)*level->inv);
+		Cell *cell = ClaimCell(grid, hand->level, x, y);
+		cell->count++;
+		handleCells[i] = cell;
+	}
+	
+	int levelStarts[HASH_GRID_MAX_LEVELS];
+	for(int i=0, start=0; i<grid->levelCount; i++){
+		levels[i].start = levelStarts[i] = start;
+		start += levels[i].count;
+	}
+	
+	// Give each cell a range of entries within its level, then fill them in from the end.
+	for(int i=0; i<count; i++){
+		Handle *hand = handles[i];
+		Cell *cell = handleCells[i];
+		
+		if(cell->start < 0){
+			cell->start = levelStarts[hand->level] += cell->count;
+		}
+		
+		int index = --cell->start;
+		Entry entry = {hand->bb, hand->obj};
+		grid->entries[index] = entry;
+		hand->index = index;
+	}
+	
+	cpfree(handles);
+	cpfree(handleCells);
+}
+
+// Rebuild once enough of the grid is out of date that checking the pending list and skipping removed entries becomes a significant cost.
+static void
+RebuildIfNeeded(cpHashGrid *grid)
+{
+	int stale = grid->pending->num + grid->removedCount;
+	if(stale > 16 + grid->entryCount/8) Rebuild(grid);
+}
+
+//MARK: Memory Management Functions
+
+cpHashGrid *
+cpHashGridAlloc(void)
+{
+	return (cpHashGrid *)cpcalloc(1, sizeof(cpHashGrid));
+}
+
+cpSpatialIndex *
+cpHashGridInit(cpHashGrid *grid, cpFloat celldim, int levels, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpAssertHard(celldim > 0.0f, "Cell dimensions must be positive.");
+	cpSpatialIndexInit((cpSpatialIndex *)grid, Klass(), bbfunc, staticIndex);
+	
+	grid->levelCount = (levels < 1 ? 1 : (levels > HASH_GRID_MAX_LEVELS ? HASH_GRID_MAX_LEVELS : levels));
+	for(int i=0; i<grid->levelCount; i++){
+		Level *level = grid->levels + i;
+		level->dim = celldim;
+		level->inv = 1.0f/celldim;
+		level->reach = 0.0f;
+		level->start = level->count = 0;
+		
+		celldim *= 2.0f;
+	}
+	
+	grid->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql);
+	grid->pooledHandles = NULL;
+	grid->allocatedBuffers = cpArrayNew(0);
+	
+	grid->cells = NULL;
+	grid->cellCapacity = 0;
+	
+	grid->entries = NULL;
+	grid->entryCount = grid->entryCapacity = 0;
+	grid->removedCount = 0;
+	
+	grid->pending = cpArrayNew(0);
+	
+	return (cpSpatialIndex *)grid;
+}
+
+cpSpatialIndex *
+cpHashGridNew(cpFloat celldim, int levels, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpHashGridInit(cpHashGridAlloc(), celldim, levels, bbfunc, staticIndex);
+}
+
+static void
+cpHashGridDestroy(cpHashGrid *grid)
+{
+	cpHashSetFree(grid->handleSet);
+	
+	if(grid->allocatedBuffers) cpArrayFreeEach(grid->allocatedBuffers, cpfree);
+	cpArrayFree(grid->allocatedBuffers);
+	
+	cpfree(grid->cells);
+	cpfree(grid->entries);
+	cpArrayFree(grid->pending);
+}
+
+//MARK: Misc
+
+static int
+cpHashGridCount(cpHashGrid *grid)
+{
+	return cpHashSetCount(grid->handleSet);
+}
+
+typedef struct eachContext {
+	cpSpatialIndexIteratorFunc func;
+	void *data;
+} eachContext;
+
+static void each_helper(Handle *hand, eachContext *context){context->func(hand->obj, context->data);}
+
+static void
+cpHashGridEach(cpHashGrid *grid, cpSpatialIndexIteratorFunc func, void *data)
+{
+	eachContext context = {func, data};
+	cpHashSetEach(grid->handleSet, (cpHashSetIteratorFunc)each_helper, &context);
+}
+
+static int
+cpHashGridContains(cpHashGrid *grid, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(grid->handleSet, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpHashGridInsert(cpHashGrid *grid, void *obj, cpHashValue hashid)
+{
+	HandleContext context = {grid, hashid};
+	Handle *hand = (Handle *)cpHashSetInsert(grid->handleSet, hashid, obj, (cpHashSetTransFunc)handleSetTrans, &context);
+	PendingPush(grid, hand);
+	
+	RebuildIfNeeded(grid);
+}
+
+static void
+cpHashGridRemove(cpHashGrid *grid, void *obj, cpHashValue hashid)
+{
+	Handle *hand = (Handle *)cpHashSetRemove(grid->handleSet, hashid, obj);
+	if(hand){
+		HandleDetach(grid, hand);
+		HandleRecycle(grid, hand);
+		
+		RebuildIfNeeded(grid);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpHashGridReindex(cpHashGrid *grid)
+{
+	cpHashSetEach(grid->handleSet, (cpHashSetIteratorFunc)HandleUpdate, grid);
+	Rebuild(grid);
+}
+
+static void
+cpHashGridReindexObject(cpHashGrid *grid, void *obj, cpHashValue hashid)
+{
+	Handle *hand = (Handle *)cpHashSetFind(grid->handleSet, hashid, obj);
+	if(hand){
+		HandleUpdate(hand, grid);
+		
+		if(hand->index >= 0){
+			HandleDetach(grid, hand);
+			PendingPush(grid, hand);
+			
+			RebuildIfNeeded(grid);
+		}
+	}
+}
+
+//MARK: Query Functions
+
+// Query the entries in a level, skipping entries before minEntry.
+static void
+LevelQuery(cpHashGrid *grid, Level *level, void *obj, cpBB bb, int minEntry, cpSpatialIndexQueryFunc func, void *data)
+{
+	Entry *entries = grid->entries;
+	cpFloat inv = level->inv, reach = level->reach;
+	
+	cpFloat l = cpffloor((bb.l - reach)*inv), r = cpffloor((bb.r + reach)*inv);
+	cpFloat b = cpffloor((bb.b - reach)*inv), t = cpffloor((bb.t + reach)*inv);
+	
+	if((r - l + 1.0f)*(t - b + 1.0f) > level->count){
+		// Cheaper to check every entry in the level than to look up the cells.
+		int start = level->start, end = start + level->count;
+		for(int i=(start > minEntry ? start : minEntry); i<end; i++){
+			Entry *entry = entries + i;
+			if(entry->obj && cpBBIntersects(entry->bb, bb)) func(obj, entry->obj, 0, data);
+		}
+	} else {
+		int level_index = (int)(level - grid->levels);
+		
+		for(int x=(int)l; x<=(int)r; x++){
+			for(int y=(int)b; y<=(int)t; y++){
+				Cell *cell = FindCell(grid, level_index, x, y);
+				if(!cell) continue;
+				
+				for(int i=cell->start, end=i + cell->count; i<end; i++){
+					Entry *entry = entries + i;
+					if(i >= minEntry && entry->obj && cpBBIntersects(entry->bb, bb)) func(obj, entry->obj, 0, data);
+				}
+			}
+		}
+	}
+}
+
+static void
+cpHashGridQuery(cpHashGrid *grid, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	for(int i=0; i<grid->levelCount; i++){
+		Level *level = grid->levels + i;
+		if(level->count) LevelQuery(grid, level, obj, bb, 0, func, data);
+	}
+	
+	cpArray *pending = grid->pending;
+	for(int i=0; i<pending->num; i++){
+		Handle *hand = (Handle *)pending->arr[i];
+		if(cpBBIntersects(hand->bb, bb)) func(obj, hand->obj, 0, data);
+	}
+}
+
+static inline cpFloat
+EntrySegmentQuery(Entry *entry, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(entry->obj && cpBBSegmentQuery(entry->bb, a, b) < t_exit){
+		return cpfmin(t_exit, func(obj, entry->obj, data));
+	} else {
+		return t_exit;
+	}
+}
+
+static cpFloat
+LevelSegmentQuery(cpHashGrid *grid, Level *level, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Entry *entries = grid->entries;
+	cpFloat dim = level->dim, inv = level->inv, reach = level->reach;
+	
+	cpFloat l = cpffloor((cpfmin(a.x, b.x) - reach)*inv), r = cpffloor((cpfmax(a.x, b.x) + reach)*inv);
+	cpFloat bottom = cpffloor((cpfmin(a.y, b.y) - reach)*inv), top = cpffloor((cpfmax(a.y, b.y) + reach)*inv);
+	
+	// Roughly the number of cells the walk below will check.
+	cpFloat cells = (r - l + 1.0f)*(2.0f + 2.0f*reach*inv) + (top - bottom + 1.0f);
+	
+	if(cells > level->count){
+		// Cheaper to check every entry in the level than to look up the cells.
+		for(int i=level->start, end=i + level->count; i<end; i++){
+			t_exit = EntrySegmentQuery(entries + i, obj, a, b, t_exit, func, data);
+		}
+		
+		return t_exit;
+	}
+	
+	int level_index = (int)(level - grid->levels);
+	cpFloat dx = b.x - a.x, dy = b.y - a.y;
+	int x_inc = (dx >= 0.0f ? 1 : -1), y_inc = (dy >= 0.0f ? 1 : -1);
+	
+	// Walk the columns in the direction of the segment, checking the rows the segment covers in each.
+	// The column's range is widened by the reach to find objects in neighboring cells.
+	int x_end = (int)(x_inc > 0 ? r : l) + x_inc;
+	for(int x=(int)(x_inc > 0 ? l : r); x != x_end; x += x_inc){
+		cpFloat y_min = cpfmin(a.y, b.y), y_max = cpfmax(a.y, b.y);
+		
+		if(dx != 0.0f){
+			cpFloat t0 = cpfclamp01((x*dim - reach - a.x)/dx);
+			cpFloat t1 = cpfclamp01(((x + 1)*dim + reach - a.x)/dx);
+			
+			// The rest of the columns are beyond the closest hit so far.
+			if(cpfmin(t0, t1) > t_exit) break;
+			
+			cpFloat y0 = a.y + dy*t0, y1 = a.y + dy*t1;
+			y_min = cpfmin(y0, y1);
+			y_max = cpfmax(y0, y1);
+		}
+		
+		int y_start = floor_int((y_inc > 0 ? y_min - reach : y_max + reach)*inv);
+		int y_stop = floor_int((y_inc > 0 ? y_max + reach : y_min - reach)*inv) + y_inc;
+		
+		for(int y=y_start; y != y_stop; y += y_inc){
+			Cell *cell = FindCell(grid, level_index, x, y);
+			if(!cell) continue;
+			
+			for(int i=cell->start, end=i + cell->count; i<end; i++){
+				t_exit = EntrySegmentQuery(entries + i, obj, a, b, t_exit, func, data);
+			}
+		}
+	}
+	
+	return t_exit;
+}
+
+static void
+cpHashGridSegmentQuery(cpHashGrid *grid, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	for(int i=0; i<grid->levelCount; i++){
+		Level *level = grid->levels + i;
+		if(level->count) t_exit = LevelSegmentQuery(grid, level, obj, a, b, t_exit, func, data);
+	}
+	
+	cpArray *pending = grid->pending;
+	for(int i=0; i<pending->num; i++){
+		Handle *hand = (Handle *)pending->arr[i];
+		if(cpBBSegmentQuery(hand->bb, a, b) < t_exit) t_exit = cpfmin(t_exit, func(obj, hand->obj, data));
+	}
+}
+
+//MARK: Reindex/Query
+
+static void
+cpHashGridReindexQuery(cpHashGrid *grid, cpSpatialIndexQueryFunc func, void *data)
+{
+	cpHashGridReindex(grid);
+	
+	// The levels are stored in order, so only checking the same or larger levels for later entries finds each pair once.
+	for(int i=0; i<grid->levelCount; i++){
+		Level *level = grid->levels + i;
+		
+		for(int j=level->start, end=j + level->count; j<end; j++){
+			Entry *entry = grid->entries + j;
+			
+			for(int k=i; k<grid->levelCount; k++){
+				Level *other = grid->levels + k;
+				if(other->count) LevelQuery(grid, other, entry->obj, entry->bb, j + 1, func, data);
+			}
+		}
+	}
+	
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)grid, grid->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpHashGridDestroy,
+	
+	(cpSpatialIndexCountImpl)cpHashGridCount,
+	(cpSpatialIndexEachImpl)cpHashGridEach,
+	(cpSpatialIndexContainsImpl)cpHashGridContains,
+	
+	(cpSpatialIndexInsertImpl)cpHashGridInsert,
+	(cpSpatialIndexRemoveImpl)cpHashGridRemove,
+	
+	(cpSpatialIndexReindexImpl)cpHashGridReindex,
+	(cpSpatialIndexReindexObjectImpl)cpHashGridReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpHashGridReindexQuery,
+	
+	(cpSpatialIndexQueryImpl)cpHashGridQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpHashGridSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(void){return &klass;}
@@ -19,130 +19,259 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
-#include "prime.h"
 
-typedef struct cpHashSetBin {
-	void *elt;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define CP_HASH_SET_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+// Open addressing hash set, laid out like a SwissTable.
+// Every slot has a control byte that is either empty, deleted, or holds 7 bits of the slot's hash as a tag.
+// Lookups compare a whole group of control bytes against the tag at once, and only call the eql func on matches.
+// The control bytes of the first group are mirrored after the end of the table so groups can wrap around.
+
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+typedef struct cpHashSetSlot {
 	cpHashValue hash;
-	struct cpHashSetBin *next;
-} cpHashSetBin;
+	void *elt;
+} cpHashSetSlot;
 
 struct cpHashSet {
-	unsigned int entries, size;
+	unsigned int entries, capacity;
+	
+	// How many more elements can be inserted before the table needs to be rebuilt.
+	// Deleted slots aren't reused until a probe passes over them, so they use it up too.
+	unsigned int growthLeft;
 	
 	cpHashSetEqlFunc eql;
 	void *default_value;
 	
-	cpHashSetBin **table;
-	cpHashSetBin *pooledBins;
-	
-	cpArray *allocatedBuffers;
+	uint8_t *ctrl;
+	cpHashSetSlot *slots;
 };
 
-void
-cpHashSetFree(cpHashSet *set)
+//MARK: Hashing and Groups
+
+// Pointers and sequential ids don't have many random bits, so scramble them.
+// The low bits pick the starting slot, and the top 7 bits are the tag.
+static inline cpHashValue
+MixHash(cpHashValue hash)
 {
-	if(set){
-		cpfree(set->table);
-		
-		cpArrayFreeEach(set->allocatedBuffers, cpfree);
-		cpArrayFree(set->allocatedBuffers);
-		
-		cpfree(set);
-	}
+	cpHashValue h = hash*(cpHashValue)0x9E3779B97F4A7C15ull;
+	return h ^ (h >> (4*sizeof(cpHashValue)));
 }
 
-cpHashSet *
-cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc)
+static inline uint8_t
+HashTag(cpHashValue h)
 {
-	cpHashSet *set = (cpHashSet *)cpcalloc(1, sizeof(cpHashSet));
-	
-	set->size = next_prime(size);
-	set->entries = 0;
-	
-	set->eql = eqlFunc;
-	set->default_value = NULL;
-	
-	set->table = (cpHashSetBin **)cpcalloc(set->size, sizeof(cpHashSetBin *));
-	set->pooledBins = NULL;
-	
-	set->allocatedBuffers = cpArrayNew(0);
-	
-	return set;
+	return (uint8_t)(h >> (8*sizeof(cpHashValue) - 7));
 }
 
-void
-cpHashSetSetDefaultValue(cpHashSet *set, void *default_value)
+static inline bool
+CtrlIsFull(uint8_t ctrl)
 {
-	set->default_value = default_value;
+	return (ctrl & 0x80) == 0;
 }
 
-static int
-setIsFull(cpHashSet *set)
+// Bitmask of the control bytes in the group that equal ctrl.
+static inline unsigned int
+GroupMatch(const uint8_t *group, uint8_t ctrl)
 {
-	return (set->entries >= set->size);
+#if CP_HASH_SET_SSE2
+	__m128i bytes = _mm_loadu_si128((const __m128i *)group);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)ctrl)));
+#else
+	unsigned int bits = 0;
+	for(int i=0; i<GROUP_WIDTH; i++) bits |= (unsigned int)(group[i] == ctrl) << i;
+	return bits;
+#endif
+}
+
+// Bitmask of the empty or deleted control bytes in the group.
+static inline unsigned int
+GroupMatchAvailable(const uint8_t *group)
+{
+#if CP_HASH_SET_SSE2
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+	unsigned int bits = 0;
+	for(int i=0; i<GROUP_WIDTH; i++) bits |= (unsigned int)(group[i] >> 7) << i;
+	return bits;
+#endif
+}
+
+// Index of the lowest set bit.
+static inline int
+LowestBit(unsigned int bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(bits);
+#else
+	int i = 0;
+	while(!(bits&1)){bits >>= 1; i++;}
+	return i;
+#endif
+}
+
+// Index of the highest set bit.
+static inline int
+HighestBit(unsigned int bits)
+{
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(bits);
+#else
+	int i = 0;
+	while(bits >>= 1) i++;
+	return i;
+#endif
+}
+
+//MARK: Table
+
+static inline unsigned int
+MaxLoad(unsigned int capacity)
+{
+	return capacity - capacity/8;
+}
+
+static inline void
+SetCtrl(cpHashSet *set, unsigned int i, uint8_t ctrl)
+{
+	set->ctrl[i] = ctrl;
+	if(i < GROUP_WIDTH) set->ctrl[set->capacity + i] = ctrl;
 }
 
 static void
-cpHashSetResize(cpHashSet *set)
-{
-	// Get the next approximate doubled prime.
-	unsigned int newSize = next_prime(set->size + 1);
-	// Allocate a new table.
-	cpHashSetBin **newTable = (cpHashSetBin **)cpcalloc(newSize, sizeof(cpHashSetBin *));
-	
-	// Iterate over the chains.
-	for(unsigned int i=0; i<set->size; i++){
-		// Rehash the bins into the new table.
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			
-			cpHashValue idx = bin->hash%newSize;
-			bin->next = newTable[idx];
-			newTable[idx] = bin;
-			
-			bin = next;
+AllocTable(cpHashSet *set, unsigned int capacity)
+{
+	set->capacity = capacity;
+	set->growthLeft = MaxLoad(capacity) - set->entries;
+	
+	set->ctrl = (uint8_t *)cpcalloc(capacity + GROUP_WIDTH, sizeof(uint8_t));
+	memset(set->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+	set->slots = (cpHashSetSlot *)cpcalloc(capacity, sizeof(cpHashSetSlot));
+}
+
+// Probe the groups in triangular steps, which visits each of them once since the group count is a power of two.
+// A group with an empty slot ends the search since an insert would have stopped there.
+static int
+FindSlot(cpHashSet *set, cpHashValue h, const void *ptr)
+{
+	unsigned int mask = set->capacity - 1;
+	unsigned int pos = (unsigned int)h & mask;
+	uint8_t tag = HashTag(h);
+	
+	for(unsigned int step = GROUP_WIDTH;; step += GROUP_WIDTH){
+		const uint8_t *group = set->ctrl + pos;
+		
+		for(unsigned int bits = GroupMatch(group, tag); bits; bits &= bits - 1){
+			unsigned int i = (pos + LowestBit(bits))&mask;
+			cpHashSetSlot *slot = set->slots + i;
+			if(slot->hash == h && set->eql(ptr, slot->elt)) return (int)i;
 		}
+		
+		if(GroupMatch(group, CTRL_EMPTY)) return -1;
+		pos = (pos + step)&mask;
 	}
+}
+
+// Find the first empty or deleted slot along the probe sequence for a hash.
+static unsigned int
+FindAvailableSlot(cpHashSet *set, cpHashValue h)
+{
+	unsigned int mask = set->capacity - 1;
+	unsigned int pos = (unsigned int)h & mask;
 	
-	cpfree(set->table);
-	
-	set->table = newTable;
-	set->size = newSize;
+	for(unsigned int step = GROUP_WIDTH;; step += GROUP_WIDTH){
+		unsigned int bits = GroupMatchAvailable(set->ctrl + pos);
+		if(bits) return (pos + LowestBit(bits))&mask;
+		pos = (pos + step)&mask;
+	}
 }
 
-static inline void
-recycleBin(cpHashSet *set, cpHashSetBin *bin)
+static void
+cpHashSetResize(cpHashSet *set, unsigned int capacity)
 {
-	bin->next = set->pooledBins;
-	set->pooledBins = bin;
-	bin->elt = NULL;
+	uint8_t *ctrl = set->ctrl;
+	cpHashSetSlot *slots = set->slots;
+	unsigned int oldCapacity = set->capacity;
+	
+	AllocTable(set, capacity);
+	
+	for(unsigned int i=0; i<oldCapacity; i++){
+		if(!CtrlIsFull(ctrl[i])) continue;
+		
+		unsigned int idx = FindAvailableSlot(set, slots[i].hash);
+		SetCtrl(set, idx, HashTag(slots[i].hash));
+		set->slots[idx] = slots[i];
+	}
+	
+	cpfree(ctrl);
+	cpfree(slots);
 }
 
-static cpHashSetBin *
-getUnusedBin(cpHashSet *set)
+// A slot can go back to being empty if no probe could have seen a full group when passing over it.
+// Otherwise it has to be left as a tombstone so lookups keep probing past it.
+static void
+EraseSlot(cpHashSet *set, unsigned int i)
 {
-	cpHashSetBin *bin = set->pooledBins;
+	unsigned int mask = set->capacity - 1;
+	unsigned int emptyAfter = GroupMatch(set->ctrl + i, CTRL_EMPTY);
+	unsigned int emptyBefore = GroupMatch(set->ctrl + ((i - GROUP_WIDTH)&mask), CTRL_EMPTY);
 	
-	if(bin){
-		set->pooledBins = bin->next;
-		return bin;
+	if(emptyAfter && emptyBefore && LowestBit(emptyAfter) + (GROUP_WIDTH - 1 - HighestBit(emptyBefore)) < GROUP_WIDTH){
+		SetCtrl(set, i, CTRL_EMPTY);
+		set->growthLeft++;
 	} else {
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpHashSetBin);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		cpHashSetBin *buffer = (cpHashSetBin *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(set->allocatedBuffers, buffer);
+		SetCtrl(set, i, CTRL_DELETED);
+	}
+	
+	set->slots[i].elt = NULL;
+	set->entries--;
+}
+
+//MARK: Public Functions
+
+void
+cpHashSetFree(cpHashSet *set)
+{
+	if(set){
+		cpfree(set->ctrl);
+		cpfree(set->slots);
 		
-		// push all but the first one, return it instead
-		for(int i=1; i<count; i++) recycleBin(set, buffer + i);
-		return buffer;
+		cpfree(set);
 	}
 }
 
+cpHashSet *
+cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc)
+{
+	cpHashSet *set = (cpHashSet *)cpcalloc(1, sizeof(cpHashSet));
+	
+	unsigned int capacity = GROUP_WIDTH;
+	while(MaxLoad(capacity) < (unsigned int)size) capacity *= 2;
+	
+	set->entries = 0;
+	AllocTable(set, capacity);
+	
+	set->eql = eqlFunc;
+	set->default_value = NULL;
+	
+	return set;
+}
+
+void
+cpHashSetSetDefaultValue(cpHashSet *set, void *default_value)
+{
+	set->default_value = default_value;
+}
+
 int
 cpHashSetCount(cpHashSet *set)
 {
@@ -152,51 +281,64 @@ cpHashSetCount(cpHashSet *set)
 const void *
 cpHashSetInsert(cpHashSet *set, cpHashValue hash, const void *ptr, cpHashSetTransFunc trans, void *data)
 {
-	cpHashValue idx = hash%set->size;
+	cpHashValue h = MixHash(hash);
+	uint8_t tag = HashTag(h);
 	
-	// Find the bin with the matching element.
-	cpHashSetBin *bin = set->table[idx];
-	while(bin && !set->eql(ptr, bin->elt))
-		bin = bin->next;
+	// Same as FindSlot(), but remember the first available slot along the way.
+	unsigned int mask = set->capacity - 1;
+	unsigned int pos = (unsigned int)h & mask;
+	unsigned int i = 0;
+	bool available = false;
 	
-	// Create it if necessary.
-	if(!bin){
-		bin = getUnusedBin(set);
-		bin->hash = hash;
-		bin->elt = (trans ? trans(ptr, data) : data);
+	for(unsigned int step = GROUP_WIDTH;; step += GROUP_WIDTH){
+		const uint8_t *group = set->ctrl + pos;
+		
+		// Return the matching element if there is one.
+		for(unsigned int bits = GroupMatch(group, tag); bits; bits &= bits - 1){
+			cpHashSetSlot *slot = set->slots + ((pos + LowestBit(bits))&mask);
+			if(slot->hash == h && set->eql(ptr, slot->elt)) return slot->elt;
+		}
 		
-		bin->next = set->table[idx];
-		set->table[idx] = bin;
+		if(!available){
+			unsigned int bits = GroupMatchAvailable(group);
+			if(bits){
+				i = (pos + LowestBit(bits))&mask;
+				available = true;
+			}
+		}
 		
-		set->entries++;
-		if(setIsFull(set)) cpHashSetResize(set);
+		if(GroupMatch(group, CTRL_EMPTY)) break;
+		pos = (pos + step)&mask;
+	}
+	
+	// Create it otherwise.
+	void *elt = (trans ? trans(ptr, data) : data);
+	
+	if(set->growthLeft == 0 && set->ctrl[i] == CTRL_EMPTY){
+		// Rebuild the table to clear out the tombstones if there are a lot of them, otherwise double it.
+		// The table never shrinks.
+		cpHashSetResize(set, set->entries < MaxLoad(set->capacity)/2 ? set->capacity : 2*set->capacity);
+		i = FindAvailableSlot(set, h);
 	}
 	
-	return bin->elt;
+	if(set->ctrl[i] == CTRL_EMPTY) set->growthLeft--;
+	SetCtrl(set, i, HashTag(h));
+	set->slots[i].hash = h;
+	set->slots[i].elt = elt;
+	set->entries++;
+	
+	return elt;
 }
 
 const void *
 cpHashSetRemove(cpHashSet *set, cpHashValue hash, const void *ptr)
 {
-	cpHashValue idx = hash%set->size;
-	
-	cpHashSetBin **prev_ptr = &set->table[idx];
-	cpHashSetBin *bin = set->table[idx];
-	
-	// Find the bin
-	while(bin && !set->eql(ptr, bin->elt)){
-		prev_ptr = &bin->next;
-		bin = bin->next;
-	}
+	int i = FindSlot(set, MixHash(hash), ptr);
 	
 	// Remove it if it exists.
-	if(bin){
-		// Update the previous linked list pointer
-		(*prev_ptr) = bin->next;
-		set->entries--;
-		
-		const void *elt = bin->elt;
-		recycleBin(set, bin);
+	if(i >= 0){
+		const void *elt = set->slots[i].elt;
+		EraseSlot(set, (unsigned int)i);
 		
 		return elt;
 	}
@@ -206,24 +348,21 @@ cpHashSetRemove(cpHashSet *set, cpHashValue hash, const void *ptr)
 
 const void *
 cpHashSetFind(cpHashSet *set, cpHashValue hash, const void *ptr)
-{	
-	cpHashValue idx = hash%set->size;
-	cpHashSetBin *bin = set->table[idx];
-	while(bin && !set->eql(ptr, bin->elt))
-		bin = bin->next;
-		
-	return (bin ? bin->elt : set->default_value);
+{
+	int i = FindSlot(set, MixHash(hash), ptr);
+	return (i >= 0 ? set->slots[i].elt : set->default_value);
 }
 
+// Iterating is a linear sweep over the groups, skipping the empty and deleted slots a group at a time.
+// Elements never move once inserted, so it's safe for func to remove elements.
+// The control byte is checked again before each call in case func removed a slot from the same group.
 void
 cpHashSetEach(cpHashSet *set, cpHashSetIteratorFunc func, void *data)
 {
-	for(unsigned int i=0; i<set->size; i++){
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			func(bin->elt, data);
-			bin = next;
+	for(unsigned int pos=0; pos<set->capacity; pos+=GROUP_WIDTH){
+		for(unsigned int bits = ~GroupMatchAvailable(set->ctrl + pos) & 0xFFFF; bits; bits &= bits - 1){
+			unsigned int i = pos + LowestBit(bits);
+			if(CtrlIsFull(set->ctrl[i])) func(set->slots[i].elt, data);
 		}
 	}
 }
@@ -231,23 +370,43 @@ cpHashSetEach(cpHashSet *set, cpHashSetIteratorFunc func, void *data)
 void
 cpHashSetFilter(cpHashSet *set, cpHashSetFilterFunc func, void *data)
 {
-	for(unsigned int i=0; i<set->size; i++){
-		// The rest works similarly to cpHashSetRemove() above.
-		cpHashSetBin **prev_ptr = &set->table[i];
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			
-			if(func(bin->elt, data)){
-				prev_ptr = &bin->next;
-			} else {
-				(*prev_ptr) = next;
-
-				set->entries--;
-				recycleBin(set, bin);
-			}
-			
-			bin = next;
+	for(unsigned int pos=0; pos<set->capacity; pos+=GROUP_WIDTH){
+		for(unsigned int bits = ~GroupMatchAvailable(set->ctrl + pos) & 0xFFFF; bits; bits &= bits - 1){
+			unsigned int i = pos + LowestBit(bits);
+			if(CtrlIsFull(set->ctrl[i]) && !func(set->slots[i].elt, data)) EraseSlot(set, i);
 		}
 	}
 }
+
+//MARK: Snapshots
+
+void
+cpHashSetSnapshot(cpHashSet *set, cpSnapshotWriter *writer)
+{
+	cpSnapshotWrite(writer, &set->entries, sizeof(set->entries));
+	cpSnapshotWrite(writer, &set->capacity, sizeof(set->capacity));
+	cpSnapshotWrite(writer, &set->growthLeft, sizeof(set->growthLeft));
+	cpSnapshotWrite(writer, set->ctrl, (set->capacity + GROUP_WIDTH)*sizeof(uint8_t));
+	cpSnapshotWrite(writer, set->slots, set->capacity*sizeof(cpHashSetSlot));
+}
+
+void
+cpHashSetRestore(cpHashSet *set, cpSnapshotReader *reader)
+{
+	unsigned int entries, capacity, growthLeft;
+	cpSnapshotRead(reader, &entries, sizeof(entries));
+	cpSnapshotRead(reader, &capacity, sizeof(capacity));
+	cpSnapshotRead(reader, &growthLeft, sizeof(growthLeft));
+	
+	// Restore the exact layout so iterating the set gives the same order as when the snapshot was taken.
+	if(capacity != set->capacity){
+		cpfree(set->ctrl);
+		cpfree(set->slots);
+		AllocTable(set, capacity);
+	}
+	
+	cpSnapshotRead(reader, set->ctrl, (capacity + GROUP_WIDTH)*sizeof(uint8_t));
+	cpSnapshotRead(reader, set->slots, capacity*sizeof(cpHashSetSlot));
+	set->entries = entries;
+	set->growthLeft = growthLeft;
+}
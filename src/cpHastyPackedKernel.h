@@ -0,0 +1,128 @@
+// Copyright 2013 Howling Moon Software. All rights reserved.
+// See http://chipmunk2d.net/legal.php for more information.
+
+// Contact solver kernel for the packed solver in cpHastySpace.c.
+// This file is included once for each instruction set with the following defined:
+//
+// PACKED_KERNEL: Name of the function to define.
+// PACKED_TARGET: Function attributes needed to use the instruction set (may be empty).
+// vfloat: Vector type holding VLANES cpFloats. PACKED_WIDTH must be a multiple of VLANES.
+// VLoad(ptr), VStore(ptr, v), VSet1(f): Unaligned loads and stores, and broadcasting a scalar.
+// VAdd, VSub, VMul, VMin, VMax, VNeg: Arithmetic. VMin and VMax must behave like cpfmin() and cpfmax().
+// VGather(base, idx): Load base[idx[i]] into each lane.
+//
+// The operations are done in exactly the same order as cpArbiterApplyImpulse() to give the same rounding.
+// That only holds as long as cpHastySpace.c is compiled without fast-math or FMA contraction. (see src/CMakeLists.txt)
+
+static PACKED_TARGET void
+PACKED_KERNEL(struct PackedBlock *block, cpFloat *bodies)
+{
+	for(int lane=0; lane<PACKED_WIDTH; lane+=VLANES){
+		const int *ia = block->a + lane;
+		const int *ib = block->b + lane;
+
+		vfloat v_ax = VGather(bodies + PACKED_V_X, ia), v_bx = VGather(bodies + PACKED_V_X, ib);
+		vfloat v_ay = VGather(bodies + PACKED_V_Y, ia), v_by = VGather(bodies + PACKED_V_Y, ib);
+		vfloat w_a = VGather(bodies + PACKED_W, ia), w_b = VGather(bodies + PACKED_W, ib);
+		vfloat v_bias_ax = VGather(bodies + PACKED_V_BIAS_X, ia), v_bias_bx = VGather(bodies + PACKED_V_BIAS_X, ib);
+		vfloat v_bias_ay = VGather(bodies + PACKED_V_BIAS_Y, ia), v_bias_by = VGather(bodies + PACKED_V_BIAS_Y, ib);
+		vfloat w_bias_a = VGather(bodies + PACKED_W_BIAS, ia), w_bias_b = VGather(bodies + PACKED_W_BIAS, ib);
+		vfloat m_inv_a = VGather(bodies + PACKED_M_INV, ia), m_inv_b = VGather(bodies + PACKED_M_INV, ib);
+		vfloat i_inv_a = VGather(bodies + PACKED_I_INV, ia), i_inv_b = VGather(bodies + PACKED_I_INV, ib);
+
+		vfloat n_x = VLoad(block->n_x + lane);
+		vfloat n_y = VLoad(block->n_y + lane);
+		vfloat surface_vr_x = VLoad(block->surface_vr_x + lane);
+		vfloat surface_vr_y = VLoad(block->surface_vr_y + lane);
+		vfloat friction = VLoad(block->u + lane);
+		vfloat zero = VSet1(0.0f);
+
+		for(int i=0; i<block->contact_count; i++){
+			struct PackedContacts *con = block->contacts + i;
+			vfloat r1_x = VLoad(con->r1_x + lane), r1_y = VLoad(con->r1_y + lane);
+			vfloat r2_x = VLoad(con->r2_x + lane), r2_y = VLoad(con->r2_y + lane);
+			vfloat nMass = VLoad(con->nMass + lane);
+
+			vfloat vb1_x = VAdd(v_bias_ax, VMul(VNeg(r1_y), w_bias_a));
+			vfloat vb1_y = VAdd(v_bias_ay, VMul(r1_x, w_bias_a));
+			vfloat vb2_x = VAdd(v_bias_bx, VMul(VNeg(r2_y), w_bias_b));
+			vfloat vb2_y = VAdd(v_bias_by, VMul(r2_x, w_bias_b));
+
+			vfloat v1_x = VAdd(v_ax, VMul(VNeg(r1_y), w_a));
+			vfloat v1_y = VAdd(v_ay, VMul(r1_x, w_a));
+			vfloat v2_x = VAdd(v_bx, VMul(VNeg(r2_y), w_b));
+			vfloat v2_y = VAdd(v_by, VMul(r2_x, w_b));
+			vfloat vr_x = VAdd(VSub(v2_x, v1_x), surface_vr_x);
+			vfloat vr_y = VAdd(VSub(v2_y, v1_y), surface_vr_y);
+
+			vfloat vbn = VAdd(VMul(VSub(vb2_x, vb1_x), n_x), VMul(VSub(vb2_y, vb1_y), n_y));
+			vfloat vrn = VAdd(VMul(vr_x, n_x), VMul(vr_y, n_y));
+			vfloat vrt = VAdd(VMul(vr_x, VNeg(n_y)), VMul(vr_y, n_x));
+
+			vfloat jbn = VMul(VSub(VLoad(con->bias + lane), vbn), nMass);
+			vfloat jbnOld = VLoad(con->jBias + lane);
+			vfloat jBias = VMax(VAdd(jbnOld, jbn), zero);
+
+			vfloat jn = VMul(VNeg(VAdd(VLoad(con->bounce + lane), vrn)), nMass);
+			vfloat jnOld = VLoad(con->jnAcc + lane);
+			vfloat jnAcc = VMax(VAdd(jnOld, jn), zero);
+
+			vfloat jtMax = VMul(friction, jnAcc);
+			vfloat jt = VMul(VNeg(vrt), VLoad(con->tMass + lane));
+			vfloat jtOld = VLoad(con->jtAcc + lane);
+			vfloat jtAcc = VMin(VMax(VAdd(jtOld, jt), VNeg(jtMax)), jtMax);
+
+			VStore(con->jBias + lane, jBias);
+			VStore(con->jnAcc + lane, jnAcc);
+			VStore(con->jtAcc + lane, jtAcc);
+
+			// Apply the bias impulse.
+			vfloat jbApply = VSub(jBias, jbnOld);
+			vfloat jb_x = VMul(n_x, jbApply);
+			vfloat jb_y = VMul(n_y, jbApply);
+
+			v_bias_ax = VAdd(v_bias_ax, VMul(VNeg(jb_x), m_inv_a));
+			v_bias_ay = VAdd(v_bias_ay, VMul(VNeg(jb_y), m_inv_a));
+			w_bias_a = VAdd(w_bias_a, VMul(i_inv_a, VSub(VMul(r1_x, VNeg(jb_y)), VMul(r1_y, VNeg(jb_x)))));
+			v_bias_bx = VAdd(v_bias_bx, VMul(jb_x, m_inv_b));
+			v_bias_by = VAdd(v_bias_by, VMul(jb_y, m_inv_b));
+			w_bias_b = VAdd(w_bias_b, VMul(i_inv_b, VSub(VMul(r2_x, jb_y), VMul(r2_y, jb_x))));
+
+			// Apply the normal and friction impulses.
+			vfloat jnApply = VSub(jnAcc, jnOld);
+			vfloat jtApply = VSub(jtAcc, jtOld);
+			vfloat j_x = VSub(VMul(n_x, jnApply), VMul(n_y, jtApply));
+			vfloat j_y = VAdd(VMul(n_x, jtApply), VMul(n_y, jnApply));
+
+			v_ax = VAdd(v_ax, VMul(VNeg(j_x), m_inv_a));
+			v_ay = VAdd(v_ay, VMul(VNeg(j_y), m_inv_a));
+			w_a = VAdd(w_a, VMul(i_inv_a, VSub(VMul(r1_x, VNeg(j_y)), VMul(r1_y, VNeg(j_x)))));
+			v_bx = VAdd(v_bx, VMul(j_x, m_inv_b));
+			v_by = VAdd(v_by, VMul(j_y, m_inv_b));
+			w_b = VAdd(w_b, VMul(i_inv_b, VSub(VMul(r2_x, j_y), VMul(r2_y, j_x))));
+		}
+
+		// Scatter the velocities back in lane order.
+		// Lanes only share the dummy body and non-dynamic bodies, which the impulses can't change.
+		// Blocks in other workers can share them too, so they are skipped instead of being written back.
+		cpFloat out[12][VLANES];
+		VStore(out[ 0], v_ax); VStore(out[ 1], v_ay); VStore(out[ 2], w_a);
+		VStore(out[ 3], v_bias_ax); VStore(out[ 4], v_bias_ay); VStore(out[ 5], w_bias_a);
+		VStore(out[ 6], v_bx); VStore(out[ 7], v_by); VStore(out[ 8], w_b);
+		VStore(out[ 9], v_bias_bx); VStore(out[10], v_bias_by); VStore(out[11], w_bias_b);
+
+		for(int i=0; i<VLANES; i++){
+			cpFloat *a = bodies + ia[i];
+			if(a[PACKED_M_INV] != 0.0f || a[PACKED_I_INV] != 0.0f){
+				a[PACKED_V_X] = out[0][i]; a[PACKED_V_Y] = out[1][i]; a[PACKED_W] = out[2][i];
+				a[PACKED_V_BIAS_X] = out[3][i]; a[PACKED_V_BIAS_Y] = out[4][i]; a[PACKED_W_BIAS] = out[5][i];
+			}
+
+			cpFloat *b = bodies + ib[i];
+			if(b[PACKED_M_INV] != 0.0f || b[PACKED_I_INV] != 0.0f){
+				b[PACKED_V_X] = out[6][i]; b[PACKED_V_Y] = out[7][i]; b[PACKED_W] = out[8][i];
+				b[PACKED_V_BIAS_X] = out[9][i]; b[PACKED_V_BIAS_Y] = out[10][i]; b[PACKED_W_BIAS] = out[11][i];
+			}
+		}
+	}
+}
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 //TODO: Move all the thread stuff to another file
 
@@ -219,6 +220,80 @@ int pthread_join(pthread_t thread, void **value_ptr)
 #include "chipmunk/chipmunk_private.h"
 #include "chipmunk/cpHastySpace.h"
 
+//MARK: Scalar Solver
+
+// Impulses can't change the velocity of bodies with infinite mass and moment, such as static and kinematic bodies.
+// Workers can solve items that share them at the same time, so the contact kernels skip writing to them.
+static inline bool
+IgnoresImpulses(cpBody *body)
+{
+	return (body->m_inv == 0.0f && body->i_inv == 0.0f);
+}
+
+static inline void
+ApplyImpulse(cpBody *body, cpVect j, cpVect r)
+{
+	if(IgnoresImpulses(body)) return;
+	
+	body->v = cpvadd(body->v, cpvmult(j, body->m_inv));
+	body->w += body->i_inv*cpvcross(r, j);
+}
+
+static inline void
+ApplyBiasImpulse(cpBody *body, cpVect j, cpVect r)
+{
+	if(IgnoresImpulses(body)) return;
+	
+	body->v_bias = cpvadd(body->v_bias, cpvmult(j, body->m_inv));
+	body->w_bias += body->i_inv*cpvcross(r, j);
+}
+
+// Same as cpArbiterApplyImpulse(), but doesn't write to bodies that can be shared between workers.
+static void
+cpArbiterApplyImpulse_Scalar(cpArbiter *arb)
+{
+	cpBody *a = arb->body_a;
+	cpBody *b = arb->body_b;
+	cpVect n = arb->n;
+	cpVect surface_vr = arb->surface_vr;
+	cpFloat friction = arb->u;
+
+	for(int i=0; i<arb->count; i++){
+		struct cpContact *con = &arb->contacts[i];
+		cpFloat nMass = con->nMass;
+		cpVect r1 = con->r1;
+		cpVect r2 = con->r2;
+		
+		cpVect vb1 = cpvadd(a->v_bias, cpvmult(cpvperp(r1), a->w_bias));
+		cpVect vb2 = cpvadd(b->v_bias, cpvmult(cpvperp(r2), b->w_bias));
+		cpVect vr = cpvadd(relative_velocity(a, b, r1, r2), surface_vr);
+		
+		cpFloat vbn = cpvdot(cpvsub(vb2, vb1), n);
+		cpFloat vrn = cpvdot(vr, n);
+		cpFloat vrt = cpvdot(vr, cpvperp(n));
+		
+		cpFloat jbn = (con->bias - vbn)*nMass;
+		cpFloat jbnOld = con->jBias;
+		con->jBias = cpfmax(jbnOld + jbn, 0.0f);
+		
+		cpFloat jn = -(con->bounce + vrn)*nMass;
+		cpFloat jnOld = con->jnAcc;
+		con->jnAcc = cpfmax(jnOld + jn, 0.0f);
+		
+		cpFloat jtMax = friction*con->jnAcc;
+		cpFloat jt = -vrt*con->tMass;
+		cpFloat jtOld = con->jtAcc;
+		con->jtAcc = cpfclamp(jtOld + jt, -jtMax, jtMax);
+		
+		cpVect jBias = cpvmult(n, con->jBias - jbnOld);
+		ApplyBiasImpulse(a, cpvneg(jBias), r1);
+		ApplyBiasImpulse(b, jBias, r2);
+		
+		cpVect j = cpvrotate(n, cpv(con->jnAcc - jnOld, con->jtAcc - jtOld));
+		ApplyImpulse(a, cpvneg(j), r1);
+		ApplyImpulse(b, j, r2);
+	}
+}
 
 //MARK: ARM NEON Solver
 
@@ -298,6 +373,10 @@ cpArbiterApplyImpulse_NEON(cpArbiter *arb)
 	cpFloatx2_t n = vld((cpFloat_t *)&arb->n);
 	cpFloat_t friction = arb->u;
 	
+	// Static and kinematic bodies can be shared between workers, so don't write to them.
+	bool write_a = !IgnoresImpulses(a);
+	bool write_b = !IgnoresImpulses(b);
+	
 	int numContacts = arb->count;
 	struct cpContact *contacts = arb->contacts;
 	for(int i=0; i<numContacts; i++){
@@ -362,15 +441,19 @@ cpArbiterApplyImpulse_NEON(cpArbiter *arb)
 		v_b = vadd(v_b, vmul_n(j, b->m_inv));
 		
 		// TODO would moving these earlier help pipeline them better?
-		vst((cpFloat_t *)&a->v_bias, vBias_a);
-		vst((cpFloat_t *)&b->v_bias, vBias_b);
-		vst_lane((cpFloat_t *)&a->w_bias, wBias, 0);
-		vst_lane((cpFloat_t *)&b->w_bias, wBias, 1);
+		if(write_a){
+			vst((cpFloat_t *)&a->v_bias, vBias_a);
+			vst_lane((cpFloat_t *)&a->w_bias, wBias, 0);
+			vst((cpFloat_t *)&a->v, v_a);
+			vst_lane((cpFloat_t *)&a->w, w, 0);
+		}
 		
-		vst((cpFloat_t *)&a->v, v_a);
-		vst((cpFloat_t *)&b->v, v_b);
-		vst_lane((cpFloat_t *)&a->w, w, 0);
-		vst_lane((cpFloat_t *)&b->w, w, 1);
+		if(write_b){
+			vst((cpFloat_t *)&b->v_bias, vBias_b);
+			vst_lane((cpFloat_t *)&b->w_bias, wBias, 1);
+			vst((cpFloat_t *)&b->v, v_b);
+			vst_lane((cpFloat_t *)&b->w, w, 1);
+		}
 		
 		vst_lane((cpFloat_t *)&con->jBias, jbn_jn, 0);
 		vst_lane((cpFloat_t *)&con->jnAcc, jbn_jn, 1);
@@ -380,41 +463,688 @@ cpArbiterApplyImpulse_NEON(cpArbiter *arb)
 
 #endif
 
+//MARK: x86 SSE2 and AVX2 Solver
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define HASTY_SSE2 1
+	#include <emmintrin.h>
+	
+	// AVX2 kernels are compiled in if the compiler can target AVX2 for a single function, and picked at runtime.
+	#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || (defined(_MSC_VER) && _MSC_VER >= 1800)
+		#define HASTY_AVX2 1
+		#include <immintrin.h>
+		
+		#ifdef _MSC_VER
+			#include <intrin.h>
+		#endif
+	#endif
+#endif
+
+// These kernels do the same operations as cpArbiterApplyImpulse() in the same order so they round the same way.
+// Negating a term and adding it instead of subtracting it (and vice versa) doesn't change the result.
+// FMA is never used since fusing the multiplies and adds would change the rounding.
+
+#if HASTY_SSE2
+	#if CP_USE_DOUBLES
+		// Just use the full register.
+		typedef __m128d cpFloatx2_sse;
+		#define sse_ld(__p) _mm_loadu_pd((const double *)(__p))
+		#define sse_st(__p, __v) _mm_storeu_pd((double *)(__p), __v)
+		#define sse_make(__x, __y) _mm_set_pd(__y, __x)
+		#define sse_dup _mm_set1_pd
+		#define sse_add _mm_add_pd
+		#define sse_sub _mm_sub_pd
+		#define sse_mul _mm_mul_pd
+		#define sse_max _mm_max_pd
+		#define sse_rev(__a) _mm_shuffle_pd(__a, __a, 1)
+		#define sse_lane0(__a) _mm_cvtsd_f64(__a)
+		#define sse_lane1(__a) _mm_cvtsd_f64(_mm_unpackhi_pd(__a, __a))
+		// (a0 + a1, b0 + b1) like NEON's vpadd.
+		#define sse_padd(__a, __b) _mm_add_pd(_mm_unpacklo_pd(__a, __b), _mm_unpackhi_pd(__a, __b))
+	#else
+		// Only the low half of the register is used.
+		typedef __m128 cpFloatx2_sse;
+		#define sse_ld(__p) _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(__p))
+		#define sse_st(__p, __v) _mm_storel_pi((__m64 *)(__p), __v)
+		#define sse_make(__x, __y) _mm_set_ps(0.0f, 0.0f, __y, __x)
+		#define sse_dup _mm_set1_ps
+		#define sse_add _mm_add_ps
+		#define sse_sub _mm_sub_ps
+		#define sse_mul _mm_mul_ps
+		#define sse_max _mm_max_ps
+		#define sse_rev(__a) _mm_shuffle_ps(__a, __a, _MM_SHUFFLE(3, 2, 0, 1))
+		#define sse_lane0(__a) _mm_cvtss_f32(__a)
+		#define sse_lane1(__a) _mm_cvtss_f32(_mm_shuffle_ps(__a, __a, _MM_SHUFFLE(1, 1, 1, 1)))
+		
+		static inline __m128
+		sse_padd(__m128 a, __m128 b)
+		{
+			__m128 t = _mm_unpacklo_ps(a, b);
+			return _mm_add_ps(t, _mm_movehl_ps(t, t));
+		}
+	#endif
+	
+	// A port of the NEON kernel that works on a cpVect at a time.
+	static void
+	cpArbiterApplyImpulse_SSE2(cpArbiter *arb)
+	{
+		cpBody *a = arb->body_a;
+		cpBody *b = arb->body_b;
+		cpFloatx2_sse surface_vr = sse_ld(&arb->surface_vr);
+		cpFloatx2_sse n = sse_ld(&arb->n);
+		cpFloat friction = arb->u;
+		
+		cpFloatx2_sse perp = sse_make(-1.0f, 1.0f);
+		cpFloatx2_sse t = sse_mul(sse_rev(n), perp);
+		
+		// Static and kinematic bodies can be shared between workers, so don't write to them.
+		bool write_a = !IgnoresImpulses(a);
+		bool write_b = !IgnoresImpulses(b);
+		
+		int numContacts = arb->count;
+		struct cpContact *contacts = arb->contacts;
+		for(int i=0; i<numContacts; i++){
+			struct cpContact *con = contacts + i;
+			cpFloatx2_sse r1 = sse_ld(&con->r1);
+			cpFloatx2_sse r2 = sse_ld(&con->r2);
+			cpFloatx2_sse r1p = sse_mul(sse_rev(r1), perp);
+			cpFloatx2_sse r2p = sse_mul(sse_rev(r2), perp);
+			
+			cpFloatx2_sse vBias_a = sse_ld(&a->v_bias);
+			cpFloatx2_sse vBias_b = sse_ld(&b->v_bias);
+			cpFloatx2_sse vb1 = sse_add(vBias_a, sse_mul(r1p, sse_dup(a->w_bias)));
+			cpFloatx2_sse vb2 = sse_add(vBias_b, sse_mul(r2p, sse_dup(b->w_bias)));
+			cpFloatx2_sse vbr = sse_sub(vb2, vb1);
+			
+			cpFloatx2_sse v_a = sse_ld(&a->v);
+			cpFloatx2_sse v_b = sse_ld(&b->v);
+			cpFloatx2_sse v1 = sse_add(v_a, sse_mul(r1p, sse_dup(a->w)));
+			cpFloatx2_sse v2 = sse_add(v_b, sse_mul(r2p, sse_dup(b->w)));
+			cpFloatx2_sse vr = sse_add(sse_sub(v2, v1), surface_vr);
+			
+			// (bias - vbn, bounce + vrn)*(nMass, -nMass)
+			cpFloatx2_sse vbn_vrn = sse_padd(sse_mul(vbr, n), sse_mul(vr, n));
+			cpFloatx2_sse v_offset = sse_make(con->bias, con->bounce);
+			cpFloatx2_sse jbn_jn = sse_mul(sse_add(v_offset, sse_mul(vbn_vrn, perp)), sse_make(con->nMass, -con->nMass));
+			
+			cpFloatx2_sse jOld = sse_make(con->jBias, con->jnAcc);
+			cpFloatx2_sse jAcc = sse_max(sse_add(jOld, jbn_jn), sse_dup(0.0f));
+			cpFloatx2_sse jApply = sse_sub(jAcc, jOld);
+			
+			cpFloatx2_sse vrt = sse_padd(sse_mul(vr, t), sse_mul(vr, t));
+			cpFloat jnAcc = sse_lane1(jAcc);
+			cpFloat jtMax = friction*jnAcc;
+			cpFloat jt = -sse_lane0(vrt)*con->tMass;
+			cpFloat jtOld = con->jtAcc;
+			cpFloat jtAcc = cpfclamp(jtOld + jt, -jtMax, jtMax);
+			
+			con->jBias = sse_lane0(jAcc);
+			con->jnAcc = jnAcc;
+			con->jtAcc = jtAcc;
+			
+			// cpvcross(r1, -j) for body a and cpvcross(r2, j) for body b.
+			cpFloatx2_sse nperp = sse_make(1.0f, -1.0f);
+			cpFloatx2_sse i_inv = sse_make(-a->i_inv, b->i_inv);
+			
+			cpFloatx2_sse jBias = sse_mul(n, sse_dup(sse_lane0(jApply)));
+			cpFloatx2_sse jBiasCross = sse_mul(sse_rev(jBias), nperp);
+			cpFloatx2_sse wBias = sse_add(sse_make(a->w_bias, b->w_bias), sse_mul(i_inv, sse_padd(sse_mul(r1, jBiasCross), sse_mul(r2, jBiasCross))));
+			
+			cpFloatx2_sse j = sse_add(sse_mul(n, sse_dup(sse_lane1(jApply))), sse_mul(t, sse_dup(jtAcc - jtOld)));
+			cpFloatx2_sse jCross = sse_mul(sse_rev(j), nperp);
+			cpFloatx2_sse w = sse_add(sse_make(a->w, b->w), sse_mul(i_inv, sse_padd(sse_mul(r1, jCross), sse_mul(r2, jCross))));
+			
+			if(write_a){
+				sse_st(&a->v_bias, sse_sub(vBias_a, sse_mul(jBias, sse_dup(a->m_inv))));
+				a->w_bias = sse_lane0(wBias);
+				sse_st(&a->v, sse_sub(v_a, sse_mul(j, sse_dup(a->m_inv))));
+				a->w = sse_lane0(w);
+			}
+			
+			if(write_b){
+				sse_st(&b->v_bias, sse_add(vBias_b, sse_mul(jBias, sse_dup(b->m_inv))));
+				b->w_bias = sse_lane1(wBias);
+				sse_st(&b->v, sse_add(v_b, sse_mul(j, sse_dup(b->m_inv))));
+				b->w = sse_lane1(w);
+			}
+		}
+	}
+#endif
+
+#if HASTY_AVX2
+	#ifdef _MSC_VER
+		#define HASTY_TARGET_AVX2
+	#else
+		#define HASTY_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+	
+	static bool
+	CPUSupportsAVX2(void)
+	{
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if(info[0] < 7) return false;
+		
+		// Check that the CPU supports AVX and the OS saves the AVX registers.
+		__cpuid(info, 1);
+		if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+		if((_xgetbv(0) & 0x6) != 0x6) return false;
+		
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	#endif
+	}
+	
+	#if CP_USE_DOUBLES
+		// Keeps the values for both bodies in a single register as (a.x, a.y, b.x, b.y).
+		// With floats this would only fill half of an SSE register, so the SSE2 kernel is used instead.
+		static HASTY_TARGET_AVX2 void
+		cpArbiterApplyImpulse_AVX2(cpArbiter *arb)
+		{
+			cpBody *a = arb->body_a;
+			cpBody *b = arb->body_b;
+			__m128d surface_vr = _mm_loadu_pd((const double *)&arb->surface_vr);
+			__m128d n = _mm_loadu_pd((const double *)&arb->n);
+			cpFloat friction = arb->u;
+			
+			__m128d t = _mm_mul_pd(_mm_shuffle_pd(n, n, 1), _mm_set_pd(1.0, -1.0));
+			__m256d perp = _mm256_set_pd(1.0, -1.0, 1.0, -1.0);
+			__m256d m_inv = _mm256_set_pd(b->m_inv, b->m_inv, a->m_inv, a->m_inv);
+			__m256d i_inv = _mm256_set_pd(b->i_inv, b->i_inv, a->i_inv, a->i_inv);
+			
+			#define LOAD_PAIR(__a, __b) _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_loadu_pd((const double *)&(__a))), _mm_loadu_pd((const double *)&(__b)), 1)
+			__m256d v = LOAD_PAIR(a->v, b->v);
+			__m256d v_bias = LOAD_PAIR(a->v_bias, b->v_bias);
+			__m256d w = _mm256_set_pd(b->w, b->w, a->w, a->w);
+			__m256d w_bias = _mm256_set_pd(b->w_bias, b->w_bias, a->w_bias, a->w_bias);
+			
+			int numContacts = arb->count;
+			struct cpContact *contacts = arb->contacts;
+			for(int i=0; i<numContacts; i++){
+				struct cpContact *con = contacts + i;
+				__m256d r = LOAD_PAIR(con->r1, con->r2);
+				__m256d rp = _mm256_mul_pd(_mm256_permute_pd(r, 0x5), perp);
+				
+				// (vb1, vb2) and (v1, v2)
+				__m256d vb = _mm256_add_pd(v_bias, _mm256_mul_pd(rp, w_bias));
+				__m256d vs = _mm256_add_pd(v, _mm256_mul_pd(rp, w));
+				__m128d vbr = _mm_sub_pd(_mm256_extractf128_pd(vb, 1), _mm256_castpd256_pd128(vb));
+				__m128d vr = _mm_add_pd(_mm_sub_pd(_mm256_extractf128_pd(vs, 1), _mm256_castpd256_pd128(vs)), surface_vr);
+				
+				// (vbn, vrn) and (vrt, vrt)
+				__m128d vbn_vrn = _mm_hadd_pd(_mm_mul_pd(vbr, n), _mm_mul_pd(vr, n));
+				__m128d vrt = _mm_hadd_pd(_mm_mul_pd(vr, t), _mm_mul_pd(vr, t));
+				
+				__m128d v_offset = _mm_set_pd(con->bounce, con->bias);
+				__m128d jbn_jn = _mm_mul_pd(_mm_add_pd(v_offset, _mm_mul_pd(vbn_vrn, _mm_set_pd(1.0, -1.0))), _mm_set_pd(-con->nMass, con->nMass));
+				
+				__m128d jOld = _mm_set_pd(con->jnAcc, con->jBias);
+				__m128d jAcc = _mm_max_pd(_mm_add_pd(jOld, jbn_jn), _mm_setzero_pd());
+				__m128d jApply = _mm_sub_pd(jAcc, jOld);
+				
+				cpFloat jnAcc = _mm_cvtsd_f64(_mm_unpackhi_pd(jAcc, jAcc));
+				cpFloat jtMax = friction*jnAcc;
+				cpFloat jt = -_mm_cvtsd_f64(vrt)*con->tMass;
+				cpFloat jtOld = con->jtAcc;
+				cpFloat jtAcc = cpfclamp(jtOld + jt, -jtMax, jtMax);
+				
+				con->jBias = _mm_cvtsd_f64(jAcc);
+				con->jnAcc = jnAcc;
+				con->jtAcc = jtAcc;
+				
+				// Impulses are applied as (-j, j) so the crosses come out as cpvcross(r1, -j) and cpvcross(r2, j).
+				__m128d jb = _mm_mul_pd(n, _mm_set1_pd(_mm_cvtsd_f64(jApply)));
+				__m256d jBias = _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_xor_pd(jb, _mm_set1_pd(-0.0))), jb, 1);
+				__m256d biasCrosses = _mm256_mul_pd(r, _mm256_permute_pd(jBias, 0x5));
+				v_bias = _mm256_add_pd(v_bias, _mm256_mul_pd(jBias, m_inv));
+				w_bias = _mm256_add_pd(w_bias, _mm256_mul_pd(i_inv, _mm256_hsub_pd(biasCrosses, biasCrosses)));
+				
+				__m128d jv = _mm_add_pd(_mm_mul_pd(n, _mm_unpackhi_pd(jApply, jApply)), _mm_mul_pd(t, _mm_set1_pd(jtAcc - jtOld)));
+				__m256d j = _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_xor_pd(jv, _mm_set1_pd(-0.0))), jv, 1);
+				__m256d crosses = _mm256_mul_pd(r, _mm256_permute_pd(j, 0x5));
+				v = _mm256_add_pd(v, _mm256_mul_pd(j, m_inv));
+				w = _mm256_add_pd(w, _mm256_mul_pd(i_inv, _mm256_hsub_pd(crosses, crosses)));
+			}
+			#undef LOAD_PAIR
+			
+			// Static and kinematic bodies can be shared between workers, so don't write to them.
+			if(!IgnoresImpulses(a)){
+				_mm_storeu_pd((double *)&a->v, _mm256_castpd256_pd128(v));
+				_mm_storeu_pd((double *)&a->v_bias, _mm256_castpd256_pd128(v_bias));
+				a->w = _mm_cvtsd_f64(_mm256_castpd256_pd128(w));
+				a->w_bias = _mm_cvtsd_f64(_mm256_castpd256_pd128(w_bias));
+			}
+			
+			if(!IgnoresImpulses(b)){
+				_mm_storeu_pd((double *)&b->v, _mm256_extractf128_pd(v, 1));
+				_mm_storeu_pd((double *)&b->v_bias, _mm256_extractf128_pd(v_bias, 1));
+				b->w = _mm_cvtsd_f64(_mm256_extractf128_pd(w, 1));
+				b->w_bias = _mm_cvtsd_f64(_mm256_extractf128_pd(w_bias, 1));
+			}
+		}
+	#endif
+#endif
+
+//MARK: Packed Solver Kernels
+
+// Number of arbiters packed into each block. Enough to fill the widest vector registers.
+#if CP_USE_DOUBLES
+	#define PACKED_WIDTH 4
+#else
+	#define PACKED_WIDTH 8
+#endif
+
+// Layout of the packed bodies, PACKED_BODY_SIZE cpFloats each.
+enum {
+	PACKED_V_X, PACKED_V_Y, PACKED_W,
+	PACKED_V_BIAS_X, PACKED_V_BIAS_Y, PACKED_W_BIAS,
+	PACKED_M_INV, PACKED_I_INV,
+	PACKED_BODY_SIZE,
+};
+
+// One contact from each arbiter in a block.
+struct PackedContacts {
+	cpFloat r1_x[PACKED_WIDTH], r1_y[PACKED_WIDTH];
+	cpFloat r2_x[PACKED_WIDTH], r2_y[PACKED_WIDTH];
+	cpFloat nMass[PACKED_WIDTH], tMass[PACKED_WIDTH];
+	cpFloat bias[PACKED_WIDTH], bounce[PACKED_WIDTH];
+	cpFloat jBias[PACKED_WIDTH], jnAcc[PACKED_WIDTH], jtAcc[PACKED_WIDTH];
+};
+
+// A group of arbiters that share no dynamic bodies, stored one arbiter per lane.
+struct PackedBlock {
+	// Offsets of each arbiter's bodies in cpHastySpace.packed_bodies.
+	int a[PACKED_WIDTH], b[PACKED_WIDTH];
+
+	cpFloat n_x[PACKED_WIDTH], n_y[PACKED_WIDTH];
+	cpFloat surface_vr_x[PACKED_WIDTH], surface_vr_y[PACKED_WIDTH];
+	cpFloat u[PACKED_WIDTH];
+
+	// Lanes past an arbiter's contact count are filled with zeros so they don't apply any impulse.
+	struct PackedContacts contacts[CP_MAX_CONTACTS_PER_ARBITER];
+	int contact_count;
+
+	// NULL for unused lanes.
+	cpArbiter *arbiters[PACKED_WIDTH];
+};
+
+typedef void (*PackedKernelFunc)(struct PackedBlock *block, cpFloat *bodies);
+
+#define PACKED_KERNEL PackedKernel_Scalar
+#define PACKED_TARGET
+
+#define vfloat cpFloat
+#define VLANES 1
+#define VLoad(__p) (*(__p))
+#define VStore(__p, __v) (*(__p) = (__v))
+#define VSet1(__f) ((cpFloat)(__f))
+#define VAdd(__a, __b) ((__a) + (__b))
+#define VSub(__a, __b) ((__a) - (__b))
+#define VMul(__a, __b) ((__a)*(__b))
+#define VMin cpfmin
+#define VMax cpfmax
+#define VNeg(__a) (-(__a))
+#define VGather(__base, __idx) ((__base)[(__idx)[0]])
+
+#include "cpHastyPackedKernel.h"
+
+#undef PACKED_KERNEL
+#undef PACKED_TARGET
+#undef vfloat
+#undef VLANES
+#undef VLoad
+#undef VStore
+#undef VSet1
+#undef VAdd
+#undef VSub
+#undef VMul
+#undef VMin
+#undef VMax
+#undef VNeg
+#undef VGather
+
+#if HASTY_SSE2
+	#define PACKED_KERNEL PackedKernel_SSE2
+	#define PACKED_TARGET
+
+	#if CP_USE_DOUBLES
+		#define vfloat __m128d
+		#define VLANES 2
+		#define VLoad _mm_loadu_pd
+		#define VStore _mm_storeu_pd
+		#define VSet1 _mm_set1_pd
+		#define VAdd _mm_add_pd
+		#define VSub _mm_sub_pd
+		#define VMul _mm_mul_pd
+		#define VMin _mm_min_pd
+		#define VMax _mm_max_pd
+		#define VNeg(__a) _mm_xor_pd(__a, _mm_set1_pd(-0.0))
+		#define VGather(__base, __idx) _mm_set_pd((__base)[(__idx)[1]], (__base)[(__idx)[0]])
+	#else
+		#define vfloat __m128
+		#define VLANES 4
+		#define VLoad _mm_loadu_ps
+		#define VStore _mm_storeu_ps
+		#define VSet1 _mm_set1_ps
+		#define VAdd _mm_add_ps
+		#define VSub _mm_sub_ps
+		#define VMul _mm_mul_ps
+		#define VMin _mm_min_ps
+		#define VMax _mm_max_ps
+		#define VNeg(__a) _mm_xor_ps(__a, _mm_set1_ps(-0.0f))
+		#define VGather(__base, __idx) _mm_set_ps((__base)[(__idx)[3]], (__base)[(__idx)[2]], (__base)[(__idx)[1]], (__base)[(__idx)[0]])
+	#endif
+
+	#include "cpHastyPackedKernel.h"
+
+	#undef PACKED_KERNEL
+	#undef PACKED_TARGET
+	#undef vfloat
+	#undef VLANES
+	#undef VLoad
+	#undef VStore
+	#undef VSet1
+	#undef VAdd
+	#undef VSub
+	#undef VMul
+	#undef VMin
+	#undef VMax
+	#undef VNeg
+	#undef VGather
+#endif
+
+#if HASTY_AVX2
+	#define PACKED_KERNEL PackedKernel_AVX2
+	#define PACKED_TARGET HASTY_TARGET_AVX2
+
+	#if CP_USE_DOUBLES
+		#define vfloat __m256d
+		#define VLANES 4
+		#define VLoad _mm256_loadu_pd
+		#define VStore _mm256_storeu_pd
+		#define VSet1 _mm256_set1_pd
+		#define VAdd _mm256_add_pd
+		#define VSub _mm256_sub_pd
+		#define VMul _mm256_mul_pd
+		#define VMin _mm256_min_pd
+		#define VMax _mm256_max_pd
+		#define VNeg(__a) _mm256_xor_pd(__a, _mm256_set1_pd(-0.0))
+		#define VGather(__base, __idx) _mm256_i32gather_pd(__base, _mm_loadu_si128((const __m128i *)(__idx)), 8)
+	#else
+		#define vfloat __m256
+		#define VLANES 8
+		#define VLoad _mm256_loadu_ps
+		#define VStore _mm256_storeu_ps
+		#define VSet1 _mm256_set1_ps
+		#define VAdd _mm256_add_ps
+		#define VSub _mm256_sub_ps
+		#define VMul _mm256_mul_ps
+		#define VMin _mm256_min_ps
+		#define VMax _mm256_max_ps
+		#define VNeg(__a) _mm256_xor_ps(__a, _mm256_set1_ps(-0.0f))
+		#define VGather(__base, __idx) _mm256_i32gather_ps(__base, _mm256_loadu_si256((const __m256i *)(__idx)), 4)
+	#endif
+
+	#include "cpHastyPackedKernel.h"
+
+	#undef PACKED_KERNEL
+	#undef PACKED_TARGET
+	#undef vfloat
+	#undef VLANES
+	#undef VLoad
+	#undef VStore
+	#undef VSet1
+	#undef VAdd
+	#undef VSub
+	#undef VMul
+	#undef VMin
+	#undef VMax
+	#undef VNeg
+	#undef VGather
+#endif
+
+typedef void (*ArbiterApplyImpulseFunc)(cpArbiter *arb);
+
+//MARK: Atomics
+
+#ifdef _MSC_VER
+	static inline long
+	AtomicFetchAdd(volatile long *ptr, long value)
+	{
+		return InterlockedExchangeAdd(ptr, value);
+	}
+	
+	static inline long
+	AtomicLoad(volatile long *ptr)
+	{
+		return InterlockedCompareExchange(ptr, 0, 0);
+	}
+	
+	static inline void
+	CPUPause(void)
+	{
+		YieldProcessor();
+	}
+	
+	static inline void
+	ThreadYield(void)
+	{
+		SwitchToThread();
+	}
+#else
+	#include <sched.h>
+	#include <unistd.h>
+	
+	static inline long
+	AtomicFetchAdd(volatile long *ptr, long value)
+	{
+		return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+	}
+	
+	static inline long
+	AtomicLoad(volatile long *ptr)
+	{
+		return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+	}
+	
+	static inline void
+	CPUPause(void)
+	{
+	#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+		__asm__ __volatile__("yield");
+	#endif
+	}
+	
+	static inline void
+	ThreadYield(void)
+	{
+		sched_yield();
+	}
+#endif
+
 //MARK: PThreads
 
-// Right now using more than 2 threads probably wont help your performance any.
-// If you are using a ridiculous number of iterations it could help though.
-#define MAX_THREADS 2
+// The solver splits the work up by islands, so more threads help as long as there are enough independent piles of objects.
+#define MAX_THREADS 32
 
 struct ThreadContext {
 	pthread_t thread;
 	cpHastySpace *space;
 	unsigned long thread_num;
+	
+	// Job generation the worker was started at.
+	long generation;
 };
 
 typedef	void (*cpHastySpaceWorkFunction)(cpSpace *space, unsigned long worker, unsigned long worker_count);
 
+// Maximum number of colors used by the graph coloring. Must fit in the bits of a uint32_t.
+#define MAX_COLORS 32
+
+// A group of arbiters and constraints that share no dynamic bodies with any other island.
+struct Island {
+	// Range of the island's arbiters in cpHastySpace.island_arbiters.
+	int arbiter_start, arbiter_end;
+	// Range of the island's constraints in cpHastySpace.island_constraints.
+	int constraint_start, constraint_end;
+};
+
 struct cpHastySpace {
 	cpSpace space;
 	
 	// Number of worker threads (including the main thread)
 	unsigned long num_threads;
 	
-	// Number of worker threads currently executing. (also including the main thread)
-	unsigned long num_working;
-	
 	// Number of constraints (plus contacts) that must exist per step to start the worker threads.
 	unsigned long constraint_count_threshold;
 	
-	pthread_mutex_t mutex;
-	pthread_cond_t cond_work, cond_resume;
+	// Number of times idle workers check for new work before parking.
+	unsigned long spin_budget;
 	
 	// Work function to invoke.
 	cpHastySpaceWorkFunction work;
 	
+	// Incremented each time a new job is handed out to the workers.
+	volatile long job_generation;
+	
+	// Number of workers (excluding the main thread) that haven't finished the current job yet.
+	volatile long num_working;
+	
+	// Number of workers parked on cond_work.
+	volatile long num_parked;
+	
+	// Only used to park idle workers.
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_work;
+	
 	struct ThreadContext workers[MAX_THREADS - 1];
+	
+	// Each worker's copies of the static or kinematic bodies attached to the constraint it's solving.
+	cpBody scratch_bodies[MAX_THREADS][2];
+	
+	// Arbiters and constraints grouped by island for the solver.
+	cpArray *island_arbiters, *island_constraints;
+	
+	struct Island *islands;
+	long island_count, island_capacity;
+	
+	// Index of the next island to be picked up by a worker.
+	volatile long island_cursor;
+	
+	// Islands with at least this many arbiters and constraints are graph colored so every worker can help solve them.
+	int color_threshold;
+	
+	// Arbiters and constraints of the colored islands sorted by color.
+	cpArbiter **color_arbiters;
+	cpConstraint **color_constraints;
+	int color_arbiters_capacity, color_constraints_capacity;
+	
+	// Ranges of each color in color_arbiters and color_constraints.
+	// Items that can't fit into any color are put into the overflow batch and solved by a single worker.
+	struct Island colors[MAX_COLORS];
+	struct Island color_overflow;
+	int color_count;
+	
+	// Open addressed table of the colors used by each body while coloring, and where it's stored by the packed solver.
+	cpBody **body_table_bodies;
+	uint32_t *body_table_colors;
+	int *body_table_slots;
+	unsigned int body_table_size;
+	
+	// Scratch space for each item's color.
+	int *item_colors;
+	int item_colors_capacity;
+	
+	// Spinning barrier that workers wait on between colors.
+	volatile long barrier_count, barrier_generation;
+	
+	// Dynamic shapes gathered up so their bounding boxes can be updated in parallel.
+	cpArray *shapes;
+	
+	// Number of pairs sorted for the narrow phase, and the index of the next batch to be picked up by a worker.
+	int sorted_pair_count;
+	volatile long pair_cursor;
+	
+	// Batched segment query being split up between the workers, and the index of the next segments to be picked up.
+	struct SegmentQueryBatch *segment_batch;
+	volatile long segment_cursor;
+	
+	// Use the SIMD kernels if the CPU supports them.
+	bool vectorized;
+	ArbiterApplyImpulseFunc apply_impulse;
+	
+	// Use the packed solver instead of the island solver.
+	bool packed_solver;
+	PackedKernelFunc packed_kernel;
+	
+	// Velocities and masses of the bodies used by the packed solver, PACKED_BODY_SIZE cpFloats each.
+	// The first one is a dummy body that unused lanes point to.
+	// The bodies attached to constraints come next so they can be easily copied to and from their cpBody structs.
+	cpFloat *packed_bodies;
+	cpBody **packed_body_list;
+	int packed_body_count, packed_body_capacity;
+	int packed_constraint_body_count;
+	
+	// Arbiters packed into blocks sorted by color.
+	struct PackedBlock *packed_blocks;
+	int packed_block_count, packed_block_capacity;
+	
+	// Range of blocks in each color. The overflow color comes last and has a single arbiter per block.
+	int packed_colors[MAX_COLORS + 2];
 };
 
+// Back off a little while spinning.
+// Yield every so often in case there are more threads than cores and the thread being waited on needs the CPU.
+static inline void
+SpinPause(unsigned long i)
+{
+	if((i & 0x3F) == 0x3F){
+		ThreadYield();
+	} else {
+		CPUPause();
+	}
+}
+
+// Wait for the job generation to change, spinning for a while before parking the thread.
+static long
+WaitForJob(cpHastySpace *hasty, long generation)
+{
+	for(unsigned long i=0; i<hasty->spin_budget; i++){
+		long next = AtomicLoad(&hasty->job_generation);
+		if(next != generation) return next;
+		
+		SpinPause(i);
+	}
+	
+	long next;
+	pthread_mutex_lock(&hasty->mutex); {
+		// RunWorkers() checks num_parked after changing the generation, so either it sees this worker as parked or the worker sees the new job.
+		AtomicFetchAdd(&hasty->num_parked, 1);
+		while((next = AtomicLoad(&hasty->job_generation)) == generation){
+			pthread_cond_wait(&hasty->cond_work, &hasty->mutex);
+		}
+		AtomicFetchAdd(&hasty->num_parked, -1);
+	} pthread_mutex_unlock(&hasty->mutex);
+	
+	return next;
+}
+
+static void
+WakeParkedWorkers(cpHastySpace *hasty)
+{
+	if(AtomicLoad(&hasty->num_parked) > 0){
+		pthread_mutex_lock(&hasty->mutex); {
+			pthread_cond_broadcast(&hasty->cond_work);
+		} pthread_mutex_unlock(&hasty->mutex);
+	}
+}
+
 static void *
 WorkerThreadLoop(struct ThreadContext *context)
 {
@@ -422,19 +1152,15 @@ WorkerThreadLoop(struct ThreadContext *context)
 	
 	unsigned long thread = context->thread_num;
 	unsigned long num_threads = hasty->num_threads;
+	long generation = context->generation;
 	
 	for(;;){
-		pthread_mutex_lock(&hasty->mutex); {
-			if(--hasty->num_working == 0){
-				pthread_cond_signal(&hasty->cond_resume);
-			}
-			
-			pthread_cond_wait(&hasty->cond_work, &hasty->mutex);
-		} pthread_mutex_unlock(&hasty->mutex);
+		generation = WaitForJob(hasty, generation);
 		
 		cpHastySpaceWorkFunction func = hasty->work;
 		if(func){
-			hasty->work(&hasty->space, thread, num_threads);
+			func(&hasty->space, thread, num_threads);
+			AtomicFetchAdd(&hasty->num_working, -1);
 		} else {
 			break;
 		}
@@ -446,139 +1172,1060 @@ WorkerThreadLoop(struct ThreadContext *context)
 static void
 RunWorkers(cpHastySpace *hasty, cpHastySpaceWorkFunction func)
 {
-	hasty->num_working = hasty->num_threads - 1;
-	hasty->work = func;
-	
-	if(hasty->num_working > 0){
-		pthread_mutex_lock(&hasty->mutex); {
-			pthread_cond_broadcast(&hasty->cond_work);
-		} pthread_mutex_unlock(&hasty->mutex);
+	if(hasty->num_threads > 1){
+		hasty->work = func;
+		hasty->num_working = hasty->num_threads - 1;
+		
+		// Publish the job, then do the main thread's share of the work.
+		AtomicFetchAdd(&hasty->job_generation, 1);
+		WakeParkedWorkers(hasty);
 		
 		func((cpSpace *)hasty, 0, hasty->num_threads);
-			
-		pthread_mutex_lock(&hasty->mutex); {
-			if(hasty->num_working > 0){
-				pthread_cond_wait(&hasty->cond_resume, &hasty->mutex);
+		
+		// The rest of the workers should be close behind, so only spin while waiting.
+		for(unsigned long i=0; AtomicLoad(&hasty->num_working) > 0; i++){
+			if(i < hasty->spin_budget){
+				SpinPause(i);
+			} else {
+				ThreadYield();
 			}
-		} pthread_mutex_unlock(&hasty->mutex);
+		}
 	} else {
-		func((cpSpace *)hasty, 0, hasty->num_threads);
+		func((cpSpace *)hasty, 0, 1);
 	}
-	
-	hasty->work = NULL;
 }
 
+// Split up count items evenly between the workers.
+static inline void
+WorkerRange(int count, unsigned long worker, unsigned long worker_count, int *start, int *end)
+{
+	*start = (int)(count*worker/worker_count);
+	*end = (int)(count*(worker + 1)/worker_count);
+}
+
+//MARK: Parallel Step Phases
+
 static void
-Solver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+IntegratePositions(cpSpace *space, unsigned long worker, unsigned long worker_count)
 {
-	cpArray *constraints = space->constraints;
-	cpArray *arbiters = space->arbiters;
-	
+	cpArray *bodies = space->dynamicBodies;
 	cpFloat dt = space->curr_dt;
-	unsigned long iterations = (space->iterations + worker_count - 1)/worker_count;
 	
-	for(unsigned long i=0; i<iterations; i++){
-		for(int j=0; j<arbiters->num; j++){
-			cpArbiter *arb = (cpArbiter *)arbiters->arr[j];
-			#ifdef __ARM_NEON__
-				cpArbiterApplyImpulse_NEON(arb);
-			#else
-				cpArbiterApplyImpulse(arb);
-			#endif
-		}
-			
-		for(int j=0; j<constraints->num; j++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[j];
-			constraint->klass->applyImpulse(constraint, dt);
-		}
+	int start, end;
+	WorkerRange(bodies->num, worker, worker_count, &start, &end);
+	
+	for(int i=start; i<end; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		body->position_func(body, dt);
 	}
 }
 
-//MARK: Thread Management Functions
-
 static void
-HaltThreads(cpHastySpace *hasty)
+PreStepArbiters(cpSpace *space, unsigned long worker, unsigned long worker_count)
 {
-	pthread_mutex_t *mutex = &hasty->mutex;
-	pthread_mutex_lock(mutex); {
-		hasty->work = NULL; // NULL work function means break and exit
-		pthread_cond_broadcast(&hasty->cond_work);
-	} pthread_mutex_unlock(mutex);
+	cpArray *arbiters = space->arbiters;
+	cpFloat dt = space->curr_dt;
+	cpFloat slop = space->collisionSlop;
+	cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
 	
-	for(unsigned long i=0; i<(hasty->num_threads-1); i++){
-		pthread_join(hasty->workers[i].thread, NULL);
+	int start, end;
+	WorkerRange(arbiters->num, worker, worker_count, &start, &end);
+	
+	for(int i=start; i<end; i++){
+		cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef, space->collisionSpeculation);
 	}
 }
 
-void
-cpHastySpaceSetThreads(cpSpace *space, unsigned long threads)
+static void
+IntegrateVelocities(cpSpace *space, unsigned long worker, unsigned long worker_count)
 {
-#if TARGET_IPHONE_SIMULATOR == 1
-	// Individual values appear to be written non-atomically when compiled as debug for the simulator.
-	// No idea why, so threads are disabled.
-	threads = 1;
-#endif	
-	
-	cpHastySpace *hasty = (cpHastySpace *)space;
-	HaltThreads(hasty);
+	cpArray *bodies = space->dynamicBodies;
+	cpFloat dt = space->curr_dt;
+	cpFloat damping = cpfpow(space->damping, dt);
+	cpVect gravity = space->gravity;
 	
-#ifdef __APPLE__
-	if(threads == 0){
-		size_t size = sizeof(threads);
-		sysctlbyname("hw.ncpu", &threads, &size, NULL, 0);
-	}
-#else
-	if(threads == 0) threads = 1;
-#endif
+	int start, end;
+	WorkerRange(bodies->num, worker, worker_count, &start, &end);
 	
-	hasty->num_threads = (threads < MAX_THREADS ? threads : MAX_THREADS);
-	hasty->num_working = hasty->num_threads - 1;
-	
-	// Create the worker threads and wait for them to signal ready.
-	if(hasty->num_working > 0){
-		pthread_mutex_lock(&hasty->mutex);
-		for(unsigned long i=0; i<(hasty->num_threads-1); i++){
-			hasty->workers[i].space = hasty;
-			hasty->workers[i].thread_num = i + 1;
-			
-			pthread_create(&hasty->workers[i].thread, NULL, (void*(*)(void*))WorkerThreadLoop, &hasty->workers[i]);
-		}
-		
-		pthread_cond_wait(&hasty->cond_resume, &hasty->mutex);
-		pthread_mutex_unlock(&hasty->mutex);
+	for(int i=start; i<end; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		body->velocity_func(body, gravity, damping, dt);
 	}
 }
 
-unsigned long
-cpHastySpaceGetThreads(cpSpace *space)
+// Run a phase on the workers if there is enough work to be worth it.
+// Each item in these phases is independent, so the results are the same either way.
+static inline void
+RunPhase(cpHastySpace *hasty, cpHastySpaceWorkFunction func, int count)
 {
-	return ((cpHastySpace *)space)->num_threads;
+	if((unsigned long)count > hasty->constraint_count_threshold){
+		RunWorkers(hasty, func);
+	} else {
+		func((cpSpace *)hasty, 0, 1);
+	}
 }
 
-//MARK: Overriden cpSpace Functions.
+//MARK: Island Solver
 
-cpSpace *
-cpHastySpaceNew(void)
+// Constraints write to both of their bodies, so ones attached to a static or kinematic body
+// are pointed at the worker's own copy of it while they are solved.
+static inline void
+ApplyConstraintImpulse(cpConstraint *constraint, cpBody *scratch, cpFloat dt)
 {
-	cpHastySpace *hasty = (cpHastySpace *)cpcalloc(1, sizeof(cpHastySpace));
-	cpSpaceInit((cpSpace *)hasty);
+	cpBody *a = constraint->a, *b = constraint->b;
 	
-	pthread_mutex_init(&hasty->mutex, NULL);
-	pthread_cond_init(&hasty->cond_work, NULL);
-	pthread_cond_init(&hasty->cond_resume, NULL);
+	if(IgnoresImpulses(a)){
+		scratch[0] = *a;
+		constraint->a = scratch + 0;
+	}
 	
-	// TODO magic number, should test this more thoroughly.
-	hasty->constraint_count_threshold = 50;
+	if(IgnoresImpulses(b)){
+		scratch[1] = *b;
+		constraint->b = scratch + 1;
+	}
 	
-	// Default to 1 thread for determinism.
-	hasty->num_threads = 1;
-	cpHastySpaceSetThreads((cpSpace *)hasty, 1);
-
-	return (cpSpace *)hasty;
+	constraint->klass->applyImpulse(constraint, dt);
+	
+	constraint->a = a;
+	constraint->b = b;
 }
 
-void
-cpHastySpaceFree(cpSpace *space)
+static inline void
+ApplyImpulses(cpHastySpace *hasty, unsigned long worker, cpArbiter **arbiters, int arbiter_count, cpConstraint **constraints, int constraint_count, cpFloat dt)
+{
+	ArbiterApplyImpulseFunc applyImpulse = hasty->apply_impulse;
+	for(int i=0; i<arbiter_count; i++){
+		applyImpulse(arbiters[i]);
+	}
+	
+	cpBody *scratch = hasty->scratch_bodies[worker];
+	for(int i=0; i<constraint_count; i++){
+		ApplyConstraintImpulse(constraints[i], scratch, dt);
+	}
+}
+
+static void
+PushIsland(cpHastySpace *hasty, struct Island island)
+{
+	if(hasty->island_count == hasty->island_capacity){
+		hasty->island_capacity = (hasty->island_capacity ? 2*hasty->island_capacity : 16);
+		hasty->islands = (struct Island *)cprealloc(hasty->islands, hasty->island_capacity*sizeof(struct Island));
+	}
+	
+	hasty->islands[hasty->island_count++] = island;
+}
+
+static void
+CollectIsland(cpBody *root, cpHastySpace *hasty)
+{
+	cpArray *arbiters = hasty->island_arbiters;
+	cpArray *constraints = hasty->island_constraints;
+	struct Island island = {arbiters->num, 0, constraints->num, 0};
+	
+	CP_BODY_FOREACH_COMPONENT(root, body){
+		// Arbiters and constraints between two dynamic bodies show up in the lists of both.
+		// Like cpSpaceActivateBody(), body A is arbitrarily chosen to own them unless it can't be part of the component.
+		CP_BODY_FOREACH_ARBITER(body, arb){
+			if(body == arb->body_a || cpBodyGetType(arb->body_a) != CP_BODY_TYPE_DYNAMIC) cpArrayPush(arbiters, arb);
+		}
+		
+		CP_BODY_FOREACH_CONSTRAINT(body, constraint){
+			if(body == constraint->a || cpBodyGetType(constraint->a) != CP_BODY_TYPE_DYNAMIC) cpArrayPush(constraints, constraint);
+		}
+	}
+	
+	island.arbiter_end = arbiters->num;
+	island.constraint_end = constraints->num;
+	
+	// Don't bother with islands that are just a lone body.
+	if(island.arbiter_start != island.arbiter_end || island.constraint_start != island.constraint_end) PushIsland(hasty, island);
+}
+
+static inline int
+IslandSize(const struct Island *island)
+{
+	return (island->arbiter_end - island->arbiter_start) + (island->constraint_end - island->constraint_start);
+}
+
+static int
+IslandCompare(const struct Island *a, const struct Island *b)
+{
+	// Largest islands first so the workers don't end up waiting on a big one started last.
+	// Fall back on the island's position to make the sort order stable.
+	int diff = IslandSize(b) - IslandSize(a);
+	if(diff == 0) diff = a->arbiter_start - b->arbiter_start;
+	return (diff ? diff : a->constraint_start - b->constraint_start);
+}
+
+//MARK: Graph Coloring
+
+// Clear the body table, resizing it to keep it no more than 1/4 full.
+static void
+ResetBodyTable(cpHastySpace *hasty, int body_count)
+{
+	unsigned int table_size = 16;
+	while(table_size < 4*(unsigned int)body_count) table_size *= 2;
+	
+	if(hasty->body_table_size < table_size){
+		cpfree(hasty->body_table_bodies);
+		cpfree(hasty->body_table_colors);
+		cpfree(hasty->body_table_slots);
+		
+		hasty->body_table_size = table_size;
+		hasty->body_table_bodies = (cpBody **)cpcalloc(table_size, sizeof(cpBody *));
+		hasty->body_table_colors = (uint32_t *)cpcalloc(table_size, sizeof(uint32_t));
+		hasty->body_table_slots = (int *)cpcalloc(table_size, sizeof(int));
+	} else {
+		memset(hasty->body_table_bodies, 0, hasty->body_table_size*sizeof(cpBody *));
+	}
+}
+
+// Find the body's index in the body table, adding it if it's not there yet.
+static inline unsigned int
+BodyTableIndex(cpHastySpace *hasty, cpBody *body)
+{
+	unsigned int mask = hasty->body_table_size - 1;
+	unsigned int i = (unsigned int)(((uintptr_t)body >> 4)*2654435761u) & mask;
+	
+	for(;; i = (i + 1) & mask){
+		cpBody *key = hasty->body_table_bodies[i];
+		
+		if(key == body){
+			return i;
+		} else if(key == NULL){
+			hasty->body_table_bodies[i] = body;
+			hasty->body_table_colors[i] = 0;
+			hasty->body_table_slots[i] = -1;
+			return i;
+		}
+	}
+}
+
+static inline uint32_t *
+BodyColors(cpHastySpace *hasty, cpBody *body)
+{
+	// The solver never writes to non-dynamic bodies (see IgnoresImpulses()), so any number of items in a color can share them.
+	if(cpBodyGetType(body) != CP_BODY_TYPE_DYNAMIC) return NULL;
+	
+	return hasty->body_table_colors + BodyTableIndex(hasty, body);
+}
+
+// Greedily assign the lowest color that isn't used by either body yet.
+// Returns MAX_COLORS if all of the colors are taken.
+static inline int
+PickColor(cpHastySpace *hasty, cpBody *a, cpBody *b)
+{
+	uint32_t *colors_a = BodyColors(hasty, a);
+	uint32_t *colors_b = BodyColors(hasty, b);
+	uint32_t used = (colors_a ? *colors_a : 0) | (colors_b ? *colors_b : 0);
+	
+	int color = 0;
+	while(color < MAX_COLORS && (used & ((uint32_t)1 << color))) color++;
+	if(color == MAX_COLORS) return MAX_COLORS;
+	
+	if(colors_a) *colors_a |= ((uint32_t)1 << color);
+	if(colors_b) *colors_b |= ((uint32_t)1 << color);
+	return color;
+}
+
+static void *
+EnsureCapacity(void *ptr, int *capacity, int count, size_t size)
+{
+	if(*capacity < count){
+		*capacity = (count > 2*(*capacity) ? count : 2*(*capacity));
+		ptr = cprealloc(ptr, (*capacity)*size);
+	}
+	
+	return ptr;
+}
+
+// Split up the islands larger than the color threshold into colors.
+// Items in the same color don't share any dynamic bodies and can be solved in parallel.
+// Islands are sorted largest first, so the large islands are always at the front of the list.
+static void
+ColorIslands(cpHastySpace *hasty)
+{
+	cpArbiter **arbiters = (cpArbiter **)hasty->island_arbiters->arr;
+	cpConstraint **constraints = (cpConstraint **)hasty->island_constraints->arr;
+	
+	int large_count = 0;
+	int arbiter_count = 0, constraint_count = 0;
+	while(large_count < hasty->island_count && IslandSize(hasty->islands + large_count) >= hasty->color_threshold){
+		struct Island *island = hasty->islands + large_count;
+		arbiter_count += island->arbiter_end - island->arbiter_start;
+		constraint_count += island->constraint_end - island->constraint_start;
+		large_count++;
+	}
+	
+	hasty->color_count = 0;
+	hasty->color_overflow = (struct Island){0, 0, 0, 0};
+	if(large_count == 0) return;
+	
+	// Each item touches at most 2 bodies.
+	ResetBodyTable(hasty, 2*(arbiter_count + constraint_count));
+	
+	hasty->item_colors = (int *)EnsureCapacity(hasty->item_colors, &hasty->item_colors_capacity, arbiter_count + constraint_count, sizeof(int));
+	hasty->color_arbiters = (cpArbiter **)EnsureCapacity(hasty->color_arbiters, &hasty->color_arbiters_capacity, arbiter_count, sizeof(cpArbiter *));
+	hasty->color_constraints = (cpConstraint **)EnsureCapacity(hasty->color_constraints, &hasty->color_constraints_capacity, constraint_count, sizeof(cpConstraint *));
+	
+	// Count the size of each color including the overflow.
+	int arbiter_counts[MAX_COLORS + 1] = {0}, constraint_counts[MAX_COLORS + 1] = {0};
+	int *item_colors = hasty->item_colors;
+	
+	for(int i=0, item=0; i<large_count; i++){
+		struct Island *island = hasty->islands + i;
+		
+		for(int j=island->arbiter_start; j<island->arbiter_end; j++){
+			cpArbiter *arb = arbiters[j];
+			int color = item_colors[item++] = PickColor(hasty, arb->body_a, arb->body_b);
+			arbiter_counts[color]++;
+		}
+	}
+	
+	for(int i=0, item=arbiter_count; i<large_count; i++){
+		struct Island *island = hasty->islands + i;
+		
+		for(int j=island->constraint_start; j<island->constraint_end; j++){
+			cpConstraint *constraint = constraints[j];
+			int color = item_colors[item++] = PickColor(hasty, constraint->a, constraint->b);
+			constraint_counts[color]++;
+		}
+	}
+	
+	// Compute the ranges of the colors and skip the empty ones.
+	int arbiter_offsets[MAX_COLORS + 1], constraint_offsets[MAX_COLORS + 1];
+	for(int color=0, arbiter_start=0, constraint_start=0; color<=MAX_COLORS; color++){
+		arbiter_offsets[color] = arbiter_start;
+		constraint_offsets[color] = constraint_start;
+		
+		struct Island range = {
+			arbiter_start, arbiter_start + arbiter_counts[color],
+			constraint_start, constraint_start + constraint_counts[color],
+		};
+		
+		if(color == MAX_COLORS){
+			hasty->color_overflow = range;
+		} else if(IslandSize(&range) > 0){
+			hasty->colors[hasty->color_count++] = range;
+		}
+		
+		arbiter_start = range.arbiter_end;
+		constraint_start = range.constraint_end;
+	}
+	
+	// Counting sort the items by color, keeping them in island order otherwise.
+	for(int i=0, item=0; i<large_count; i++){
+		struct Island *island = hasty->islands + i;
+		
+		for(int j=island->arbiter_start; j<island->arbiter_end; j++){
+			hasty->color_arbiters[arbiter_offsets[item_colors[item++]]++] = arbiters[j];
+		}
+	}
+	
+	for(int i=0, item=arbiter_count; i<large_count; i++){
+		struct Island *island = hasty->islands + i;
+		
+		for(int j=island->constraint_start; j<island->constraint_end; j++){
+			hasty->color_constraints[constraint_offsets[item_colors[item++]]++] = constraints[j];
+		}
+	}
+	
+	// The colored islands are handled separately now, so drop them from the island list.
+	hasty->island_cursor = large_count;
+}
+
+// Sort the arbiters and constraints into islands.
+// Returns false if the islands don't account for every arbiter and constraint.
+static bool
+BuildIslands(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	cpArray *arbiters = hasty->island_arbiters;
+	cpArray *constraints = hasty->island_constraints;
+	
+	arbiters->num = 0;
+	constraints->num = 0;
+	hasty->island_count = 0;
+	hasty->island_cursor = 0;
+	
+	cpSpaceEachActiveComponent(space, (cpSpaceComponentIteratorFunc)CollectIsland, hasty);
+	
+	// Constraints between non-dynamic bodies aren't part of any component.
+	// Since they can't change the velocity of any body, they go into an island of their own.
+	int constraint_start = constraints->num;
+	for(int i=0; i<space->constraints->num; i++){
+		cpConstraint *constraint = (cpConstraint *)space->constraints->arr[i];
+		if(cpBodyGetType(constraint->a) != CP_BODY_TYPE_DYNAMIC && cpBodyGetType(constraint->b) != CP_BODY_TYPE_DYNAMIC){
+			cpArrayPush(constraints, constraint);
+		}
+	}
+	
+	if(constraint_start != constraints->num){
+		struct Island island = {arbiters->num, arbiters->num, constraint_start, constraints->num};
+		PushIsland(hasty, island);
+	}
+	
+	cpAssertSoft(arbiters->num == space->arbiters->num, "Internal Error: Arbiter missing from the contact graph.");
+	cpAssertSoft(constraints->num == space->constraints->num, "Internal Error: Constraint missing from the contact graph.");
+	if(arbiters->num != space->arbiters->num || constraints->num != space->constraints->num) return false;
+	
+	qsort(hasty->islands, hasty->island_count, sizeof(struct Island), (int (*)(const void *, const void *))IslandCompare);
+	ColorIslands(hasty);
+	
+	return true;
+}
+
+//MARK: Solver
+
+// Wait until all of the workers reach the barrier.
+static void
+Barrier(cpHastySpace *hasty, unsigned long worker_count)
+{
+	if(worker_count == 1) return;
+	
+	long generation = AtomicLoad(&hasty->barrier_generation);
+	if(AtomicFetchAdd(&hasty->barrier_count, 1) == (long)worker_count - 1){
+		// Last one in resets the barrier and releases the others.
+		hasty->barrier_count = 0;
+		AtomicFetchAdd(&hasty->barrier_generation, 1);
+	} else {
+		for(unsigned long i=0; AtomicLoad(&hasty->barrier_generation) == generation; i++){
+			if(i < hasty->spin_budget){
+				SpinPause(i);
+			} else {
+				ThreadYield();
+			}
+		}
+	}
+}
+
+static void
+SolveIsland(cpHastySpace *hasty, struct Island *island, unsigned long worker)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	cpArbiter **arbiters = (cpArbiter **)hasty->island_arbiters->arr + island->arbiter_start;
+	cpConstraint **constraints = (cpConstraint **)hasty->island_constraints->arr + island->constraint_start;
+	int arbiter_count = island->arbiter_end - island->arbiter_start;
+	int constraint_count = island->constraint_end - island->constraint_start;
+	
+	cpFloat dt = space->curr_dt;
+	
+	for(int i=0; i<space->iterations; i++){
+		ApplyImpulses(hasty, worker, arbiters, arbiter_count, constraints, constraint_count, dt);
+	}
+}
+
+// Solve this worker's share of a color.
+static void
+SolveColor(cpHastySpace *hasty, struct Island *color, unsigned long worker, unsigned long worker_count)
+{
+	int arbiter_start, arbiter_end;
+	WorkerRange(color->arbiter_end - color->arbiter_start, worker, worker_count, &arbiter_start, &arbiter_end);
+	
+	int constraint_start, constraint_end;
+	WorkerRange(color->constraint_end - color->constraint_start, worker, worker_count, &constraint_start, &constraint_end);
+	
+	ApplyImpulses(hasty, worker,
+		hasty->color_arbiters + color->arbiter_start + arbiter_start, arbiter_end - arbiter_start,
+		hasty->color_constraints + color->constraint_start + constraint_start, constraint_end - constraint_start,
+		hasty->space.curr_dt
+	);
+}
+
+static void
+Solver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	
+	// The colored islands are solved together one color at a time, with all of the workers splitting up each color.
+	// The items in a color are independent, so the results don't depend on how they were split up.
+	if(hasty->color_count > 0){
+		struct Island *overflow = &hasty->color_overflow;
+		
+		for(int i=0; i<space->iterations; i++){
+			for(int color=0; color<hasty->color_count; color++){
+				SolveColor(hasty, hasty->colors + color, worker, worker_count);
+				Barrier(hasty, worker_count);
+			}
+			
+			if(IslandSize(overflow) > 0){
+				if(worker == 0) SolveColor(hasty, overflow, 0, 1);
+				Barrier(hasty, worker_count);
+			}
+		}
+	}
+	
+	// Each of the remaining islands is solved start to finish by a single worker.
+	// Since islands don't share any dynamic bodies, the results don't depend on which worker solves which island.
+	// Islands can still share static and kinematic bodies, but the solver never writes to those (see IgnoresImpulses()).
+	for(;;){
+		long i = AtomicFetchAdd(&hasty->island_cursor, 1);
+		if(i >= hasty->island_count) break;
+		
+		SolveIsland(hasty, hasty->islands + i, worker);
+	}
+}
+
+static void
+SerialSolver(cpSpace *space)
+{
+	cpArray *constraints = space->constraints;
+	cpArray *arbiters = space->arbiters;
+	
+	cpFloat dt = space->curr_dt;
+	
+	for(int i=0; i<space->iterations; i++){
+		ApplyImpulses((cpHastySpace *)space, 0, (cpArbiter **)arbiters->arr, arbiters->num, (cpConstraint **)constraints->arr, constraints->num, dt);
+	}
+}
+
+//MARK: Packed Solver
+
+static int
+PushPackedBody(cpHastySpace *hasty, cpBody *body)
+{
+	if(hasty->packed_body_count == hasty->packed_body_capacity){
+		hasty->packed_body_capacity = (hasty->packed_body_capacity ? 2*hasty->packed_body_capacity : 64);
+		hasty->packed_body_list = (cpBody **)cprealloc(hasty->packed_body_list, hasty->packed_body_capacity*sizeof(cpBody *));
+		hasty->packed_bodies = (cpFloat *)cprealloc(hasty->packed_bodies, hasty->packed_body_capacity*PACKED_BODY_SIZE*sizeof(cpFloat));
+	}
+
+	hasty->packed_body_list[hasty->packed_body_count] = body;
+	return hasty->packed_body_count++;
+}
+
+// Returns the offset of the body in packed_bodies, packing it if it hasn't been already.
+static inline int
+PackedBodyOffset(cpHastySpace *hasty, cpBody *body)
+{
+	unsigned int i = BodyTableIndex(hasty, body);
+	if(hasty->body_table_slots[i] < 0) hasty->body_table_slots[i] = PushPackedBody(hasty, body);
+
+	return hasty->body_table_slots[i]*PACKED_BODY_SIZE;
+}
+
+// Color the arbiters and assign them to lanes of the packed blocks.
+static void
+BuildPackedBlocks(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	cpArbiter **arbiters = (cpArbiter **)space->arbiters->arr;
+	cpConstraint **constraints = (cpConstraint **)space->constraints->arr;
+	int arbiter_count = space->arbiters->num;
+	int constraint_count = space->constraints->num;
+
+	ResetBodyTable(hasty, 2*(arbiter_count + constraint_count));
+
+	hasty->packed_body_count = 0;
+	PushPackedBody(hasty, NULL);
+
+	for(int i=0; i<constraint_count; i++){
+		PackedBodyOffset(hasty, constraints[i]->a);
+		PackedBodyOffset(hasty, constraints[i]->b);
+	}
+
+	hasty->packed_constraint_body_count = hasty->packed_body_count;
+
+	hasty->item_colors = (int *)EnsureCapacity(hasty->item_colors, &hasty->item_colors_capacity, arbiter_count, sizeof(int));
+	int *item_colors = hasty->item_colors;
+
+	int counts[MAX_COLORS + 1] = {0};
+	for(int i=0; i<arbiter_count; i++){
+		int color = item_colors[i] = PickColor(hasty, arbiters[i]->body_a, arbiters[i]->body_b);
+		counts[color]++;
+	}
+
+	// Split each color into blocks, keeping the arbiters in order otherwise.
+	// The overflow arbiters can share bodies with each other, so they get a block each.
+	int lane_offsets[MAX_COLORS + 1];
+	int block_count = 0;
+	for(int color=0; color<=MAX_COLORS; color++){
+		hasty->packed_colors[color] = block_count;
+		lane_offsets[color] = block_count*PACKED_WIDTH;
+		block_count += (color == MAX_COLORS ? counts[color] : (counts[color] + PACKED_WIDTH - 1)/PACKED_WIDTH);
+	}
+
+	hasty->packed_colors[MAX_COLORS + 1] = block_count;
+	hasty->packed_block_count = block_count;
+	hasty->packed_blocks = (struct PackedBlock *)EnsureCapacity(hasty->packed_blocks, &hasty->packed_block_capacity, block_count, sizeof(struct PackedBlock));
+
+	for(int i=0; i<block_count; i++){
+		struct PackedBlock *block = hasty->packed_blocks + i;
+
+		for(int lane=0; lane<PACKED_WIDTH; lane++){
+			block->arbiters[lane] = NULL;
+			block->a[lane] = block->b[lane] = 0;
+		}
+	}
+
+	for(int i=0; i<arbiter_count; i++){
+		cpArbiter *arb = arbiters[i];
+		int color = item_colors[i];
+		int offset = lane_offsets[color];
+		lane_offsets[color] += (color == MAX_COLORS ? PACKED_WIDTH : 1);
+
+		struct PackedBlock *block = hasty->packed_blocks + offset/PACKED_WIDTH;
+		int lane = offset%PACKED_WIDTH;
+		block->arbiters[lane] = arb;
+		block->a[lane] = PackedBodyOffset(hasty, arb->body_a);
+		block->b[lane] = PackedBodyOffset(hasty, arb->body_b);
+	}
+}
+
+static void
+PackBlock(struct PackedBlock *block)
+{
+	block->contact_count = 0;
+
+	for(int lane=0; lane<PACKED_WIDTH; lane++){
+		cpArbiter *arb = block->arbiters[lane];
+		int count = (arb ? arb->count : 0);
+		if(count > block->contact_count) block->contact_count = count;
+
+		block->n_x[lane] = (arb ? arb->n.x : 0.0f);
+		block->n_y[lane] = (arb ? arb->n.y : 0.0f);
+		block->surface_vr_x[lane] = (arb ? arb->surface_vr.x : 0.0f);
+		block->surface_vr_y[lane] = (arb ? arb->surface_vr.y : 0.0f);
+		block->u[lane] = (arb ? arb->u : 0.0f);
+
+		for(int i=0; i<CP_MAX_CONTACTS_PER_ARBITER; i++){
+			struct PackedContacts *packed = block->contacts + i;
+
+			if(i < count){
+				struct cpContact *con = arb->contacts + i;
+				packed->r1_x[lane] = con->r1.x; packed->r1_y[lane] = con->r1.y;
+				packed->r2_x[lane] = con->r2.x; packed->r2_y[lane] = con->r2.y;
+				packed->nMass[lane] = con->nMass; packed->tMass[lane] = con->tMass;
+				packed->bias[lane] = con->bias; packed->bounce[lane] = con->bounce;
+				packed->jBias[lane] = con->jBias; packed->jnAcc[lane] = con->jnAcc; packed->jtAcc[lane] = con->jtAcc;
+			} else {
+				packed->r1_x[lane] = packed->r1_y[lane] = 0.0f;
+				packed->r2_x[lane] = packed->r2_y[lane] = 0.0f;
+				packed->nMass[lane] = packed->tMass[lane] = 0.0f;
+				packed->bias[lane] = packed->bounce[lane] = 0.0f;
+				packed->jBias[lane] = packed->jnAcc[lane] = packed->jtAcc[lane] = 0.0f;
+			}
+		}
+	}
+}
+
+static void
+UnpackBlock(struct PackedBlock *block)
+{
+	for(int lane=0; lane<PACKED_WIDTH; lane++){
+		cpArbiter *arb = block->arbiters[lane];
+		if(arb == NULL) continue;
+
+		for(int i=0; i<arb->count; i++){
+			struct cpContact *con = arb->contacts + i;
+			struct PackedContacts *packed = block->contacts + i;
+			con->jBias = packed->jBias[lane];
+			con->jnAcc = packed->jnAcc[lane];
+			con->jtAcc = packed->jtAcc[lane];
+		}
+	}
+}
+
+static void
+PackBody(cpHastySpace *hasty, int slot)
+{
+	cpFloat *packed = hasty->packed_bodies + slot*PACKED_BODY_SIZE;
+	cpBody *body = hasty->packed_body_list[slot];
+
+	if(body){
+		packed[PACKED_V_X] = body->v.x;
+		packed[PACKED_V_Y] = body->v.y;
+		packed[PACKED_W] = body->w;
+		packed[PACKED_V_BIAS_X] = body->v_bias.x;
+		packed[PACKED_V_BIAS_Y] = body->v_bias.y;
+		packed[PACKED_W_BIAS] = body->w_bias;
+		packed[PACKED_M_INV] = body->m_inv;
+		packed[PACKED_I_INV] = body->i_inv;
+	} else {
+		for(int i=0; i<PACKED_BODY_SIZE; i++) packed[i] = 0.0f;
+	}
+}
+
+static void
+UnpackBody(cpHastySpace *hasty, int slot)
+{
+	cpFloat *packed = hasty->packed_bodies + slot*PACKED_BODY_SIZE;
+	cpBody *body = hasty->packed_body_list[slot];
+
+	// Only dynamic bodies can have their velocity changed by the solver.
+	if(body && cpBodyGetType(body) == CP_BODY_TYPE_DYNAMIC){
+		body->v = cpv(packed[PACKED_V_X], packed[PACKED_V_Y]);
+		body->w = packed[PACKED_W];
+		body->v_bias = cpv(packed[PACKED_V_BIAS_X], packed[PACKED_V_BIAS_Y]);
+		body->w_bias = packed[PACKED_W_BIAS];
+	}
+}
+
+static void
+PackedSolver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	PackedKernelFunc kernel = hasty->packed_kernel;
+	struct PackedBlock *blocks = hasty->packed_blocks;
+	cpFloat *bodies = hasty->packed_bodies;
+	cpArray *constraints = space->constraints;
+	cpFloat dt = space->curr_dt;
+	int start, end;
+
+	// Gather up the bodies and contacts.
+	WorkerRange(hasty->packed_block_count, worker, worker_count, &start, &end);
+	for(int i=start; i<end; i++) PackBlock(blocks + i);
+
+	WorkerRange(hasty->packed_body_count, worker, worker_count, &start, &end);
+	for(int i=start; i<end; i++) PackBody(hasty, i);
+
+	Barrier(hasty, worker_count);
+
+	for(int iteration=0; iteration<space->iterations; iteration++){
+		// Blocks in a color don't share any dynamic bodies, so the workers can split them up.
+		for(int color=0; color<MAX_COLORS; color++){
+			int color_start = hasty->packed_colors[color], color_end = hasty->packed_colors[color + 1];
+			if(color_start == color_end) continue;
+
+			WorkerRange(color_end - color_start, worker, worker_count, &start, &end);
+			for(int i=color_start + start; i<color_start + end; i++) kernel(blocks + i, bodies);
+
+			Barrier(hasty, worker_count);
+		}
+
+		int overflow_start = hasty->packed_colors[MAX_COLORS], overflow_end = hasty->packed_colors[MAX_COLORS + 1];
+		if(overflow_start != overflow_end){
+			if(worker == 0){
+				for(int i=overflow_start; i<overflow_end; i++) kernel(blocks + i, bodies);
+			}
+
+			Barrier(hasty, worker_count);
+		}
+
+		// Constraints are solved by a single worker using the regular cpBody structs.
+		if(constraints->num > 0){
+			if(worker == 0){
+				for(int i=1; i<hasty->packed_constraint_body_count; i++) UnpackBody(hasty, i);
+
+				for(int i=0; i<constraints->num; i++){
+					cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+					constraint->klass->applyImpulse(constraint, dt);
+				}
+
+				for(int i=1; i<hasty->packed_constraint_body_count; i++) PackBody(hasty, i);
+			}
+
+			Barrier(hasty, worker_count);
+		}
+	}
+
+	// Scatter the results back.
+	WorkerRange(hasty->packed_block_count, worker, worker_count, &start, &end);
+	for(int i=start; i<end; i++) UnpackBlock(blocks + i);
+
+	WorkerRange(hasty->packed_body_count, worker, worker_count, &start, &end);
+	for(int i=start; i<end; i++) UnpackBody(hasty, i);
+}
+
+//MARK: Collision Detection
+
+// Number of pairs a worker grabs at a time in the narrow phase.
+#define PAIR_BATCH_SIZE 64
+
+static void
+GatherShape(cpShape *shape, cpArray *shapes)
+{
+	cpArrayPush(shapes, shape);
+}
+
+static void
+UpdateShapes(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpArray *shapes = ((cpHastySpace *)space)->shapes;
+	
+	int start, end;
+	WorkerRange(shapes->num, worker, worker_count, &start, &end);
+	
+	if(space->collisionSpeculation){
+		for(int i=start; i<end; i++) cpShapeCacheSweptBB((cpShape *)shapes->arr[i], space->curr_dt);
+	} else {
+		for(int i=start; i<end; i++) cpShapeCacheBB((cpShape *)shapes->arr[i]);
+	}
+}
+
+static void
+NarrowPhase(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	
+	int pair_count = hasty->sorted_pair_count;
+	for(;;){
+		int start = (int)AtomicFetchAdd(&hasty->pair_cursor, PAIR_BATCH_SIZE);
+		if(start >= pair_count) break;
+		
+		int end = (start + PAIR_BATCH_SIZE < pair_count ? start + PAIR_BATCH_SIZE : pair_count);
+		cpSpaceCollidePairs(space, start, end);
+	}
+}
+
+static void
+FindCollisions(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	
+	hasty->shapes->num = 0;
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)GatherShape, hasty->shapes);
+	RunWorkers(hasty, UpdateShapes);
+	CP_PROFILE_MARK(space, CP_PROFILE_UPDATE_SHAPES);
+	
+	// Queue up the pairs, and let the workers grab batches of them sorted by shape types.
+	hasty->sorted_pair_count = cpSpaceFindPairs(space);
+	CP_PROFILE_COUNT(space, pairs, space->pairCount);
+	CP_PROFILE_MARK(space, CP_PROFILE_BROADPHASE);
+	
+	hasty->pair_cursor = 0;
+	RunWorkers(hasty, NarrowPhase);
+	
+	cpSpaceCommitPairs(space);
+	CP_PROFILE_MARK(space, CP_PROFILE_NARROWPHASE);
+}
+
+//MARK: Batched Queries
+
+struct SegmentQueryBatch {
+	const cpVect *starts, *ends;
+	cpFloat radius;
+	cpShapeFilter filter;
+	cpSegmentQueryInfo *out;
+	
+	const int *order;
+	int count;
+};
+
+// Number of segments a worker grabs at a time.
+#define SEGMENT_BATCH_SIZE (2*CP_BBTREE_PACKET_SIZE)
+
+static void
+SegmentQueryBatch(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	struct SegmentQueryBatch *batch = hasty->segment_batch;
+	
+	for(;;){
+		int start = (int)AtomicFetchAdd(&hasty->segment_cursor, SEGMENT_BATCH_SIZE);
+		if(start >= batch->count) break;
+		
+		int end = (start + SEGMENT_BATCH_SIZE < batch->count ? start + SEGMENT_BATCH_SIZE : batch->count);
+		cpSpaceSegmentQueryFirstBatchRange(space, batch->starts, batch->ends, batch->radius, batch->filter, batch->out, batch->order, start, end);
+	}
+}
+
+void
+cpHastySpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, int count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	
+	// Collision callbacks run on the worker threads while the space is locked, so they can't be given more work then.
+	if(hasty->num_threads == 1 || space->locked || count <= SEGMENT_BATCH_SIZE){
+		cpSpaceSegmentQueryFirstBatch(space, starts, ends, radius, filter, out, count);
+		return;
+	}
+	
+	int *order = cpSpaceSegmentQueryBatchOrder(starts, ends, count);
+	struct SegmentQueryBatch batch = {starts, ends, radius, filter, out, order, count};
+	
+	hasty->segment_batch = &batch;
+	hasty->segment_cursor = 0;
+	RunWorkers(hasty, SegmentQueryBatch);
+	hasty->segment_batch = NULL;
+	
+	cpfree(order);
+}
+
+//MARK: Thread Management Functions
+
+static void
+HaltThreads(cpHastySpace *hasty)
+{
+	hasty->work = NULL; // NULL work function means break and exit
+	AtomicFetchAdd(&hasty->job_generation, 1);
+	
+	pthread_mutex_lock(&hasty->mutex); {
+		pthread_cond_broadcast(&hasty->cond_work);
+	} pthread_mutex_unlock(&hasty->mutex);
+	
+	for(unsigned long i=0; i<(hasty->num_threads-1); i++){
+		pthread_join(hasty->workers[i].thread, NULL);
+	}
+}
+
+static unsigned long
+CPUCount(void)
+{
+	unsigned long count = 1;
+	
+#if defined(__APPLE__)
+	size_t size = sizeof(count);
+	sysctlbyname("hw.ncpu", &count, &size, NULL, 0);
+#elif defined(_WIN32) && !defined(__MINGW32__)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	count = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	if(online > 0) count = (unsigned long)online;
+#endif
+	
+	return count;
+}
+
+void
+cpHastySpaceSetThreads(cpSpace *space, unsigned long threads)
+{
+#if TARGET_IPHONE_SIMULATOR == 1
+	// Individual values appear to be written non-atomically when compiled as debug for the simulator.
+	// No idea why, so threads are disabled.
+	threads = 1;
+#endif	
+	
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	HaltThreads(hasty);
+	
+	if(threads == 0) threads = CPUCount();
+	hasty->num_threads = (threads < MAX_THREADS ? threads : MAX_THREADS);
+	
+	// The workers are persistent and idle waiting for the job generation to change.
+	for(unsigned long i=0; i<(hasty->num_threads-1); i++){
+		hasty->workers[i].space = hasty;
+		hasty->workers[i].thread_num = i + 1;
+		hasty->workers[i].generation = hasty->job_generation;
+		
+		pthread_create(&hasty->workers[i].thread, NULL, (void*(*)(void*))WorkerThreadLoop, &hasty->workers[i]);
+	}
+}
+
+unsigned long
+cpHastySpaceGetThreads(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->num_threads;
+}
+
+void
+cpHastySpaceSetSpinBudget(cpSpace *space, unsigned long spins)
+{
+	((cpHastySpace *)space)->spin_budget = spins;
+}
+
+unsigned long
+cpHastySpaceGetSpinBudget(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->spin_budget;
+}
+
+void
+cpHastySpaceSetColorThreshold(cpSpace *space, int threshold)
+{
+	cpAssertHard(threshold > 0, "Color threshold must be positive.");
+	((cpHastySpace *)space)->color_threshold = threshold;
+}
+
+int
+cpHastySpaceGetColorThreshold(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->color_threshold;
+}
+
+// Pick the widest kernels the CPU supports.
+static void
+SelectKernels(cpHastySpace *hasty)
+{
+	hasty->apply_impulse = cpArbiterApplyImpulse_Scalar;
+	hasty->packed_kernel = PackedKernel_Scalar;
+	if(!hasty->vectorized) return;
+	
+#if __ARM_NEON__
+	hasty->apply_impulse = cpArbiterApplyImpulse_NEON;
+#endif
+	
+#if HASTY_SSE2
+	hasty->apply_impulse = cpArbiterApplyImpulse_SSE2;
+	hasty->packed_kernel = PackedKernel_SSE2;
+#endif
+	
+#if HASTY_AVX2
+	if(CPUSupportsAVX2()){
+	#if CP_USE_DOUBLES
+		hasty->apply_impulse = cpArbiterApplyImpulse_AVX2;
+	#endif
+		hasty->packed_kernel = PackedKernel_AVX2;
+	}
+#endif
+}
+
+void
+cpHastySpaceSetVectorized(cpSpace *space, bool vectorized)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	hasty->vectorized = vectorized;
+	SelectKernels(hasty);
+}
+
+bool
+cpHastySpaceGetVectorized(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->vectorized;
+}
+
+void
+cpHastySpaceSetPackedSolver(cpSpace *space, bool packed)
+{
+	((cpHastySpace *)space)->packed_solver = packed;
+}
+
+bool
+cpHastySpaceGetPackedSolver(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->packed_solver;
+}
+
+//MARK: Overriden cpSpace Functions.
+
+cpSpace *
+cpHastySpaceNew(void)
+{
+	cpHastySpace *hasty = (cpHastySpace *)cpcalloc(1, sizeof(cpHastySpace));
+	cpSpaceInit((cpSpace *)hasty);
+	
+	pthread_mutex_init(&hasty->mutex, NULL);
+	pthread_cond_init(&hasty->cond_work, NULL);
+	
+	// TODO magic number, should test this more thoroughly.
+	hasty->constraint_count_threshold = 50;
+	
+	// Enough to bridge the gaps between the parallel phases of a step, but not the gaps between steps.
+	hasty->spin_budget = 10000;
+	
+	hasty->island_arbiters = cpArrayNew(0);
+	hasty->island_constraints = cpArrayNew(0);
+	
+	// Coloring adds a barrier per color to each iteration, so islands need to be large enough to keep every worker busy between them.
+	// See cpHastySpaceSetColorThreshold().
+	hasty->color_threshold = 256;
+	
+	hasty->shapes = cpArrayNew(0);
+	
+	hasty->vectorized = true;
+	SelectKernels(hasty);
+	
+	// Default to 1 thread for determinism.
+	hasty->num_threads = 1;
+	cpHastySpaceSetThreads((cpSpace *)hasty, 1);
+
+	return (cpSpace *)hasty;
+}
+
+void
+cpHastySpaceFree(cpSpace *space)
 {
 	cpHastySpace *hasty = (cpHastySpace *)space;
 	
@@ -586,7 +2233,23 @@ cpHastySpaceFree(cpSpace *space)
 	
 	pthread_mutex_destroy(&hasty->mutex);
 	pthread_cond_destroy(&hasty->cond_work);
-	pthread_cond_destroy(&hasty->cond_resume);
+	
+	cpArrayFree(hasty->island_arbiters);
+	cpArrayFree(hasty->island_constraints);
+	cpfree(hasty->islands);
+	
+	cpfree(hasty->color_arbiters);
+	cpfree(hasty->color_constraints);
+	cpfree(hasty->body_table_bodies);
+	cpfree(hasty->body_table_colors);
+	cpfree(hasty->body_table_slots);
+	cpfree(hasty->item_colors);
+	
+	cpArrayFree(hasty->shapes);
+	
+	cpfree(hasty->packed_bodies);
+	cpfree(hasty->packed_body_list);
+	cpfree(hasty->packed_blocks);
 	
 	cpSpaceFree(space);
 }
@@ -597,7 +2260,11 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 	// don't step if the timestep is 0!
 	if(dt == 0.0f) return;
 	
+	if(space->tuner) cpSpaceTuneSpatialIndex(space);
+	
+	cpHastySpace *hasty = (cpHastySpace *)space;
 	space->stamp++;
+	CP_PROFILE_BEGIN_STEP(space);
 	
 	cpFloat prev_dt = space->curr_dt;
 	space->curr_dt = dt;
@@ -620,30 +2287,26 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 	
 	cpSpaceLock(space); {
 		// Integrate positions
-		for(int i=0; i<bodies->num; i++){
-			cpBody *body = (cpBody *)bodies->arr[i];
-			body->position_func(body, dt);
-		}
+		cpSpaceBeginBullets(space);
+		RunPhase(hasty, IntegratePositions, bodies->num);
+		CP_PROFILE_MARK(space, CP_PROFILE_INTEGRATE_POSITIONS);
 		
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
-		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
-		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		FindCollisions(hasty);
 	} cpSpaceUnlock(space, false);
 	
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
 	cpSpaceProcessComponents(space, dt);
+	CP_PROFILE_MARK(space, CP_PROFILE_PROCESS_COMPONENTS);
 	
 	cpSpaceLock(space); {
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		CP_PROFILE_MARK(space, CP_PROFILE_FILTER_ARBITERS);
 
 		// Prestep the arbiters and constraints.
-		cpFloat slop = space->collisionSlop;
-		cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
-		}
+		RunPhase(hasty, PreStepArbiters, arbiters->num);
 
 		for(int i=0; i<constraints->num; i++){
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
@@ -653,14 +2316,11 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 			
 			constraint->klass->preStep(constraint, dt);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_PRESTEP);
 	
 		// Integrate velocities.
-		cpFloat damping = cpfpow(space->damping, dt);
-		cpVect gravity = space->gravity;
-		for(int i=0; i<bodies->num; i++){
-			cpBody *body = (cpBody *)bodies->arr[i];
-			body->velocity_func(body, gravity, damping, dt);
-		}
+		RunPhase(hasty, IntegrateVelocities, bodies->num);
+		CP_PROFILE_MARK(space, CP_PROFILE_INTEGRATE_VELOCITIES);
 		
 		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
@@ -672,14 +2332,19 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 			constraint->klass->applyCachedImpulse(constraint, dt_coef);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_CACHED_IMPULSES);
 		
 		// Run the impulse solver.
-		cpHastySpace *hasty = (cpHastySpace *)space;
-		if((unsigned long)(arbiters->num + constraints->num) > hasty->constraint_count_threshold){
+		// The island or packed solver is used regardless of the thread count so the results don't depend on it.
+		if(hasty->packed_solver && arbiters->num > 0){
+			BuildPackedBlocks(hasty);
+			RunPhase(hasty, PackedSolver, arbiters->num + constraints->num);
+		} else if((unsigned long)(arbiters->num + constraints->num) > hasty->constraint_count_threshold && BuildIslands(hasty)){
 			RunWorkers(hasty, Solver);
 		} else {
-			Solver(space, 0, 1);
+			SerialSolver(space);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_SOLVER);
 		
 		// Run the constraint post-solve callbacks
 		for(int i=0; i<constraints->num; i++){
@@ -697,4 +2362,7 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 			handler->postSolveFunc(arb, space, handler->userData);
 		}
 	} cpSpaceUnlock(space, true);
+	
+	CP_PROFILE_MARK(space, CP_PROFILE_POST_SOLVE);
+	CP_PROFILE_END_STEP(space);
 }
@@ -307,6 +307,9 @@ cpPolyShapeSetVertsRaw(cpShape *shape, int count, cpVect *verts)
 	cpFloat mass = shape->massInfo.m;
 	shape->massInfo = cpPolyShapeMassInfo(shape->massInfo.m, count, verts, poly->r);
 	if(mass > 0.0f) cpBodyAccumulateMassFromShapes(shape->body);
+	
+	// The planes may have been reallocated, so old snapshots can't be restored.
+	if(shape->space) shape->space->topologyStamp++;
 }
 
 void
@@ -0,0 +1,680 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+// A 4-wide bounding volume hierarchy for shapes that rarely move.
+// The whole hierarchy is built at once and each node stores its four children's bounds in SoA form so they can be tested together.
+// Objects added or changed after it was built go into a small bounding box tree until there are enough of them to make rebuilding worthwhile.
+// This happens regularly for a space's static index, since shapes are moved into it when their bodies fall asleep.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define QBVH_SSE 1
+	#include <xmmintrin.h>
+#endif
+
+//MARK: Basic Structures
+
+typedef struct Leaf {
+	void *obj;
+	cpHashValue hashid;
+	cpBB bb;
+	
+	// Index into the baked leaves, or -1 if the leaf is pending.
+	int index;
+	struct Leaf *next;
+} Leaf;
+
+typedef struct BakedLeaf {
+	cpBB bb;
+	// NULL if the object was removed or changed since the hierarchy was built.
+	void *obj;
+} BakedLeaf;
+
+typedef struct QNode {
+	// Child bounds rounded outwards to floats.
+	float l[4], b[4], r[4], t[4];
+	
+	// Index of a child node, the bitwise complement of a baked leaf index, or 0 for unused children.
+	// The root is node 0, so it can never be a child.
+	int child[4];
+} QNode;
+
+struct cpQBVH {
+	cpSpatialIndex spatialIndex;
+	
+	cpHashSet *leaves;
+	Leaf *pooledLeaves;
+	cpArray *allocatedBuffers;
+	
+	QNode *nodes;
+	int nodeCount, nodeCapacity;
+	
+	BakedLeaf *baked;
+	int bakedCount, bakedCapacity;
+	int removedCount;
+	
+	cpSpatialIndex *pending;
+};
+
+//MARK: Leaf Functions
+
+static void
+LeafRecycle(cpQBVH *bvh, Leaf *leaf)
+{
+	leaf->next = bvh->pooledLeaves;
+	bvh->pooledLeaves = leaf;
+}
+
+static Leaf *
+LeafFromPool(cpQBVH *bvh)
+{
+	Leaf *leaf = bvh->pooledLeaves;
+	
+	if(leaf){
+		bvh->pooledLeaves = leaf->next;
+		return leaf;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Leaf);
+		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		
+		Leaf *buffer = (Leaf *)cpcalloc(1, CP_BUFFER_BYTES);
+		cpArrayPush(bvh->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++) LeafRecycle(bvh, buffer + i);
+		return buffer;
+	}
+}
+
+static int
+leafSetEql(void *obj, Leaf *leaf)
+{
+	return (obj == leaf->obj);
+}
+
+typedef struct LeafContext {
+	cpQBVH *bvh;
+	cpHashValue hashid;
+} LeafContext;
+
+static void *
+leafSetTrans(void *obj, LeafContext *context)
+{
+	Leaf *leaf = LeafFromPool(context->bvh);
+	leaf->obj = obj;
+	leaf->hashid = context->hashid;
+	leaf->bb = context->bvh->spatialIndex.bbfunc(obj);
+	leaf->index = -1;
+	leaf->next = NULL;
+	
+	return leaf;
+}
+
+// Take a leaf out of the baked hierarchy or the pending tree.
+static void
+LeafDetach(cpQBVH *bvh, Leaf *leaf)
+{
+	if(leaf->index >= 0){
+		bvh->baked[leaf->index].obj = NULL;
+		bvh->removedCount++;
+	} else {
+		cpSpatialIndexRemove(bvh->pending, leaf->obj, leaf->hashid);
+	}
+	
+	leaf->index = -1;
+}
+
+//MARK: Building
+
+static inline float
+FloatDown(cpFloat x)
+{
+	float f = (float)x;
+	return (f > x ? nextafterf(f, -INFINITY) : f);
+}
+
+static inline float
+FloatUp(cpFloat x)
+{
+	float f = (float)x;
+	return (f < x ? nextafterf(f, INFINITY) : f);
+}
+
+static inline cpFloat
+cpBBHalfPerimeter(cpBB bb)
+{
+	return (bb.r - bb.l) + (bb.t - bb.b);
+}
+
+static inline cpFloat
+LeafCenter(Leaf *leaf, int axis)
+{
+	// Doubled to save a multiply, only the relative positions matter.
+	return (axis ? leaf->bb.b + leaf->bb.t : leaf->bb.l + leaf->bb.r);
+}
+
+#define SAH_BINS 16
+
+static inline int
+BinIndex(cpFloat center, cpFloat min, cpFloat scale)
+{
+	int bin = (int)((center - min)*scale);
+	return (bin < SAH_BINS ? bin : SAH_BINS - 1);
+}
+
+typedef struct SAHBin {
+	cpBB bb;
+	int count;
+} SAHBin;
+
+// Partition the leaves in two using the same binned surface area heuristic as cpBBTreeOptimize().
+// Returns the number of leaves in the first half.
+static int
+SplitLeaves(Leaf **leaves, int count)
+{
+	if(count < 2) return count;
+	
+	cpFloat min[2], max[2];
+	for(int axis=0; axis<2; axis++){
+		min[axis] = max[axis] = LeafCenter(leaves[0], axis);
+		
+		for(int i=1; i<count; i++){
+			cpFloat center = LeafCenter(leaves[i], axis);
+			min[axis] = cpfmin(min[axis], center);
+			max[axis] = cpfmax(max[axis], center);
+		}
+	}
+	
+	cpFloat bestCost = INFINITY;
+	int bestAxis = -1, bestSplit = 0;
+	
+	for(int axis=0; axis<2; axis++){
+		if(max[axis] <= min[axis]) continue;
+		cpFloat scale = SAH_BINS/(max[axis] - min[axis]);
+		
+		SAHBin bins[SAH_BINS];
+		for(int i=0; i<SAH_BINS; i++) bins[i].count = 0;
+		
+		for(int i=0; i<count; i++){
+			Leaf *leaf = leaves[i];
+			SAHBin *bin = bins + BinIndex(LeafCenter(leaf, axis), min[axis], scale);
+			bin->bb = (bin->count ? cpBBMerge(bin->bb, leaf->bb) : leaf->bb);
+			bin->count++;
+		}
+		
+		cpFloat rightCost[SAH_BINS];
+		cpBB bb = bins[SAH_BINS - 1].bb;
+		int n = 0;
+		
+		for(int i=SAH_BINS - 1; i>0; i--){
+			if(bins[i].count){
+				bb = (n ? cpBBMerge(bb, bins[i].bb) : bins[i].bb);
+				n += bins[i].count;
+			}
+			
+			rightCost[i] = (n ? cpBBHalfPerimeter(bb)*n : 0.0f);
+		}
+		
+		n = 0;
+		for(int i=0; i<SAH_BINS - 1; i++){
+			if(bins[i].count){
+				bb = (n ? cpBBMerge(bb, bins[i].bb) : bins[i].bb);
+				n += bins[i].count;
+			}
+			
+			if(0 < n && n < count){
+				cpFloat cost = cpBBHalfPerimeter(bb)*n + rightCost[i + 1];
+				if(cost < bestCost){
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i + 1;
+				}
+			}
+		}
+	}
+	
+	// All of the leaves have the same center, so split them in half.
+	if(bestAxis < 0) return count/2;
+	
+	cpFloat scale = SAH_BINS/(max[bestAxis] - min[bestAxis]);
+	int right = count;
+	
+	for(int left=0; left < right;){
+		Leaf *leaf = leaves[left];
+		if(BinIndex(LeafCenter(leaf, bestAxis), min[bestAxis], scale) >= bestSplit){
+			right--;
+			leaves[left] = leaves[right];
+			leaves[right] = leaf;
+		} else {
+			left++;
+		}
+	}
+	
+	return right;
+}
+
+static int
+BuildNode(cpQBVH *bvh, Leaf **leaves, int count)
+{
+	int index = bvh->nodeCount++;
+	cpAssertSoft(index < bvh->nodeCapacity, "Internal Error: Node array is too small.");
+	
+	// Split the leaves into (up to) four groups.
+	int start[4], counts[4], groups = 0;
+	if(count <= 4){
+		for(int i=0; i<count; i++){
+			start[groups] = i;
+			counts[groups] = 1;
+			groups++;
+		}
+	} else {
+		int half = SplitLeaves(leaves, count);
+		int halves[2][2] = {{0, half}, {half, count - half}};
+		
+		for(int i=0; i<2; i++){
+			int first = halves[i][0], n = halves[i][1];
+			int split = SplitLeaves(leaves + first, n);
+			
+			if(split == n){
+				start[groups] = first;
+				counts[groups] = n;
+				groups++;
+			} else {
+				start[groups] = first;
+				counts[groups] = split;
+				groups++;
+				
+				start[groups] = first + split;
+				counts[groups] = n - split;
+				groups++;
+			}
+		}
+	}
+	
+	int child[4] = {0, 0, 0, 0};
+	cpBB bounds[4];
+	
+	for(int i=0; i<groups; i++){
+		Leaf **group = leaves + start[i];
+		
+		if(counts[i] == 1){
+			Leaf *leaf = group[0];
+			leaf->index = bvh->bakedCount++;
+			
+			BakedLeaf baked = {leaf->bb, leaf->obj};
+			bvh->baked[leaf->index] = baked;
+			
+			child[i] = ~leaf->index;
+			bounds[i] = leaf->bb;
+		} else {
+			cpBB bb = group[0]->bb;
+			for(int j=1; j<counts[i]; j++) bb = cpBBMerge(bb, group[j]->bb);
+			
+			child[i] = BuildNode(bvh, group, counts[i]);
+			bounds[i] = bb;
+		}
+	}
+	
+	QNode *node = bvh->nodes + index;
+	for(int i=0; i<4; i++){
+		node->child[i] = child[i];
+		
+		if(child[i]){
+			node->l[i] = FloatDown(bounds[i].l);
+			node->b[i] = FloatDown(bounds[i].b);
+			node->r[i] = FloatUp(bounds[i].r);
+			node->t[i] = FloatUp(bounds[i].t);
+		} else {
+			// Empty bounds never overlap anything.
+			node->l[i] = node->b[i] = INFINITY;
+			node->r[i] = node->t[i] = -INFINITY;
+		}
+	}
+	
+	return index;
+}
+
+static void
+GatherLeaf(Leaf *leaf, Leaf ***cursor)
+{
+	(**cursor) = leaf;
+	(*cursor)++;
+}
+
+static void
+Rebuild(cpQBVH *bvh)
+{
+	int count = cpHashSetCount(bvh->leaves);
+	
+	bvh->nodeCount = 0;
+	bvh->bakedCount = 0;
+	bvh->removedCount = 0;
+	
+	if(cpSpatialIndexCount(bvh->pending)){
+		cpSpatialIndexFree(bvh->pending);
+		bvh->pending = cpBBTreeNew(bvh->spatialIndex.bbfunc, NULL);
+	}
+	
+	if(count == 0) return;
+	
+	Leaf **leaves = (Leaf **)cpcalloc(count, sizeof(Leaf *));
+	Leaf **cursor = leaves;
+	cpHashSetEach(bvh->leaves, (cpHashSetIteratorFunc)GatherLeaf, &cursor);
+	
+	// Every node has at least two children, except when there is only one leaf.
+	if(bvh->nodeCapacity < count){
+		bvh->nodeCapacity = count;
+		bvh->nodes = (QNode *)cprealloc(bvh->nodes, count*sizeof(QNode));
+	}
+	
+	if(bvh->bakedCapacity < count){
+		bvh->bakedCapacity = count;
+		bvh->baked = (BakedLeaf *)cprealloc(bvh->baked, count*sizeof(BakedLeaf));
+	}
+	
+	BuildNode(bvh, leaves, count);
+	cpfree(leaves);
+}
+
+// Rebuild once enough of the hierarchy is out of date that checking the pending tree and skipping removed leaves becomes a significant cost.
+static void
+RebuildIfNeeded(cpQBVH *bvh)
+{
+	int stale = cpSpatialIndexCount(bvh->pending) + bvh->removedCount;
+	if(stale > 16 + bvh->bakedCount/8) Rebuild(bvh);
+}
+
+//MARK: Memory Management Functions
+
+cpQBVH *
+cpQBVHAlloc(void)
+{
+	return (cpQBVH *)cpcalloc(1, sizeof(cpQBVH));
+}
+
+cpSpatialIndex *
+cpQBVHInit(cpQBVH *bvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)bvh, Klass(), bbfunc, staticIndex);
+	
+	bvh->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
+	bvh->pooledLeaves = NULL;
+	bvh->allocatedBuffers = cpArrayNew(0);
+	
+	bvh->nodes = NULL;
+	bvh->nodeCount = bvh->nodeCapacity = 0;
+	
+	bvh->baked = NULL;
+	bvh->bakedCount = bvh->bakedCapacity = 0;
+	bvh->removedCount = 0;
+	
+	bvh->pending = cpBBTreeNew(bbfunc, NULL);
+	
+	return (cpSpatialIndex *)bvh;
+}
+
+cpSpatialIndex *
+cpQBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpQBVHInit(cpQBVHAlloc(), bbfunc, staticIndex);
+}
+
+static void
+cpQBVHDestroy(cpQBVH *bvh)
+{
+	cpHashSetFree(bvh->leaves);
+	
+	if(bvh->allocatedBuffers) cpArrayFreeEach(bvh->allocatedBuffers, cpfree);
+	cpArrayFree(bvh->allocatedBuffers);
+	
+	cpfree(bvh->nodes);
+	cpfree(bvh->baked);
+	cpSpatialIndexFree(bvh->pending);
+}
+
+//MARK: Misc
+
+static int
+cpQBVHCount(cpQBVH *bvh)
+{
+	return cpHashSetCount(bvh->leaves);
+}
+
+typedef struct eachContext {
+	cpSpatialIndexIteratorFunc func;
+	void *data;
+} eachContext;
+
+static void each_helper(Leaf *leaf, eachContext *context){context->func(leaf->obj, context->data);}
+
+static void
+cpQBVHEach(cpQBVH *bvh, cpSpatialIndexIteratorFunc func, void *data)
+{
+	eachContext context = {func, data};
+	cpHashSetEach(bvh->leaves, (cpHashSetIteratorFunc)each_helper, &context);
+}
+
+static int
+cpQBVHContains(cpQBVH *bvh, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(bvh->leaves, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpQBVHInsert(cpQBVH *bvh, void *obj, cpHashValue hashid)
+{
+	LeafContext context = {bvh, hashid};
+	cpHashSetInsert(bvh->leaves, hashid, obj, (cpHashSetTransFunc)leafSetTrans, &context);
+	cpSpatialIndexInsert(bvh->pending, obj, hashid);
+	
+	RebuildIfNeeded(bvh);
+}
+
+static void
+cpQBVHRemove(cpQBVH *bvh, void *obj, cpHashValue hashid)
+{
+	Leaf *leaf = (Leaf *)cpHashSetRemove(bvh->leaves, hashid, obj);
+	if(leaf){
+		LeafDetach(bvh, leaf);
+		LeafRecycle(bvh, leaf);
+		
+		RebuildIfNeeded(bvh);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+UpdateLeaf(Leaf *leaf, cpQBVH *bvh)
+{
+	leaf->bb = bvh->spatialIndex.bbfunc(leaf->obj);
+}
+
+static void
+cpQBVHReindex(cpQBVH *bvh)
+{
+	cpHashSetEach(bvh->leaves, (cpHashSetIteratorFunc)UpdateLeaf, bvh);
+	Rebuild(bvh);
+}
+
+static void
+cpQBVHReindexObject(cpQBVH *bvh, void *obj, cpHashValue hashid)
+{
+	Leaf *leaf = (Leaf *)cpHashSetFind(bvh->leaves, hashid, obj);
+	if(leaf){
+		if(leaf->index >= 0){
+			LeafDetach(bvh, leaf);
+			UpdateLeaf(leaf, bvh);
+			cpSpatialIndexInsert(bvh->pending, obj, hashid);
+		} else {
+			UpdateLeaf(leaf, bvh);
+			cpSpatialIndexReindexObject(bvh->pending, obj, hashid);
+		}
+		
+		RebuildIfNeeded(bvh);
+	}
+}
+
+//MARK: Query Functions
+
+// Returns a bitmask of the children whose bounds overlap the query box.
+static inline int
+NodeOverlaps(QNode *node, const float *query)
+{
+#if QBVH_SSE
+	__m128 l = _mm_cmple_ps(_mm_loadu_ps(node->l), _mm_set1_ps(query[2]));
+	__m128 r = _mm_cmple_ps(_mm_set1_ps(query[0]), _mm_loadu_ps(node->r));
+	__m128 b = _mm_cmple_ps(_mm_loadu_ps(node->b), _mm_set1_ps(query[3]));
+	__m128 t = _mm_cmple_ps(_mm_set1_ps(query[1]), _mm_loadu_ps(node->t));
+	return _mm_movemask_ps(_mm_and_ps(_mm_and_ps(l, r), _mm_and_ps(b, t)));
+#else
+	int mask = 0;
+	for(int i=0; i<4; i++){
+		if(node->l[i] <= query[2] && query[0] <= node->r[i] && node->b[i] <= query[3] && query[1] <= node->t[i]) mask |= 1<<i;
+	}
+	
+	return mask;
+#endif
+}
+
+static void
+NodeQuery(cpQBVH *bvh, int index, const float *query, void *obj, cpBB bb, int minLeaf, cpSpatialIndexQueryFunc func, void *data)
+{
+	QNode *node = bvh->nodes + index;
+	
+	for(int mask = NodeOverlaps(node, query), i = 0; mask; mask >>= 1, i++){
+		if(!(mask&1)) continue;
+		
+		int child = node->child[i];
+		if(child < 0){
+			BakedLeaf *leaf = bvh->baked + ~child;
+			if(leaf->obj && ~child >= minLeaf && cpBBIntersects(leaf->bb, bb)) func(obj, leaf->obj, 0, data);
+		} else {
+			NodeQuery(bvh, child, query, obj, bb, minLeaf, func, data);
+		}
+	}
+}
+
+static void
+QueryBaked(cpQBVH *bvh, void *obj, cpBB bb, int minLeaf, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(bvh->nodeCount){
+		float query[4] = {FloatDown(bb.l), FloatDown(bb.b), FloatUp(bb.r), FloatUp(bb.t)};
+		NodeQuery(bvh, 0, query, obj, bb, minLeaf, func, data);
+	}
+}
+
+static void
+cpQBVHQuery(cpQBVH *bvh, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	QueryBaked(bvh, obj, bb, 0, func, data);
+	cpSpatialIndexQuery(bvh->pending, obj, bb, func, data);
+}
+
+static cpFloat
+NodeSegmentQuery(cpQBVH *bvh, int index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	QNode *node = bvh->nodes + index;
+	
+	// Sort the children that the segment hits from nearest to farthest.
+	cpFloat ts[4];
+	int order[4], count = 0;
+	
+	for(int i=0; i<4; i++){
+		if(!node->child[i]) continue;
+		
+		cpFloat t = cpBBSegmentQuery(cpBBNew(node->l[i], node->b[i], node->r[i], node->t[i]), a, b);
+		if(t < t_exit){
+			int j = count++;
+			for(; j > 0 && ts[j - 1] > t; j--){
+				ts[j] = ts[j - 1];
+				order[j] = order[j - 1];
+			}
+			
+			ts[j] = t;
+			order[j] = i;
+		}
+	}
+	
+	for(int i=0; i<count && ts[i] < t_exit; i++){
+		int child = node->child[order[i]];
+		
+		if(child < 0){
+			void *leafObj = bvh->baked[~child].obj;
+			if(leafObj) t_exit = cpfmin(t_exit, func(obj, leafObj, data));
+		} else {
+			t_exit = cpfmin(t_exit, NodeSegmentQuery(bvh, child, obj, a, b, t_exit, func, data));
+		}
+	}
+	
+	return t_exit;
+}
+
+static void
+cpQBVHSegmentQuery(cpQBVH *bvh, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(bvh->nodeCount) t_exit = NodeSegmentQuery(bvh, 0, obj, a, b, t_exit, func, data);
+	cpSpatialIndexSegmentQuery(bvh->pending, obj, a, b, t_exit, func, data);
+}
+
+//MARK: Reindex/Query
+
+static void
+cpQBVHReindexQuery(cpQBVH *bvh, cpSpatialIndexQueryFunc func, void *data)
+{
+	cpQBVHReindex(bvh);
+	
+	// Only report pairs with later leaves so each pair is found once.
+	for(int i=0; i<bvh->bakedCount; i++){
+		BakedLeaf *leaf = bvh->baked + i;
+		QueryBaked(bvh, leaf->obj, leaf->bb, i + 1, func, data);
+	}
+	
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)bvh, bvh->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpQBVHDestroy,
+	
+	(cpSpatialIndexCountImpl)cpQBVHCount,
+	(cpSpatialIndexEachImpl)cpQBVHEach,
+	(cpSpatialIndexContainsImpl)cpQBVHContains,
+	
+	(cpSpatialIndexInsertImpl)cpQBVHInsert,
+	(cpSpatialIndexRemoveImpl)cpQBVHRemove,
+	
+	(cpSpatialIndexReindexImpl)cpQBVHReindex,
+	(cpSpatialIndexReindexObjectImpl)cpQBVHReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpQBVHReindexQuery,
+	
+	(cpSpatialIndexQueryImpl)cpQBVHQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpQBVHSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(void){return &klass;}
@@ -115,6 +115,12 @@ cpShapeGetBB(const cpShape *shape)
 	return shape->bb;
 }
 
+cpBB
+cpShapeGetSweptBB(const cpShape *shape)
+{
+	return shape->sweptBB;
+}
+
 bool
 cpShapeGetSensor(const cpShape *shape)
 {
@@ -204,7 +210,16 @@ void
 cpShapeSetFilter(cpShape *shape, cpShapeFilter filter)
 {
 	cpBodyActivate(shape->body);
+	
+	cpBitmask categories = shape->filter.categories;
 	shape->filter = filter;
+	
+	// The trees keep track of the categories of their shapes to speed up filtered queries.
+	cpSpace *space = shape->space;
+	if(space && filter.categories != categories){
+		cpBBTreeUpdateCategories(space->staticShapes, shape, shape->hashid);
+		cpBBTreeUpdateCategories(space->dynamicShapes, shape, shape->hashid);
+	}
 }
 
 cpBB
@@ -213,10 +228,22 @@ cpShapeCacheBB(cpShape *shape)
 	return cpShapeUpdate(shape, shape->body->transform);
 }
 
+cpBB
+cpShapeCacheSweptBB(cpShape *shape, cpFloat dt)
+{
+	cpBB bb = cpShapeCacheBB(shape);
+	cpVect delta = cpvmult(shape->body->v, dt);
+	
+	return (shape->sweptBB = cpBBNew(
+		bb.l + cpfmin(delta.x, 0.0f), bb.b + cpfmin(delta.y, 0.0f),
+		bb.r + cpfmax(delta.x, 0.0f), bb.t + cpfmax(delta.y, 0.0f)
+	));
+}
+
 cpBB
 cpShapeUpdate(cpShape *shape, cpTransform transform)
 {
-	return (shape->bb = shape->klass->cacheData(shape, transform));
+	return (shape->bb = shape->sweptBB = shape->klass->cacheData(shape, transform));
 }
 
 cpFloat
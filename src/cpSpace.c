@@ -103,7 +103,10 @@ cpCollisionHandler cpCollisionHandlerDoNothing = {
 };
 
 // function to get the estimated velocity of a shape for the cpBBTree.
-static cpVect ShapeVelocityFunc(cpShape *shape){return shape->body->v;}
+cpVect cpShapeVelocityFunc(cpShape *shape){return shape->body->v;}
+
+// function to get the collision categories of a shape for the cpBBTree.
+cpBitmask cpShapeCategoriesFunc(cpShape *shape){return shape->filter.categories;}
 
 // Used for disposing of collision handlers.
 static void FreeWrap(void *ptr, void *unused){cpfree(ptr);}
@@ -136,14 +139,18 @@ cpSpaceInit(cpSpace *space)
 	space->collisionSlop = 0.1f;
 	space->collisionBias = cpfpow(1.0f - 0.1f, 60.0f);
 	space->collisionPersistence = 3;
+	space->collisionCoherence = 0.0f;
+	space->collisionSpeculation = false;
 	
 	space->locked = 0;
 	space->stamp = 0;
 	
 	space->shapeIDCounter = 0;
 	space->staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, space->staticShapes);
-	cpBBTreeSetVelocityFunc(space->dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetSweptBB, space->staticShapes);
+	cpBBTreeSetVelocityFunc(space->dynamicShapes, (cpBBTreeVelocityFunc)cpShapeVelocityFunc);
+	cpBBTreeSetCategoriesFunc(space->staticShapes, (cpBBTreeCategoriesFunc)cpShapeCategoriesFunc);
+	cpBBTreeSetCategoriesFunc(space->dynamicShapes, (cpBBTreeCategoriesFunc)cpShapeCategoriesFunc);
 	
 	space->allocatedBuffers = cpArrayNew(0);
 	
@@ -151,6 +158,7 @@ cpSpaceInit(cpSpace *space)
 	space->staticBodies = cpArrayNew(0);
 	space->sleepingComponents = cpArrayNew(0);
 	space->rousedBodies = cpArrayNew(0);
+	space->bulletBodies = cpArrayNew(0);
 	
 	space->sleepTimeThreshold = INFINITY;
 	space->idleSpeedThreshold = 0.0f;
@@ -161,6 +169,13 @@ cpSpaceInit(cpSpace *space)
 	space->contactBuffersHead = NULL;
 	space->cachedArbiters = cpHashSetNew(0, (cpHashSetEqlFunc)arbiterSetEql);
 	
+	space->pairs = space->prevPairs = NULL;
+	space->pairCount = space->pairCapacity = 0;
+	space->prevPairCount = space->prevPairCapacity = 0;
+	space->pairOrder = NULL;
+	space->pairContacts = NULL;
+	space->pairScratchCapacity = 0;
+	
 	space->constraints = cpArrayNew(0);
 	
 	space->usesWildcards = false;
@@ -170,6 +185,12 @@ cpSpaceInit(cpSpace *space)
 	space->postStepCallbacks = cpArrayNew(0);
 	space->skipPostStep = false;
 	
+	space->profiler = NULL;
+	space->tuner = NULL;
+	
+	space->topologyStamp = 0;
+	space->snapshotScratch = NULL;
+	
 	cpBody *staticBody = cpBodyInit(&space->_staticBody, 0.0f, 0.0f);
 	cpBodySetType(staticBody, CP_BODY_TYPE_STATIC);
 	cpSpaceSetStaticBody(space, staticBody);
@@ -197,6 +218,7 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->staticBodies);
 	cpArrayFree(space->sleepingComponents);
 	cpArrayFree(space->rousedBodies);
+	cpArrayFree(space->bulletBodies);
 	
 	cpArrayFree(space->constraints);
 	
@@ -205,6 +227,19 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->arbiters);
 	cpArrayFree(space->pooledArbiters);
 	
+	cpfree(space->pairs);
+	cpfree(space->prevPairs);
+	cpfree(space->pairOrder);
+	cpfree(space->pairContacts);
+	
+	if(space->snapshotScratch) cpArrayFree(space->snapshotScratch);
+	
+#ifdef CP_ENABLE_PROFILER
+	cpSpaceSetProfileHistoryLength(space, 0);
+#endif
+	
+	cpfree(space->tuner);
+	
 	if(space->allocatedBuffers){
 		cpArrayFreeEach(space->allocatedBuffers, cpfree);
 		cpArrayFree(space->allocatedBuffers);
@@ -335,6 +370,30 @@ cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence)
 	space->collisionPersistence = collisionPersistence;
 }
 
+cpFloat
+cpSpaceGetCollisionCoherence(const cpSpace *space)
+{
+	return space->collisionCoherence;
+}
+
+void
+cpSpaceSetCollisionCoherence(cpSpace *space, cpFloat collisionCoherence)
+{
+	space->collisionCoherence = collisionCoherence;
+}
+
+bool
+cpSpaceGetCollisionSpeculation(const cpSpace *space)
+{
+	return space->collisionSpeculation;
+}
+
+void
+cpSpaceSetCollisionSpeculation(cpSpace *space, bool collisionSpeculation)
+{
+	space->collisionSpeculation = collisionSpeculation;
+}
+
 cpDataPointer
 cpSpaceGetUserData(const cpSpace *space)
 {
@@ -433,6 +492,7 @@ cpSpaceAddShape(cpSpace *space, cpShape *shape)
 	cpShapeUpdate(shape, body->transform);
 	cpSpatialIndexInsert(isStatic ? space->staticShapes : space->dynamicShapes, shape, shape->hashid);
 	shape->space = space;
+	space->topologyStamp++;
 		
 	return shape;
 }
@@ -445,7 +505,9 @@ cpSpaceAddBody(cpSpace *space, cpBody *body)
 	cpAssertSpaceUnlocked(space);
 	
 	cpArrayPush(cpSpaceArrayForBodyType(space, cpBodyGetType(body)), body);
+	if(body->bullet.enabled) cpArrayPush(space->bulletBodies, body);
 	body->space = space;
+	space->topologyStamp++;
 	
 	return body;
 }
@@ -469,6 +531,7 @@ cpSpaceAddConstraint(cpSpace *space, cpConstraint *constraint)
 	constraint->next_a = a->constraintList; a->constraintList = constraint;
 	constraint->next_b = b->constraintList; b->constraintList = constraint;
 	constraint->space = space;
+	space->topologyStamp++;
 	
 	return constraint;
 }
@@ -500,6 +563,9 @@ cachedArbitersFilter(cpArbiter *arb, struct arbiterFilterContext *context)
 			handler->separateFunc(arb, context->space, handler->userData);
 		}
 		
+		// Clear the stamp so persistent broadphase pairs stop using it.
+		arb->stamp = 0;
+		
 		cpArbiterUnthread(arb);
 		cpArrayDeleteObj(context->space->arbiters, arb);
 		cpArrayPush(context->space->pooledArbiters, arb);
@@ -538,6 +604,7 @@ cpSpaceRemoveShape(cpSpace *space, cpShape *shape)
 	cpSpatialIndexRemove(isStatic ? space->staticShapes : space->dynamicShapes, shape, shape->hashid);
 	shape->space = NULL;
 	shape->hashid = 0;
+	space->topologyStamp++;
 }
 
 void
@@ -552,7 +619,9 @@ cpSpaceRemoveBody(cpSpace *space, cpBody *body)
 	cpBodyActivate(body);
 //	cpSpaceFilterArbiters(space, body, NULL);
 	cpArrayDeleteObj(cpSpaceArrayForBodyType(space, cpBodyGetType(body)), body);
+	if(body->bullet.enabled) cpArrayDeleteObj(space->bulletBodies, body);
 	body->space = NULL;
+	space->topologyStamp++;
 }
 
 void
@@ -568,6 +637,7 @@ cpSpaceRemoveConstraint(cpSpace *space, cpConstraint *constraint)
 	cpBodyRemoveConstraint(constraint->a, constraint);
 	cpBodyRemoveConstraint(constraint->b, constraint);
 	constraint->space = NULL;
+	space->topologyStamp++;
 }
 
 bool cpSpaceContainsShape(cpSpace *space, cpShape *shape)
@@ -677,6 +747,25 @@ cpSpaceReindexShapesForBody(cpSpace *space, cpBody *body)
 	CP_BODY_FOREACH_SHAPE(body, shape) cpSpaceReindexShape(space, shape);
 }
 
+void
+cpSpaceOptimizeSpatialIndexes(cpSpace *space)
+{
+	cpAssertHard(!space->locked, "You cannot manually optimize the spatial indexes while the space is locked. Wait until the current query or step is complete.");
+	
+	// The other spatial indexes don't need to be optimized.
+	if(cpSpatialIndexIsBBTree(space->staticShapes)) cpBBTreeOptimize(space->staticShapes);
+	if(cpSpatialIndexIsBBTree(space->dynamicShapes)) cpBBTreeOptimize(space->dynamicShapes);
+}
+
+void
+cpSpaceOptimizeSpatialIndexesIncremental(cpSpace *space, int budget)
+{
+	cpAssertHard(!space->locked, "You cannot manually optimize the spatial indexes while the space is locked. Wait until the current query or step is complete.");
+	
+	if(cpSpatialIndexIsBBTree(space->staticShapes)) cpBBTreeOptimizeIncremental(space->staticShapes, budget);
+	if(cpSpatialIndexIsBBTree(space->dynamicShapes)) cpBBTreeOptimizeIncremental(space->dynamicShapes, budget);
+}
+
 
 static void
 copyShapes(cpShape *shape, cpSpatialIndex *index)
@@ -684,18 +773,100 @@ copyShapes(cpShape *shape, cpSpatialIndex *index)
 	cpSpatialIndexInsert(index, shape, shape->hashid);
 }
 
+static void
+gatherShapes(cpShape *shape, cpArray *shapes)
+{
+	cpArrayPush(shapes, shape);
+}
+
+void
+cpSpaceReplaceDynamicShapes(cpSpace *space, cpSpatialIndex *dynamicShapes)
+{
+	cpAssertHard(!dynamicShapes->staticIndex, "Internal Error: The new dynamic index should not have a static index yet.");
+	cpSpatialIndex *staticShapes = space->staticShapes;
+	
+	cpArray *shapes = cpArrayNew(0);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)gatherShapes, shapes);
+	
+	// Removing the shapes one by one clears any pairs a bounding box tree shares with the static index.
+	for(int i=0; i<shapes->num; i++){
+		cpShape *shape = (cpShape *)shapes->arr[i];
+		cpSpatialIndexRemove(space->dynamicShapes, shape, shape->hashid);
+	}
+	
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	dynamicShapes->staticIndex = staticShapes;
+	staticShapes->dynamicIndex = dynamicShapes;
+	space->dynamicShapes = dynamicShapes;
+	
+	for(int i=0; i<shapes->num; i++) copyShapes((cpShape *)shapes->arr[i], dynamicShapes);
+	
+	// Reinsert the static shapes too, so that a static bounding box tree pairs them with the new index as if they had just been added.
+	shapes->num = 0;
+	cpSpatialIndexEach(staticShapes, (cpSpatialIndexIteratorFunc)gatherShapes, shapes);
+	
+	for(int i=0; i<shapes->num; i++){
+		cpShape *shape = (cpShape *)shapes->arr[i];
+		cpSpatialIndexRemove(staticShapes, shape, shape->hashid);
+		cpSpatialIndexInsert(staticShapes, shape, shape->hashid);
+	}
+	
+	cpArrayFree(shapes);
+	space->topologyStamp++;
+}
+
 void
 cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count)
 {
 	cpSpatialIndex *staticShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	cpSpatialIndex *dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
+	cpSpatialIndex *dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetSweptBB, staticShapes);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+	space->topologyStamp++;
+}
+
+void
+cpSpaceUseHashGrid(cpSpace *space, cpFloat dim, int levels)
+{
+	cpSpatialIndex *staticShapes = cpHashGridNew(dim, levels, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpHashGridNew(dim, levels, (cpSpatialIndexBBFunc)cpShapeGetSweptBB, staticShapes);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	cpSpatialIndexReindex(staticShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+	space->topologyStamp++;
+}
+
+void
+cpSpaceUseStaticQBVH(cpSpace *space)
+{
+	cpSpatialIndex *staticShapes = cpQBVHNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetSweptBB, staticShapes);
+	cpBBTreeSetVelocityFunc(dynamicShapes, (cpBBTreeVelocityFunc)cpShapeVelocityFunc);
+	cpBBTreeSetCategoriesFunc(dynamicShapes, (cpBBTreeCategoriesFunc)cpShapeCategoriesFunc);
 	
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
 	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	cpSpatialIndexReindex(staticShapes);
 	
 	cpSpatialIndexFree(space->staticShapes);
 	cpSpatialIndexFree(space->dynamicShapes);
 	
 	space->staticShapes = staticShapes;
 	space->dynamicShapes = dynamicShapes;
+	space->topologyStamp++;
 }
@@ -306,6 +306,43 @@ cpSpaceProcessComponents(cpSpace *space, cpFloat dt)
 	}
 }
 
+// Flood fill the contact graph of the awake bodies and call func() once for the root of each component.
+// Unlike cpSpaceProcessComponents(), this works regardless of whether sleeping is enabled.
+// The component pointers are only valid during the callback and are reset before returning.
+void
+cpSpaceEachActiveComponent(cpSpace *space, cpSpaceComponentIteratorFunc func, void *data)
+{
+	cpArray *bodies = space->dynamicBodies;
+	
+	for(int i=0; i<bodies->num; i++){
+		cpBody *body = (cpBody*)bodies->arr[i];
+		if(ComponentRoot(body) == NULL) FloodFillComponent(body, body);
+	}
+	
+	// The first body of each component found in the array is its root.
+	for(int i=0; i<bodies->num; i++){
+		cpBody *body = (cpBody*)bodies->arr[i];
+		if(ComponentRoot(body) == body) func(body, data);
+	}
+	
+	// Only sleeping bodies retain their component node pointers.
+	// Components can contain bodies that aren't in the space, so walk the components to reset them.
+	for(int i=0; i<bodies->num; i++){
+		cpBody *root = (cpBody*)bodies->arr[i];
+		if(ComponentRoot(root) != root) continue;
+		
+		cpBody *body = root;
+		while(body){
+			cpBody *next = body->sleeping.next;
+			
+			body->sleeping.root = NULL;
+			body->sleeping.next = NULL;
+			
+			body = next;
+		}
+	}
+}
+
 void
 cpBodySleep(cpBody *body)
 {
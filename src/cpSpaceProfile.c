@@ -0,0 +1,159 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+#if defined(_WIN32)
+	#include <windows.h>
+	
+	double
+	cpProfileTime(void)
+	{
+		LARGE_INTEGER count, frequency;
+		QueryPerformanceCounter(&count);
+		QueryPerformanceFrequency(&frequency);
+		return (double)count.QuadPart/(double)frequency.QuadPart;
+	}
+#else
+	#include <time.h>
+	
+	double
+	cpProfileTime(void)
+	{
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+	}
+#endif
+
+#ifdef CP_ENABLE_PROFILER
+
+//MARK: Recording
+
+void
+cpSpaceProfileBeginStep(cpSpace *space)
+{
+	struct cpSpaceProfiler *profiler = space->profiler;
+	memset(&profiler->current, 0, sizeof(cpSpaceProfile));
+	profiler->current.stamp = space->stamp;
+	profiler->stepStart = profiler->lastMark = cpProfileTime();
+}
+
+void
+cpSpaceProfileMark(cpSpace *space, cpSpaceProfileStage stage)
+{
+	struct cpSpaceProfiler *profiler = space->profiler;
+	double now = cpProfileTime();
+	profiler->current.stages[stage] += now - profiler->lastMark;
+	profiler->lastMark = now;
+}
+
+void
+cpSpaceProfileEndStep(cpSpace *space)
+{
+	struct cpSpaceProfiler *profiler = space->profiler;
+	profiler->current.total = profiler->lastMark - profiler->stepStart;
+	
+	profiler->head = (profiler->head + 1)%profiler->length;
+	profiler->history[profiler->head] = profiler->current;
+	if(profiler->count < profiler->length) profiler->count++;
+}
+
+//MARK: Public API
+
+void
+cpSpaceSetProfileHistoryLength(cpSpace *space, int length)
+{
+	cpAssertHard(length >= 0, "Profile history length cannot be negative.");
+	cpAssertHard(!space->locked, "You cannot change the profile history length from inside a callback.");
+	
+	struct cpSpaceProfiler *profiler = space->profiler;
+	
+	if(length == 0){
+		if(profiler){
+			cpfree(profiler->history);
+			cpfree(profiler);
+			space->profiler = NULL;
+		}
+	} else {
+		if(!profiler) profiler = space->profiler = (struct cpSpaceProfiler *)cpcalloc(1, sizeof(struct cpSpaceProfiler));
+		
+		// Changing the length throws away the old history.
+		profiler->history = (cpSpaceProfile *)cprealloc(profiler->history, length*sizeof(cpSpaceProfile));
+		profiler->length = length;
+		cpSpaceResetProfile(space);
+	}
+}
+
+int
+cpSpaceGetProfileHistoryLength(const cpSpace *space)
+{
+	return (space->profiler ? space->profiler->length : 0);
+}
+
+int
+cpSpaceGetProfileCount(const cpSpace *space)
+{
+	return (space->profiler ? space->profiler->count : 0);
+}
+
+const cpSpaceProfile *
+cpSpaceGetProfile(const cpSpace *space, int stepsAgo)
+{
+	struct cpSpaceProfiler *profiler = space->profiler;
+	if(!profiler || stepsAgo < 0 || stepsAgo >= profiler->count) return NULL;
+	
+	return profiler->history + (profiler->head - stepsAgo + profiler->length)%profiler->length;
+}
+
+void
+cpSpaceResetProfile(cpSpace *space)
+{
+	struct cpSpaceProfiler *profiler = space->profiler;
+	if(profiler){
+		profiler->count = 0;
+		profiler->head = profiler->length - 1;
+	}
+}
+
+const char *
+cpSpaceProfileStageName(cpSpaceProfileStage stage)
+{
+	static const char *names[CP_PROFILE_NUM_STAGES] = {
+		"integrate positions",
+		"update shapes",
+		"broadphase",
+		"narrowphase",
+		"process components",
+		"filter arbiters",
+		"prestep",
+		"integrate velocities",
+		"cached impulses",
+		"solver",
+		"post solve",
+	};
+	
+	return (0 <= stage && stage < CP_PROFILE_NUM_STAGES ? names[stage] : "unknown");
+}
+
+#endif
@@ -52,8 +52,8 @@ cpSpacePointQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpShapeFilt
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
 	
 	cpSpaceLock(space); {
-		cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
-		cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		cpBBTreeMaskedQuery(space->dynamicShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		cpBBTreeMaskedQuery(space->staticShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
 	} cpSpaceUnlock(space, true);
 }
 
@@ -89,8 +89,8 @@ cpSpacePointQueryNearest(cpSpace *space, cpVect point, cpFloat maxDistance, cpSh
 	};
 	
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	cpBBTreeMaskedQuery(space->dynamicShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	cpBBTreeMaskedQuery(space->staticShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
 	
 	return (cpShape *)out->shape;
 }
@@ -131,8 +131,8 @@ cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpFloat radius, cp
 	};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
-    cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    cpBBTreeMaskedSegmentQuery(space->staticShapes, &context, start, end, 1.0f, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    cpBBTreeMaskedSegmentQuery(space->dynamicShapes, &context, start, end, 1.0f, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
 	} cpSpaceUnlock(space, true);
 }
 
@@ -169,12 +169,145 @@ cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpFloat radiu
 		NULL
 	};
 	
-	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
-	cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, out->alpha, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	cpBBTreeMaskedSegmentQuery(space->staticShapes, &context, start, end, 1.0f, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	cpBBTreeMaskedSegmentQuery(space->dynamicShapes, &context, start, end, out->alpha, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
 	
 	return (cpShape *)out->shape;
 }
 
+//MARK: Batched Segment Query Functions
+
+typedef struct SegmentBatchKey {
+	unsigned int key;
+	int index;
+} SegmentBatchKey;
+
+// Radix sort the keys a byte at a time. The sorted keys end up back in keys.
+static void
+SortSegmentBatchKeys(SegmentBatchKey *keys, SegmentBatchKey *temp, int count)
+{
+	for(int shift=0; shift<32; shift+=8){
+		int offsets[256] = {0};
+		for(int i=0; i<count; i++) offsets[(keys[i].key>>shift)&0xFF]++;
+		
+		for(int i=0, sum=0; i<256; i++){
+			int n = offsets[i];
+			offsets[i] = sum;
+			sum += n;
+		}
+		
+		for(int i=0; i<count; i++) temp[offsets[(keys[i].key>>shift)&0xFF]++] = keys[i];
+		
+		SegmentBatchKey *swap = keys; keys = temp; temp = swap;
+	}
+}
+
+// Spread the low 15 bits of n out to the even bits.
+static inline unsigned int
+SpreadBits(unsigned int n)
+{
+	n &= 0x7FFF;
+	n = (n | (n << 8)) & 0x00FF00FF;
+	n = (n | (n << 4)) & 0x0F0F0F0F;
+	n = (n | (n << 2)) & 0x33333333;
+	n = (n | (n << 1)) & 0x55555555;
+	return n;
+}
+
+int *
+cpSpaceSegmentQueryBatchOrder(const cpVect *starts, const cpVect *ends, int count)
+{
+	int *order = (int *)cpcalloc(count, sizeof(int));
+	if(count == 0) return order;
+	
+	cpBB bounds = cpBBNew(starts[0].x, starts[0].y, starts[0].x, starts[0].y);
+	for(int i=1; i<count; i++) bounds = cpBBExpand(bounds, starts[i]);
+	
+	cpFloat width = bounds.r - bounds.l, height = bounds.t - bounds.b;
+	cpFloat scale_x = (width > 0.0f ? 32767.0f/width : 0.0f);
+	cpFloat scale_y = (height > 0.0f ? 32767.0f/height : 0.0f);
+	
+	// Sort by the quadrant of the direction, then along a Z-order curve through the starting points.
+	SegmentBatchKey *keys = (SegmentBatchKey *)cpcalloc(2*count, sizeof(SegmentBatchKey));
+	for(int i=0; i<count; i++){
+		cpVect start = starts[i];
+		unsigned int quadrant = (ends[i].x < start.x) | (ends[i].y < start.y)<<1;
+		unsigned int x = (unsigned int)((start.x - bounds.l)*scale_x);
+		unsigned int y = (unsigned int)((start.y - bounds.b)*scale_y);
+		
+		keys[i].key = quadrant<<30 | SpreadBits(x) | SpreadBits(y)<<1;
+		keys[i].index = i;
+	}
+	
+	SortSegmentBatchKeys(keys, keys + count, count);
+	for(int i=0; i<count; i++) order[i] = keys[i].index;
+	
+	cpfree(keys);
+	return order;
+}
+
+struct SegmentPacketContext {
+	cpVect start[CP_BBTREE_PACKET_SIZE], end[CP_BBTREE_PACKET_SIZE];
+	cpSegmentQueryInfo *out[CP_BBTREE_PACKET_SIZE];
+	cpFloat radius;
+	cpShapeFilter filter;
+};
+
+static cpFloat
+SegmentQueryFirstPacket(int ray, cpShape *shape, struct SegmentPacketContext *context)
+{
+	cpSegmentQueryInfo info;
+	cpSegmentQueryInfo *out = context->out[ray];
+	
+	if(
+		!cpShapeFilterReject(shape->filter, context->filter) && !shape->sensor &&
+		cpShapeSegmentQuery(shape, context->start[ray], context->end[ray], context->radius, &info) &&
+		info.alpha < out->alpha
+	){
+		(*out) = info;
+	}
+	
+	return out->alpha;
+}
+
+void
+cpSpaceSegmentQueryFirstBatchRange(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, const int *order, int start, int end)
+{
+	struct SegmentPacketContext context;
+	context.radius = radius;
+	context.filter = filter;
+	
+	cpFloat t_exit[CP_BBTREE_PACKET_SIZE];
+	
+	for(int i=start; i<end; i+=CP_BBTREE_PACKET_SIZE){
+		int count = (end - i < CP_BBTREE_PACKET_SIZE ? end - i : CP_BBTREE_PACKET_SIZE);
+		
+		for(int j=0; j<count; j++){
+			int index = order[i + j];
+			cpSegmentQueryInfo info = {NULL, ends[index], cpvzero, 1.0f};
+			out[index] = info;
+			
+			context.start[j] = starts[index];
+			context.end[j] = ends[index];
+			context.out[j] = out + index;
+			t_exit[j] = 1.0f;
+		}
+		
+		cpBBTreeSegmentQueryPacket(space->staticShapes, context.start, context.end, t_exit, count, filter.mask, (cpBBTreePacketQueryFunc)SegmentQueryFirstPacket, &context);
+		cpBBTreeSegmentQueryPacket(space->dynamicShapes, context.start, context.end, t_exit, count, filter.mask, (cpBBTreePacketQueryFunc)SegmentQueryFirstPacket, &context);
+	}
+}
+
+void
+cpSpaceSegmentQueryFirstBatch(cpSpace *space, const cpVect *starts, const cpVect *ends, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo *out, int count)
+{
+	if(count <= 0) return;
+	
+	int *order = cpSpaceSegmentQueryBatchOrder(starts, ends, count);
+	cpSpaceSegmentQueryFirstBatchRange(space, starts, ends, radius, filter, out, order, 0, count);
+	cpfree(order);
+}
+
 //MARK: BB Query Functions
 
 struct BBQueryContext {
@@ -202,8 +335,8 @@ cpSpaceBBQuery(cpSpace *space, cpBB bb, cpShapeFilter filter, cpSpaceBBQueryFunc
 	struct BBQueryContext context = {bb, filter, func};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
-    cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
+    cpBBTreeMaskedQuery(space->dynamicShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)BBQuery, data);
+    cpBBTreeMaskedQuery(space->staticShapes, &context, bb, filter.mask, (cpSpatialIndexQueryFunc)BBQuery, data);
 	} cpSpaceUnlock(space, true);
 }
 
@@ -238,8 +371,8 @@ cpSpaceShapeQuery(cpSpace *space, cpShape *shape, cpSpaceShapeQueryFunc func, vo
 	struct ShapeQueryContext context = {func, data, false};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
-    cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    cpBBTreeMaskedQuery(space->dynamicShapes, shape, bb, shape->filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    cpBBTreeMaskedQuery(space->staticShapes, shape, bb, shape->filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
 	} cpSpaceUnlock(space, true);
 	
 	return context.anyCollision;
@@ -0,0 +1,389 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+//MARK: Snapshot Buffers
+
+void
+cpSnapshotWrite(cpSnapshotWriter *writer, const void *data, size_t bytes)
+{
+	if(bytes && writer->used + bytes <= writer->size) memcpy(writer->buffer + writer->used, data, bytes);
+	writer->used += bytes;
+}
+
+// Objects are stored as their address and size followed by their contents.
+void
+cpSnapshotWriteObject(cpSnapshotWriter *writer, const void *ptr, size_t bytes)
+{
+	cpSnapshotWrite(writer, &ptr, sizeof(ptr));
+	cpSnapshotWrite(writer, &bytes, sizeof(bytes));
+	cpSnapshotWrite(writer, ptr, bytes);
+}
+
+void
+cpSnapshotEndList(cpSnapshotWriter *writer)
+{
+	cpSnapshotWriteObject(writer, NULL, 0);
+}
+
+void
+cpSnapshotRead(cpSnapshotReader *reader, void *data, size_t bytes)
+{
+	cpAssertHard(reader->used + bytes <= reader->size, "Internal Error: Read past the end of a snapshot.");
+	if(bytes) memcpy(data, reader->buffer + reader->used, bytes);
+	reader->used += bytes;
+}
+
+void *
+cpSnapshotNextObject(cpSnapshotReader *reader, const void **contents)
+{
+	void *ptr;
+	size_t bytes;
+	cpSnapshotRead(reader, &ptr, sizeof(ptr));
+	cpSnapshotRead(reader, &bytes, sizeof(bytes));
+	
+	cpAssertHard(reader->used + bytes <= reader->size, "Internal Error: Read past the end of a snapshot.");
+	if(contents) *contents = reader->buffer + reader->used;
+	reader->used += bytes;
+	
+	return ptr;
+}
+
+void *
+cpSnapshotRestoreObject(cpSnapshotReader *reader)
+{
+	const void *contents;
+	void *ptr = cpSnapshotNextObject(reader, &contents);
+	if(ptr) memcpy(ptr, contents, (reader->buffer + reader->used) - (const char *)contents);
+	
+	return ptr;
+}
+
+//MARK: Objects
+
+static size_t
+ShapeSize(cpShape *shape)
+{
+	switch(shape->klass->type){
+		case CP_CIRCLE_SHAPE: return sizeof(cpCircleShape);
+		case CP_SEGMENT_SHAPE: return sizeof(cpSegmentShape);
+		case CP_POLY_SHAPE: return sizeof(cpPolyShape);
+		default: cpAssertHard(false, "Internal Error: Unknown shape type."); return 0;
+	}
+}
+
+static size_t
+ConstraintSize(cpConstraint *constraint)
+{
+	if(cpConstraintIsPinJoint(constraint)) return sizeof(cpPinJoint);
+	if(cpConstraintIsSlideJoint(constraint)) return sizeof(cpSlideJoint);
+	if(cpConstraintIsPivotJoint(constraint)) return sizeof(cpPivotJoint);
+	if(cpConstraintIsGrooveJoint(constraint)) return sizeof(cpGrooveJoint);
+	if(cpConstraintIsDampedSpring(constraint)) return sizeof(cpDampedSpring);
+	if(cpConstraintIsDampedRotarySpring(constraint)) return sizeof(cpDampedRotarySpring);
+	if(cpConstraintIsRotaryLimitJoint(constraint)) return sizeof(cpRotaryLimitJoint);
+	if(cpConstraintIsRatchetJoint(constraint)) return sizeof(cpRatchetJoint);
+	if(cpConstraintIsGearJoint(constraint)) return sizeof(cpGearJoint);
+	if(cpConstraintIsSimpleMotor(constraint)) return sizeof(cpSimpleMotor);
+	
+	cpAssertHard(false, "Snapshots do not support custom constraint types.");
+	return 0;
+}
+
+// Saves the body along with its shapes and constraints.
+static void
+SnapshotBody(cpSpace *space, cpBody *body, cpSnapshotWriter *writer)
+{
+	cpSnapshotWriteObject(writer, body, sizeof(cpBody));
+	
+	CP_BODY_FOREACH_SHAPE(body, shape){
+		cpSnapshotWriteObject(writer, shape, ShapeSize(shape));
+		
+		if(shape->klass->type == CP_POLY_SHAPE){
+			cpPolyShape *poly = (cpPolyShape *)shape;
+			if(poly->planes != poly->_planes) cpSnapshotWriteObject(writer, poly->planes, 2*poly->count*sizeof(struct cpSplittingPlane));
+		}
+	}
+	
+	// Constraints are saved with their first body, or the second if the first was never added to the space.
+	CP_BODY_FOREACH_CONSTRAINT(body, constraint){
+		cpBody *owner = (constraint->a->space == space ? constraint->a : constraint->b);
+		if(body == owner) cpSnapshotWriteObject(writer, constraint, ConstraintSize(constraint));
+	}
+}
+
+static void
+SnapshotArray(cpArray *arr, cpSnapshotWriter *writer)
+{
+	cpSnapshotWrite(writer, &arr->num, sizeof(arr->num));
+	cpSnapshotWrite(writer, arr->arr, arr->num*sizeof(void *));
+}
+
+static void
+RestoreArray(cpArray *arr, cpSnapshotReader *reader)
+{
+	int num;
+	cpSnapshotRead(reader, &num, sizeof(num));
+	
+	if(num > arr->max){
+		arr->max = num;
+		arr->arr = (void **)cprealloc(arr->arr, num*sizeof(void *));
+	}
+	
+	arr->num = num;
+	cpSnapshotRead(reader, arr->arr, num*sizeof(void *));
+}
+
+//MARK: Arbiters
+
+// Same rule as cpSpaceDeactivateBody() for which body's list holds a sleeping arbiter.
+static inline bool
+OwnsSleepingArbiter(cpBody *body, cpArbiter *arb)
+{
+	cpBody *bodyA = arb->body_a;
+	return (body == bodyA || cpBodyGetType(bodyA) == CP_BODY_TYPE_STATIC);
+}
+
+static void
+SnapshotArbiter(cpArbiter *arb, cpSnapshotWriter *writer)
+{
+	cpSnapshotWriteObject(writer, arb, sizeof(cpArbiter));
+}
+
+static void
+SnapshotArbiters(cpSpace *space, cpSnapshotWriter *writer)
+{
+	// Sleeping arbiters aren't cached, and their contacts are stored in separately allocated memory.
+	cpArray *components = space->sleepingComponents;
+	for(int i=0; i<components->num; i++){
+		CP_BODY_FOREACH_COMPONENT((cpBody *)components->arr[i], body){
+			CP_BODY_FOREACH_ARBITER(body, arb){
+				if(OwnsSleepingArbiter(body, arb)){
+					cpSnapshotWriteObject(writer, arb, sizeof(cpArbiter));
+					cpSnapshotWriteObject(writer, arb->contacts, arb->count*sizeof(struct cpContact));
+				}
+			}
+		}
+	}
+	cpSnapshotEndList(writer);
+	
+	cpHashSetEach(space->cachedArbiters, (cpHashSetIteratorFunc)SnapshotArbiter, writer);
+	cpSnapshotEndList(writer);
+}
+
+// Temporary values for cpArbiter.count while restoring.
+enum {
+	ARBITER_IN_SNAPSHOT = -1,
+	ARBITER_MAY_KEEP_CONTACTS = -2,
+	ARBITER_KEEP_CONTACTS = -3,
+	ARBITER_COPY_CONTACTS = -4,
+};
+
+static void
+GatherArbiter(cpArbiter *arb, cpArray *arbiters)
+{
+	cpArrayPush(arbiters, arb);
+}
+
+static void
+RestoreArbiters(cpSpace *space, cpSnapshotReader *reader)
+{
+	cpArray *scratch = space->snapshotScratch;
+	scratch->num = 0;
+	
+	// Sleeping arbiters that are still sleeping on the same contact memory can reuse it.
+	cpSnapshotReader sleeping = *reader;
+	for(cpArbiter *arb; (arb = (cpArbiter *)cpSnapshotNextObject(reader, NULL));){
+		const void *contents;
+		void *contacts = cpSnapshotNextObject(reader, &contents);
+		size_t bytes = (reader->buffer + reader->used) - (const char *)contents;
+		
+		if(arb->contacts == contacts && arb->count*sizeof(struct cpContact) == bytes) arb->count = ARBITER_MAY_KEEP_CONTACTS;
+	}
+	
+	// Free the contacts of the arbiters sleeping now unless they can be reused.
+	cpArray *components = space->sleepingComponents;
+	for(int i=0; i<components->num; i++){
+		CP_BODY_FOREACH_COMPONENT((cpBody *)components->arr[i], body){
+			CP_BODY_FOREACH_ARBITER(body, arb){
+				if(OwnsSleepingArbiter(body, arb)){
+					if(arb->count == ARBITER_MAY_KEEP_CONTACTS){
+						arb->count = ARBITER_KEEP_CONTACTS;
+					} else {
+						cpfree(arb->contacts);
+					}
+					
+					cpArrayPush(scratch, arb);
+				}
+			}
+		}
+	}
+	
+	// Mark the rest of the arbiters in the snapshot.
+	cpSnapshotReader marking = sleeping;
+	for(cpArbiter *arb; (arb = (cpArbiter *)cpSnapshotNextObject(&marking, NULL));){
+		cpSnapshotNextObject(&marking, NULL);
+		if(arb->count != ARBITER_KEEP_CONTACTS) arb->count = ARBITER_COPY_CONTACTS;
+	}
+	
+	cpSnapshotReader cached = *reader;
+	for(cpArbiter *arb; (arb = (cpArbiter *)cpSnapshotNextObject(reader, NULL));) arb->count = ARBITER_IN_SNAPSHOT;
+	
+	// Every arbiter is either pooled, cached or sleeping. Put all of them missing from the snapshot back in the pool.
+	cpArray *pool = space->pooledArbiters;
+	for(int i=0; i<pool->num; i++) cpArrayPush(scratch, pool->arr[i]);
+	cpHashSetEach(space->cachedArbiters, (cpHashSetIteratorFunc)GatherArbiter, scratch);
+	
+	pool->num = 0;
+	for(int i=0; i<scratch->num; i++){
+		cpArbiter *arb = (cpArbiter *)scratch->arr[i];
+		if(arb->count >= 0){
+			// Clear the stamp in case one of the restored pairs still refers to it.
+			arb->stamp = 0;
+			cpArrayPush(pool, arb);
+		}
+	}
+	
+	const void *contents;
+	for(cpArbiter *arb; (arb = (cpArbiter *)cpSnapshotNextObject(&sleeping, &contents));){
+		bool keep = (arb->count == ARBITER_KEEP_CONTACTS);
+		memcpy(arb, contents, sizeof(cpArbiter));
+		
+		cpSnapshotNextObject(&sleeping, &contents);
+		size_t bytes = arb->count*sizeof(struct cpContact);
+		if(!keep) arb->contacts = (struct cpContact *)cpcalloc(1, bytes);
+		memcpy(arb->contacts, contents, bytes);
+	}
+	
+	while(cpSnapshotRestoreObject(&cached));
+}
+
+//MARK: Snapshot/Restore
+
+#define CP_SNAPSHOT_MAGIC 0x70616e73
+
+typedef struct SnapshotHeader {
+	unsigned int magic;
+	cpTimestamp topologyStamp;
+	cpSpace *space;
+	size_t size;
+} SnapshotHeader;
+
+size_t
+cpSpaceSnapshot(cpSpace *space, void *buffer, size_t size)
+{
+	cpAssertSpaceUnlocked(space);
+	
+	cpSnapshotWriter writer = {(char *)buffer, (buffer ? size : 0), 0};
+	SnapshotHeader header = {CP_SNAPSHOT_MAGIC, space->topologyStamp, space, 0};
+	cpSnapshotWrite(&writer, &header, sizeof(header));
+	
+	cpSnapshotWrite(&writer, &space->stamp, sizeof(space->stamp));
+	cpSnapshotWrite(&writer, &space->curr_dt, sizeof(space->curr_dt));
+	
+	// The order matches what cpSpaceRestore() needs. Pools are rebuilt before any objects are copied back.
+	SnapshotArbiters(space, &writer);
+	cpHashSetSnapshot(space->cachedArbiters, &writer);
+	cpBBTreeSnapshot(space->staticShapes, &writer);
+	cpBBTreeSnapshot(space->dynamicShapes, &writer);
+	cpSpaceSnapshotContactBuffers(space, &writer);
+	
+	SnapshotArray(space->dynamicBodies, &writer);
+	SnapshotArray(space->staticBodies, &writer);
+	SnapshotArray(space->sleepingComponents, &writer);
+	SnapshotArray(space->constraints, &writer);
+	SnapshotArray(space->arbiters, &writer);
+	
+	// The broadphase looks up the collision ids of persistent pairs in the previous step's pairs.
+	cpSnapshotWrite(&writer, &space->pairCount, sizeof(space->pairCount));
+	cpSnapshotWrite(&writer, space->pairs, space->pairCount*sizeof(struct cpCollisionPair));
+	
+	cpArray *bodies = space->dynamicBodies;
+	for(int i=0; i<bodies->num; i++) SnapshotBody(space, (cpBody *)bodies->arr[i], &writer);
+	
+	bodies = space->staticBodies;
+	for(int i=0; i<bodies->num; i++) SnapshotBody(space, (cpBody *)bodies->arr[i], &writer);
+	
+	cpArray *components = space->sleepingComponents;
+	for(int i=0; i<components->num; i++){
+		CP_BODY_FOREACH_COMPONENT((cpBody *)components->arr[i], body) SnapshotBody(space, body, &writer);
+	}
+	
+	if(!cpArrayContains(space->staticBodies, space->staticBody)) SnapshotBody(space, space->staticBody, &writer);
+	cpSnapshotEndList(&writer);
+	
+	header.size = writer.used;
+	if(writer.used <= writer.size) memcpy(buffer, &header, sizeof(header));
+	
+	return writer.used;
+}
+
+bool
+cpSpaceRestore(cpSpace *space, const void *buffer, size_t size)
+{
+	cpAssertSpaceUnlocked(space);
+	
+	SnapshotHeader header;
+	if(buffer == NULL || size < sizeof(header)) return false;
+	memcpy(&header, buffer, sizeof(header));
+	
+	if(
+		header.magic != CP_SNAPSHOT_MAGIC || header.space != space ||
+		header.topologyStamp != space->topologyStamp || header.size > size
+	){
+		return false;
+	}
+	
+	if(!space->snapshotScratch) space->snapshotScratch = cpArrayNew(0);
+	cpSnapshotReader reader = {(const char *)buffer, header.size, sizeof(header)};
+	
+	cpSnapshotRead(&reader, &space->stamp, sizeof(space->stamp));
+	cpSnapshotRead(&reader, &space->curr_dt, sizeof(space->curr_dt));
+	
+	RestoreArbiters(space, &reader);
+	cpHashSetRestore(space->cachedArbiters, &reader);
+	cpBBTreeRestore(space->staticShapes, &reader, space->snapshotScratch);
+	cpBBTreeRestore(space->dynamicShapes, &reader, space->snapshotScratch);
+	cpSpaceRestoreContactBuffers(space, &reader);
+	
+	RestoreArray(space->dynamicBodies, &reader);
+	RestoreArray(space->staticBodies, &reader);
+	RestoreArray(space->sleepingComponents, &reader);
+	RestoreArray(space->constraints, &reader);
+	RestoreArray(space->arbiters, &reader);
+	
+	int pairCount;
+	cpSnapshotRead(&reader, &pairCount, sizeof(pairCount));
+	if(pairCount > space->pairCapacity){
+		space->pairCapacity = pairCount;
+		space->pairs = (struct cpCollisionPair *)cprealloc(space->pairs, pairCount*sizeof(struct cpCollisionPair));
+	}
+	
+	space->pairCount = pairCount;
+	cpSnapshotRead(&reader, space->pairs, pairCount*sizeof(struct cpCollisionPair));
+	
+	while(cpSnapshotRestoreObject(&reader));
+	
+	return true;
+}
@@ -19,6 +19,9 @@
  * SOFTWARE.
  */
 
+#include <stddef.h>
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 //MARK: Post Step Callback Functions
@@ -182,6 +185,75 @@ cpSpacePopContacts(cpSpace *space, int count){
 	space->contactBuffersHead->numContacts -= count;
 }
 
+void
+cpSpaceSnapshotContactBuffers(cpSpace *space, cpSnapshotWriter *writer)
+{
+	cpContactBufferHeader *head = space->contactBuffersHead;
+	cpSnapshotWrite(writer, &head, sizeof(head));
+	
+	if(head){
+		cpContactBufferHeader *buffer = head;
+		do {
+			size_t bytes = offsetof(cpContactBuffer, contacts) + buffer->numContacts*sizeof(struct cpContact);
+			cpSnapshotWriteObject(writer, buffer, bytes);
+			buffer = buffer->next;
+		} while(buffer != head);
+	}
+	
+	cpSnapshotEndList(writer);
+}
+
+#define CP_CONTACT_BUFFER_RESTORE_MARK ((unsigned int)-1)
+
+void
+cpSpaceRestoreContactBuffers(cpSpace *space, cpSnapshotReader *reader)
+{
+	cpContactBufferHeader *head;
+	cpSnapshotRead(reader, &head, sizeof(head));
+	
+	cpSnapshotReader buffers = *reader;
+	for(cpContactBufferHeader *buffer; (buffer = (cpContactBufferHeader *)cpSnapshotNextObject(reader, NULL));){
+		buffer->numContacts = CP_CONTACT_BUFFER_RESTORE_MARK;
+	}
+	
+	// Buffers are never freed, so the ring may have grown since the snapshot.
+	// Pull the new buffers out of the ring and stamp them so they will be the first to be reused.
+	cpContactBufferHeader *unused = NULL, *current = space->contactBuffersHead;
+	if(current){
+		cpContactBufferHeader *buffer = current;
+		do {
+			cpContactBufferHeader *next = buffer->next;
+			
+			if(buffer->numContacts != CP_CONTACT_BUFFER_RESTORE_MARK){
+				buffer->stamp = space->stamp - space->collisionPersistence - 1;
+				buffer->numContacts = 0;
+				buffer->next = unused;
+				unused = buffer;
+			}
+			
+			buffer = next;
+		} while(buffer != current);
+	}
+	
+	while(cpSnapshotRestoreObject(&buffers));
+	
+	// Splice the unused buffers in as the oldest ones in the ring.
+	if(unused){
+		cpContactBufferHeader *last = unused;
+		while(last->next) last = last->next;
+		
+		if(head){
+			last->next = head->next;
+			head->next = unused;
+		} else {
+			last->next = unused;
+			head = unused;
+		}
+	}
+	
+	space->contactBuffersHead = head;
+}
+
 //MARK: Collision Detection Functions
 
 static void *
@@ -198,6 +270,8 @@ cpSpaceArbiterSetTrans(cpShape **shapes, cpSpace *space)
 		for(int i=0; i<count; i++) cpArrayPush(space->pooledArbiters, buffer + i);
 	}
 	
+	CP_PROFILE_COUNT(space, arbitersCreated, 1);
+	CP_PROFILE_COUNT(space, arbitersReused, -1);
 	return cpArbiterInit((cpArbiter *)cpArrayPop(space->pooledArbiters), shapes[0], shapes[1]);
 }
 
@@ -220,8 +294,8 @@ static inline bool
 QueryReject(cpShape *a, cpShape *b)
 {
 	return (
-		// BBoxes must overlap
-		!cpBBIntersects(a->bb, b->bb)
+		// BBoxes must overlap, including the distance they were swept.
+		!cpBBIntersects(a->sweptBB, b->sweptBB)
 		// Don't collide shapes attached to the same body.
 		|| a->body == b->body
 		// Don't collide shapes that are filtered.
@@ -231,25 +305,47 @@ QueryReject(cpShape *a, cpShape *b)
 	);
 }
 
-// Callback from the spatial hash.
-cpCollisionID
-cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+struct cpCollisionInfo
+cpSpaceNarrowPhase(cpShape *a, cpShape *b, cpCollisionID id, struct cpContact *contacts)
 {
 	// Reject any of the simple cases
-	if(QueryReject(a,b)) return id;
+	if(QueryReject(a,b)){
+		struct cpCollisionInfo info = {a, b, id, cpvzero, 0, contacts, 0.0f};
+		return info;
+	}
 	
 	// Narrow-phase collision detection.
-	struct cpCollisionInfo info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+	return cpCollide(a, b, id, contacts);
+}
+
+// Check if an arbiter remembered by a persistent broadphase pair is still the cached arbiter for the shapes.
+// It must have been used last step and not pooled since. Pooled arbiters have their stamp cleared,
+// and 0 is never the previous step's stamp when there are previous pairs.
+// Shapes of sleeping bodies are moved to the static index, so their pairs are never persistent.
+static inline bool
+PairArbiterValid(cpSpace *space, cpArbiter *arb, const cpShape *a, const cpShape *b)
+{
+	return (
+		arb && arb->stamp == space->stamp - 1 &&
+		((arb->a == a && arb->b == b) || (arb->a == b && arb->b == a))
+	);
+}
+
+static cpArbiter *
+CommitCollision(cpSpace *space, struct cpCollisionInfo *info, cpArbiter *arb)
+{
+	const cpShape *a = info->a, *b = info->b;
 	
-	if(info.count == 0) return info.id; // Shapes are not colliding.
-	cpSpacePushContacts(space, info.count);
+	CP_PROFILE_COUNT(space, arbitersReused, 1);
+	if(!PairArbiterValid(space, arb, a, b)){
+		// Get an arbiter from space->arbiterSet for the two shapes.
+		// This is where the persistant contact magic comes from.
+		const cpShape *shape_pair[] = {a, b};
+		cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
+		arb = (cpArbiter *)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
+	}
 	
-	// Get an arbiter from space->arbiterSet for the two shapes.
-	// This is where the persistant contact magic comes from.
-	const cpShape *shape_pair[] = {info.a, info.b};
-	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)info.a, (cpHashValue)info.b);
-	cpArbiter *arb = (cpArbiter *)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
-	cpArbiterUpdate(arb, &info, space);
+	cpArbiterUpdate(arb, info, space);
 	
 	cpCollisionHandler *handler = arb->handler;
 	
@@ -272,8 +368,9 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 		!(a->body->m == INFINITY && b->body->m == INFINITY)
 	){
 		cpArrayPush(space->arbiters, arb);
+		CP_PROFILE_COUNT(space, contacts, info->count);
 	} else {
-		cpSpacePopContacts(space, info.count);
+		cpSpacePopContacts(space, info->count);
 		
 		arb->contacts = NULL;
 		arb->count = 0;
@@ -285,9 +382,375 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 	
 	// Time stamp the arbiter so we know it was used recently.
 	arb->stamp = space->stamp;
+	return arb;
+}
+
+void
+cpSpaceCommitCollision(cpSpace *space, struct cpCollisionInfo *info)
+{
+	CommitCollision(space, info, NULL);
+}
+
+// Callback from the spatial hash.
+cpCollisionID
+cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+{
+	struct cpCollisionInfo info = cpSpaceNarrowPhase(a, b, id, cpContactBufferGetArray(space));
+	
+	if(info.count == 0) return info.id; // Shapes are not colliding.
+	cpSpacePushContacts(space, info.count);
+	
+	cpSpaceCommitCollision(space, &info);
 	return info.id;
 }
 
+//MARK: Contact Coherence
+
+static inline cpVect
+BodyRot(cpBody *body)
+{
+	return cpv(body->transform.a, body->transform.b);
+}
+
+// Record the poses of the bodies for ReuseContacts() after committing a pair.
+static void
+RecordCoherence(cpArbiter *arb, bool collided)
+{
+	cpBody *a = arb->body_a, *b = arb->body_b;
+	arb->rot_a = BodyRot(a);
+	arb->rot_b = BodyRot(b);
+	
+	if(collided){
+		arb->coherence_p = cpvunrotate(cpvsub(b->p, a->p), arb->rot_a);
+		arb->coherence_rot = cpvunrotate(arb->rot_b, arb->rot_a);
+	}
+}
+
+// Fill in the pair's collision info from the contacts its arbiter had last step instead of running the narrow phase.
+// Only done if no point on shape b can have moved more than cpSpace.collisionCoherence in body a's frame
+// since the narrow phase last ran for the pair. The contacts on each shape are carried along with its body.
+static bool
+ReuseContacts(cpSpace *space, struct cpCollisionPair *pair)
+{
+	cpArbiter *arb = pair->arb;
+	if(!PairArbiterValid(space, arb, pair->a, pair->b) || arb->count == 0) return false;
+	
+	cpBody *a = arb->body_a, *b = arb->body_b;
+	cpVect rot_a = BodyRot(a), rot_b = BodyRot(b);
+	
+	// A point at distance r from body b's center moves at most |dp| + r*|drot - 1| in body a's frame.
+	cpVect p = cpvunrotate(cpvsub(b->p, a->p), rot_a);
+	cpVect drot = cpvunrotate(cpvunrotate(rot_b, rot_a), arb->coherence_rot);
+	
+	cpBB bb = arb->b->bb;
+	cpVect extents = cpv(cpfmax(bb.r - b->p.x, b->p.x - bb.l), cpfmax(bb.t - b->p.y, b->p.y - bb.b));
+	cpFloat motion = cpvdist(p, arb->coherence_p) + cpvlength(extents)*cpvdist(drot, cpv(1.0f, 0.0f));
+	if(motion > space->collisionCoherence) return false;
+	
+	// How much each body rotated since last step.
+	cpVect dra = cpvunrotate(rot_a, arb->rot_a);
+	cpVect drb = cpvunrotate(rot_b, arb->rot_b);
+	
+	struct cpCollisionInfo *info = &pair->info;
+	info->a = arb->a;
+	info->b = arb->b;
+	info->n = cpvrotate(arb->n, dra);
+	info->count = arb->count;
+	
+	for(int i=0; i<arb->count; i++){
+		struct cpContact *con = info->arr + i;
+		(*con) = arb->contacts[i];
+		
+		// The arbiter stores the offsets relative to the bodies, the narrow phase returns absolute positions.
+		con->r1 = cpvadd(a->p, cpvrotate(con->r1, dra));
+		con->r2 = cpvadd(b->p, cpvrotate(con->r2, drb));
+	}
+	
+	return true;
+}
+
+//MARK: Batched Narrow Phase
+
+void
+cpSpaceSwapPairs(cpSpace *space)
+{
+	struct cpCollisionPair *pairs = space->prevPairs;
+	int capacity = space->prevPairCapacity;
+	
+	space->prevPairs = space->pairs;
+	space->prevPairCapacity = space->pairCapacity;
+	space->prevPairCount = space->pairCount;
+	
+	space->pairs = pairs;
+	space->pairCapacity = capacity;
+	space->pairCount = 0;
+}
+
+// Callback from the spatial index.
+cpCollisionID
+cpSpaceQueuePair(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+{
+	// Persistent broadphase pairs pass back the id returned for them last step, which is their index in prevPairs plus one.
+	// Only trust it to find the collision id if it really is the same pair.
+	// The arbiter it was committed to is carried along too so the commit can skip looking it up.
+	cpCollisionID collisionID = 0;
+	cpArbiter *arb = NULL;
+	if(0 < id && id <= (cpCollisionID)space->prevPairCount){
+		struct cpCollisionPair *prev = space->prevPairs + (id - 1);
+		if((prev->a == a && prev->b == b) || (prev->a == b && prev->b == a)){
+			collisionID = prev->info.id;
+			arb = prev->arb;
+		}
+	}
+	
+	if(space->pairCount == space->pairCapacity){
+		space->pairCapacity = (space->pairCapacity ? 2*space->pairCapacity : 256);
+		space->pairs = (struct cpCollisionPair *)cprealloc(space->pairs, space->pairCapacity*sizeof(struct cpCollisionPair));
+	}
+	
+	struct cpCollisionPair *pair = space->pairs + space->pairCount++;
+	pair->a = a;
+	pair->b = b;
+	
+	// Sort the shapes by type the same way cpCollide() does.
+	struct cpCollisionInfo info = {a, b, collisionID, cpvzero, 0, NULL, 0.0f};
+	if(a->klass->type > b->klass->type){
+		info.a = b;
+		info.b = a;
+	}
+	
+	// Look for speculative contacts as far apart as the shapes can move towards each other this step.
+	if(space->collisionSpeculation && !(a->sensor || b->sensor)){
+		info.margin = cpvlength(cpvsub(b->body->v, a->body->v))*space->curr_dt;
+	}
+	
+	pair->info = info;
+	pair->arb = arb;
+	pair->bucket = (QueryReject(a, b) ? -1 : info.a->klass->type + info.b->klass->type*CP_NUM_SHAPES);
+	
+	return (cpCollisionID)space->pairCount;
+}
+
+int
+cpSpaceSortPairs(cpSpace *space)
+{
+	int count = space->pairCount;
+	
+	if(count > space->pairScratchCapacity){
+		space->pairScratchCapacity = space->pairCapacity;
+		space->pairOrder = (int *)cprealloc(space->pairOrder, space->pairScratchCapacity*sizeof(int));
+		space->pairContacts = (struct cpContact *)cprealloc(space->pairContacts, space->pairScratchCapacity*CP_MAX_CONTACTS_PER_ARBITER*sizeof(struct cpContact));
+	}
+	
+	// Counting sort the unrejected pairs into their buckets.
+	int *buckets = space->pairBuckets;
+	memset(buckets, 0, sizeof(space->pairBuckets));
+	
+	bool coherence = (space->collisionCoherence > 0.0f);
+	
+	for(int i=0; i<count; i++){
+		struct cpCollisionPair *pair = space->pairs + i;
+		pair->info.arr = space->pairContacts + i*CP_MAX_CONTACTS_PER_ARBITER;
+		
+		// Pairs that reuse their contacts don't need to be collided.
+		if(pair->bucket >= 0 && coherence && ReuseContacts(space, pair)) pair->bucket = -1;
+		if(pair->bucket >= 0) buckets[pair->bucket + 1]++;
+	}
+	
+	for(int i=0; i<CP_NUM_SHAPES*CP_NUM_SHAPES; i++) buckets[i + 1] += buckets[i];
+	
+	int cursor[CP_NUM_SHAPES*CP_NUM_SHAPES];
+	memcpy(cursor, buckets, sizeof(cursor));
+	
+	for(int i=0; i<count; i++){
+		int bucket = space->pairs[i].bucket;
+		if(bucket >= 0) space->pairOrder[cursor[bucket]++] = i;
+	}
+	
+	return buckets[CP_NUM_SHAPES*CP_NUM_SHAPES];
+}
+
+void
+cpSpaceCollidePairs(cpSpace *space, int start, int end)
+{
+	struct cpCollisionPair *pairs = space->pairs;
+	const int *order = space->pairOrder;
+	
+	// Split the range up into runs of the same bucket.
+	while(start < end){
+		int bucket = pairs[order[start]].bucket;
+		int run_end = space->pairBuckets[bucket + 1];
+		if(run_end > end) run_end = end;
+		
+		cpCollideBatch(pairs, order + start, run_end - start);
+		start = run_end;
+	}
+}
+
+void
+cpSpaceCommitPairs(cpSpace *space)
+{
+	// Commit the collisions in the order the broadphase found them.
+	// This gives exactly the same results as calling cpSpaceCollideShapes() from the broadphase.
+	for(int i=0; i<space->pairCount; i++){
+		struct cpCollisionPair *pair = space->pairs + i;
+		int count = pair->info.count;
+		if(count == 0) continue;
+		
+		struct cpContact *contacts = cpContactBufferGetArray(space);
+		memcpy(contacts, pair->info.arr, count*sizeof(struct cpContact));
+		cpSpacePushContacts(space, count);
+		
+		pair->info.arr = contacts;
+		pair->arb = CommitCollision(space, &pair->info, pair->arb);
+		RecordCoherence(pair->arb, pair->bucket >= 0);
+	}
+}
+
+//MARK: Bullets
+
+// Maximum number of conservative advancement steps taken to find a time of impact.
+#define BULLET_ITERATIONS 16
+
+static inline bool
+BulletActive(cpBody *body)
+{
+	return body->bullet.enabled && cpBodyGetType(body) == CP_BODY_TYPE_DYNAMIC && !cpBodyIsSleeping(body);
+}
+
+void
+cpSpaceBeginBullets(cpSpace *space)
+{
+	cpArray *bullets = space->bulletBodies;
+	for(int i=0; i<bullets->num; i++){
+		cpBody *body = (cpBody *)bullets->arr[i];
+		if(BulletActive(body)) cpBodyBeginSweep(body);
+	}
+}
+
+// Grow the bullets' bounding boxes to cover where they started the step so the broadphase finds everything they passed.
+static void
+SweepBullets(cpSpace *space)
+{
+	cpArray *bullets = space->bulletBodies;
+	for(int i=0; i<bullets->num; i++){
+		cpBody *body = (cpBody *)bullets->arr[i];
+		if(!BulletActive(body)) continue;
+		
+		cpTransform start = cpBodyGetSweepTransform(body, 0.0f);
+		CP_BODY_FOREACH_SHAPE(body, shape){
+			cpBB bb = shape->sweptBB;
+			bb = cpBBMerge(bb, cpShapeUpdate(shape, start));
+			cpShapeCacheBB(shape);
+			shape->sweptBB = bb;
+		}
+	}
+}
+
+// Find when a bullet's shape first comes within the slop of another shape as a fraction of the bullet's motion.
+// Shapes that were already that close at the start of the step are left to the regular collision detection.
+static cpFloat
+BulletTimeOfImpact(cpShape *shape, cpShape *other, cpFloat slop)
+{
+	cpBody *body = shape->body;
+	
+	if(shape->klass->type == CP_CIRCLE_SHAPE){
+		// Circles can be swept exactly (ignoring rotation) with a segment query.
+		cpCircleShape *circle = (cpCircleShape *)shape;
+		cpVect start = cpTransformPoint(cpBodyGetSweepTransform(body, 0.0f), circle->c);
+		
+		cpSegmentQueryInfo info;
+		if(cpShapeSegmentQuery(other, start, circle->tc, circle->r + 0.5f*slop, &info) && info.alpha > 0.0f){
+			return info.alpha;
+		} else {
+			return 1.0f;
+		}
+	}
+	
+	// No point on the shape can move faster than the center of gravity plus the rotation times the point's distance from it.
+	cpBB bb = cpShapeCacheBB(shape);
+	cpVect p = body->p;
+	cpVect extent = cpv(cpfmax(cpfabs(bb.l - p.x), cpfabs(bb.r - p.x)), cpfmax(cpfabs(bb.b - p.y), cpfabs(bb.t - p.y)));
+	cpFloat bound = cpvdist(body->bullet.p, p) + cpfabs(body->a - body->bullet.a)*cpvlength(extent);
+	if(bound == 0.0f) return 1.0f;
+	
+	// Conservative advancement. Each step moves the shape as far as it can go without possibly getting closer than half the slop.
+	cpCollisionID id = 0;
+	cpFloat t = 0.0f;
+	for(int i=0; i<BULLET_ITERATIONS; i++){
+		cpShapeUpdate(shape, cpBodyGetSweepTransform(body, t));
+		cpFloat dist = cpCollideDistance(shape, other, &id);
+		if(dist <= slop){
+			if(i == 0) t = 1.0f;
+			break;
+		}
+		
+		t += (dist - 0.5f*slop)/bound;
+		if(t >= 1.0f){
+			t = 1.0f;
+			break;
+		}
+	}
+	
+	// Put the shape back where the body ended the step in case it's the other shape in another bullet's pair.
+	cpShapeCacheBB(shape);
+	return t;
+}
+
+// Move the bullets back to their earliest time of impact with the shapes they swept past.
+static void
+SolveBullets(cpSpace *space)
+{
+	cpFloat slop = space->collisionSlop;
+	
+	for(int i=0; i<space->pairCount; i++){
+		struct cpCollisionPair *pair = space->pairs + i;
+		cpShape *a = pair->a, *b = pair->b;
+		
+		// Rejected pairs and sensors don't stop bullets.
+		if(pair->bucket < 0 || a->sensor || b->sensor) continue;
+		
+		bool bullet_a = BulletActive(a->body), bullet_b = BulletActive(b->body);
+		if(!(bullet_a || bullet_b)) continue;
+		
+		if(bullet_a) a->body->bullet.toi = cpfmin(a->body->bullet.toi, BulletTimeOfImpact(a, b, slop));
+		if(bullet_b) b->body->bullet.toi = cpfmin(b->body->bullet.toi, BulletTimeOfImpact(b, a, slop));
+		
+		// Rewound bullets stop up to the slop away from what they hit. Make sure the narrow phase still finds the contact.
+		pair->info.margin = cpfmax(pair->info.margin, slop);
+	}
+	
+	cpArray *bullets = space->bulletBodies;
+	for(int i=0; i<bullets->num; i++){
+		cpBody *body = (cpBody *)bullets->arr[i];
+		if(!BulletActive(body)) continue;
+		
+		if(body->bullet.toi < 1.0f) cpBodyRewindSweep(body, body->bullet.toi);
+		CP_BODY_FOREACH_SHAPE(body, shape) cpShapeCacheBB(shape);
+	}
+}
+
+int
+cpSpaceFindPairs(cpSpace *space)
+{
+	cpSpaceSwapPairs(space);
+	
+	bool bullets = (space->bulletBodies->num > 0);
+	if(bullets) SweepBullets(space);
+	
+	if(space->tuner){
+		double start = cpProfileTime();
+		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceQueuePair, space);
+		cpSpaceSampleBroadphase(space, cpProfileTime() - start);
+	} else {
+		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceQueuePair, space);
+	}
+	
+	if(bullets) SolveBullets(space);
+	
+	return cpSpaceSortPairs(space);
+}
+
 // Hashset filter func to throw away old arbiters.
 bool
 cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
@@ -316,6 +779,7 @@ cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
 	if(ticks >= space->collisionPersistence){
 		arb->contacts = NULL;
 		arb->count = 0;
+		arb->stamp = 0;
 		
 		cpArrayPush(space->pooledArbiters, arb);
 		return false;
@@ -332,13 +796,22 @@ cpShapeUpdateFunc(cpShape *shape, void *unused)
 	cpShapeCacheBB(shape);
 }
 
+static void
+ShapeSweptUpdateFunc(cpShape *shape, cpSpace *space)
+{
+	cpShapeCacheSweptBB(shape, space->curr_dt);
+}
+
 void
 cpSpaceStep(cpSpace *space, cpFloat dt)
 {
 	// don't step if the timestep is 0!
 	if(dt == 0.0f) return;
 	
+	if(space->tuner) cpSpaceTuneSpatialIndex(space);
+	
 	space->stamp++;
+	CP_PROFILE_BEGIN_STEP(space);
 	
 	cpFloat prev_dt = space->curr_dt;
 	space->curr_dt = dt;
@@ -361,29 +834,46 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 
 	cpSpaceLock(space); {
 		// Integrate positions
+		cpSpaceBeginBullets(space);
 		for(int i=0; i<bodies->num; i++){
 			cpBody *body = (cpBody *)bodies->arr[i];
 			body->position_func(body, dt);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_INTEGRATE_POSITIONS);
 		
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
-		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
-		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		if(space->collisionSpeculation){
+			cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)ShapeSweptUpdateFunc, space);
+		} else {
+			cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
+		}
+		CP_PROFILE_MARK(space, CP_PROFILE_UPDATE_SHAPES);
+		
+		// Queue up the pairs so the narrow phase can collide each pair of shape types as a batch.
+		int pairCount = cpSpaceFindPairs(space);
+		CP_PROFILE_COUNT(space, pairs, space->pairCount);
+		CP_PROFILE_MARK(space, CP_PROFILE_BROADPHASE);
+		
+		cpSpaceCollidePairs(space, 0, pairCount);
+		cpSpaceCommitPairs(space);
+		CP_PROFILE_MARK(space, CP_PROFILE_NARROWPHASE);
 	} cpSpaceUnlock(space, false);
 	
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
 	cpSpaceProcessComponents(space, dt);
+	CP_PROFILE_MARK(space, CP_PROFILE_PROCESS_COMPONENTS);
 	
 	cpSpaceLock(space); {
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		CP_PROFILE_MARK(space, CP_PROFILE_FILTER_ARBITERS);
 
 		// Prestep the arbiters and constraints.
 		cpFloat slop = space->collisionSlop;
 		cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
 		for(int i=0; i<arbiters->num; i++){
-			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
+			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef, space->collisionSpeculation);
 		}
 
 		for(int i=0; i<constraints->num; i++){
@@ -394,6 +884,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			
 			constraint->klass->preStep(constraint, dt);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_PRESTEP);
 	
 		// Integrate velocities.
 		cpFloat damping = cpfpow(space->damping, dt);
@@ -402,6 +893,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			cpBody *body = (cpBody *)bodies->arr[i];
 			body->velocity_func(body, gravity, damping, dt);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_INTEGRATE_VELOCITIES);
 		
 		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
@@ -413,6 +905,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 			constraint->klass->applyCachedImpulse(constraint, dt_coef);
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_CACHED_IMPULSES);
 		
 		// Run the impulse solver.
 		for(int i=0; i<space->iterations; i++){
@@ -425,6 +918,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 				constraint->klass->applyImpulse(constraint, dt);
 			}
 		}
+		CP_PROFILE_MARK(space, CP_PROFILE_SOLVER);
 		
 		// Run the constraint post-solve callbacks
 		for(int i=0; i<constraints->num; i++){
@@ -442,4 +936,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			handler->postSolveFunc(arb, space, handler->userData);
 		}
 	} cpSpaceUnlock(space, true);
+	
+	CP_PROFILE_MARK(space, CP_PROFILE_POST_SOLVE);
+	CP_PROFILE_END_STEP(space);
 }
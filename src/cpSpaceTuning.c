@@ -0,0 +1,317 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+// Spatial index tuning times the broadphase over windows of steps.
+// When the dynamic shapes change enough, or every so often anyway, it starts a round of trials that times each candidate index for a window.
+// The fastest one is kept until the next round. In between, a spatial hash is resized if its cells no longer fit the shapes.
+// Candidates that are known to do badly with the current shapes are skipped to avoid long, slow trials.
+
+// Steps timed for each index.
+#define TUNING_WINDOW 60
+// Windows before trying the other indexes again, even if the shapes haven't changed.
+#define TUNING_RETRY 30
+
+enum {
+	// Whatever index the space had when tuning was enabled. It can be kept, but not switched back to.
+	TUNING_CUSTOM,
+	TUNING_BBTREE,
+	TUNING_SPACE_HASH,
+	TUNING_HASH_GRID,
+	TUNING_SWEEP_1D,
+	TUNING_NUM_INDEXES
+};
+
+typedef struct ShapeStats {
+	int count;
+	// 10th percentile, median, 90th percentile and largest shape sizes.
+	cpFloat small, typical, large, max;
+	cpBB bounds;
+} ShapeStats;
+
+typedef struct cpSpatialIndexTuner {
+	int current;
+	
+	// Measurements for the current window.
+	int steps;
+	double time, pairs, overlaps;
+	
+	// Average broadphase time per step for each index in the last round of trials, or negative if it wasn't tried.
+	double cost[TUNING_NUM_INDEXES];
+	bool trialing;
+	int windows;
+	
+	// The shapes when the last round of trials started.
+	ShapeStats stats;
+	
+	// Size of the current spatial hash.
+	cpFloat celldim;
+	int numcells;
+} cpSpatialIndexTuner;
+
+//MARK: Shape Statistics
+
+typedef struct GatherContext {
+	cpFloat *sizes;
+	int count;
+	cpBB bounds;
+} GatherContext;
+
+static void
+GatherShape(cpShape *shape, GatherContext *context)
+{
+	cpBB bb = shape->bb;
+	context->sizes[context->count++] = cpfmax(bb.r - bb.l, bb.t - bb.b);
+	context->bounds = cpBBMerge(context->bounds, bb);
+}
+
+static int
+CompareSizes(const void *a, const void *b)
+{
+	cpFloat x = *(const cpFloat *)a, y = *(const cpFloat *)b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static ShapeStats
+GatherStats(cpSpace *space)
+{
+	ShapeStats stats = {0, 1.0f, 1.0f, 1.0f, 1.0f, {0.0f, 0.0f, 0.0f, 0.0f}};
+	
+	int count = cpSpatialIndexCount(space->dynamicShapes);
+	if(count == 0) return stats;
+	
+	GatherContext context = {(cpFloat *)cpcalloc(count, sizeof(cpFloat)), 0, {INFINITY, INFINITY, -INFINITY, -INFINITY}};
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)GatherShape, &context);
+	qsort(context.sizes, count, sizeof(cpFloat), CompareSizes);
+	
+	// Points and other zero sized shapes still need cells with a positive size.
+	cpFloat max = context.sizes[count - 1];
+	cpFloat minSize = (max > 0.0f ? max*1e-3f : 1.0f);
+	
+	stats.count = count;
+	stats.small = cpfmax(context.sizes[count/10], minSize);
+	stats.typical = cpfmax(context.sizes[count/2], minSize);
+	stats.large = cpfmax(context.sizes[count - 1 - count/10], minSize);
+	stats.max = cpfmax(max, minSize);
+	stats.bounds = context.bounds;
+	
+	cpfree(context.sizes);
+	return stats;
+}
+
+static inline bool
+RatioWithin(cpFloat a, cpFloat b, cpFloat ratio)
+{
+	return (a <= b*ratio && b <= a*ratio);
+}
+
+// Whether the shapes have changed enough that a different index might be faster.
+static bool
+StatsChanged(ShapeStats a, ShapeStats b)
+{
+	return !(
+		RatioWithin((cpFloat)a.count + 16.0f, (cpFloat)b.count + 16.0f, 1.5f) &&
+		RatioWithin(a.typical, b.typical, 2.0f) &&
+		RatioWithin(a.large/a.small, b.large/b.small, 2.0f)
+	);
+}
+
+//MARK: Candidate Indexes
+
+static bool
+CandidateAllowed(int candidate, ShapeStats stats)
+{
+	switch(candidate){
+		// Large shapes get copied into many cells of a spatial hash, so it's only tried when the shapes are similar sizes.
+		case TUNING_SPACE_HASH: return (stats.large <= 4.0f*stats.small);
+		// Sort and sweep only sorts along the x-axis, which works best when the shapes are spread out along it.
+		case TUNING_SWEEP_1D: return (stats.bounds.r - stats.bounds.l >= 4.0f*(stats.bounds.t - stats.bounds.b));
+		case TUNING_CUSTOM: return false;
+		default: return true;
+	}
+}
+
+static int
+HashCells(ShapeStats stats)
+{
+	// About ten times as many cells as shapes is recommended by cpSpaceHashResize().
+	return 10*(stats.count > 100 ? stats.count : 100);
+}
+
+static void
+UseIndex(cpSpace *space, cpSpatialIndexTuner *tuner, int candidate, ShapeStats stats)
+{
+	cpSpatialIndexBBFunc bbfunc = (cpSpatialIndexBBFunc)cpShapeGetSweptBB;
+	cpSpatialIndex *index = NULL;
+	
+	switch(candidate){
+		case TUNING_BBTREE: {
+			index = cpBBTreeNew(bbfunc, NULL);
+			cpBBTreeSetVelocityFunc(index, (cpBBTreeVelocityFunc)cpShapeVelocityFunc);
+			cpBBTreeSetCategoriesFunc(index, (cpBBTreeCategoriesFunc)cpShapeCategoriesFunc);
+		} break;
+		case TUNING_SPACE_HASH: {
+			tuner->celldim = stats.typical;
+			tuner->numcells = HashCells(stats);
+			index = cpSpaceHashNew(tuner->celldim, tuner->numcells, bbfunc, NULL);
+		} break;
+		case TUNING_HASH_GRID: {
+			// Enough levels to hold the largest shape.
+			int levels = 1;
+			for(cpFloat dim = stats.small; dim < stats.max && levels < 24; dim *= 2.0f) levels++;
+			
+			index = cpHashGridNew(stats.small, levels, bbfunc, NULL);
+		} break;
+		case TUNING_SWEEP_1D: {
+			index = cpSweep1DNew(bbfunc, NULL);
+		} break;
+		default: cpAssertHard(false, "Internal Error: Unknown spatial index.");
+	}
+	
+	// The space links the new index to the static index when it moves the shapes over.
+	cpSpaceReplaceDynamicShapes(space, index);
+	tuner->current = candidate;
+}
+
+// Resize a spatial hash if its cells don't fit the shapes anymore.
+// If it's finding a lot of pairs that don't overlap, more cells will cut down on the hash collisions.
+static void
+ResizeHash(cpSpace *space, cpSpatialIndexTuner *tuner, ShapeStats stats)
+{
+	int cells = HashCells(stats);
+	bool falsePositives = (tuner->pairs > 2.0f*tuner->overlaps + TUNING_WINDOW);
+	
+	if(!RatioWithin(tuner->celldim, stats.typical, 2.0f) || !RatioWithin((cpFloat)tuner->numcells, (cpFloat)cells, 4.0f)){
+		tuner->celldim = stats.typical;
+		tuner->numcells = cells;
+	} else if(falsePositives && tuner->numcells < 4*cells){
+		tuner->numcells *= 2;
+	} else {
+		return;
+	}
+	
+	cpSpaceHashResize((cpSpaceHash *)space->dynamicShapes, tuner->celldim, tuner->numcells);
+}
+
+//MARK: Tuning
+
+void
+cpSpaceSampleBroadphase(cpSpace *space, double time)
+{
+	cpSpatialIndexTuner *tuner = space->tuner;
+	
+	int overlaps = 0;
+	for(int i=0; i<space->pairCount; i++){
+		struct cpCollisionPair *pair = space->pairs + i;
+		if(cpBBIntersects(pair->a->bb, pair->b->bb)) overlaps++;
+	}
+	
+	tuner->steps++;
+	tuner->time += time;
+	tuner->pairs += space->pairCount;
+	tuner->overlaps += overlaps;
+}
+
+static void
+StartTrials(cpSpatialIndexTuner *tuner, ShapeStats stats)
+{
+	for(int i=0; i<TUNING_NUM_INDEXES; i++){
+		if(i != tuner->current) tuner->cost[i] = -1.0f;
+	}
+	
+	tuner->trialing = true;
+	tuner->stats = stats;
+}
+
+void
+cpSpaceTuneSpatialIndex(cpSpace *space)
+{
+	cpSpatialIndexTuner *tuner = space->tuner;
+	if(tuner->steps < TUNING_WINDOW) return;
+	
+	tuner->cost[tuner->current] = tuner->time/tuner->steps;
+	ShapeStats stats = GatherStats(space);
+	
+	if(!tuner->trialing){
+		tuner->windows++;
+		
+		if(tuner->windows >= TUNING_RETRY || StatsChanged(tuner->stats, stats)){
+			StartTrials(tuner, stats);
+		} else if(tuner->current == TUNING_SPACE_HASH){
+			ResizeHash(space, tuner, stats);
+		}
+	}
+	
+	if(tuner->trialing){
+		int next = -1;
+		for(int i=0; i<TUNING_NUM_INDEXES; i++){
+			if(tuner->cost[i] < 0.0f && CandidateAllowed(i, tuner->stats)){
+				next = i;
+				break;
+			}
+		}
+		
+		if(next >= 0){
+			UseIndex(space, tuner, next, tuner->stats);
+		} else {
+			int best = tuner->current;
+			for(int i=0; i<TUNING_NUM_INDEXES; i++){
+				bool available = (i != TUNING_CUSTOM && tuner->cost[i] >= 0.0f);
+				if(available && tuner->cost[i] < tuner->cost[best]) best = i;
+			}
+			
+			if(best != tuner->current) UseIndex(space, tuner, best, tuner->stats);
+			
+			tuner->trialing = false;
+			tuner->windows = 0;
+		}
+	}
+	
+	tuner->steps = 0;
+	tuner->time = tuner->pairs = tuner->overlaps = 0.0f;
+}
+
+void
+cpSpaceSetSpatialIndexTuning(cpSpace *space, bool enabled)
+{
+	cpAssertHard(!space->locked, "You cannot change spatial index tuning while the space is locked. Wait until the current query or step is complete.");
+	
+	if(enabled && !space->tuner){
+		cpSpatialIndexTuner *tuner = space->tuner = (cpSpatialIndexTuner *)cpcalloc(1, sizeof(cpSpatialIndexTuner));
+		tuner->current = TUNING_CUSTOM;
+		
+		// Start with a round of trials once the current index has been timed.
+		tuner->stats = GatherStats(space);
+		tuner->windows = TUNING_RETRY;
+	} else if(!enabled && space->tuner){
+		cpfree(space->tuner);
+		space->tuner = NULL;
+	}
+}
+
+bool
+cpSpaceGetSpatialIndexTuning(const cpSpace *space)
+{
+	return (space->tuner != NULL);
+}
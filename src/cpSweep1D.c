@@ -19,19 +19,46 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass *Klass(void);
 
-//MARK: Basic Structures
+// Sort and sweep along the x-axis, pruning the pairs it finds using the y-axis.
+// The bounds are stored in parallel arrays so the sweep can test several of them at once.
+// The sorted order is kept between steps, so it only needs an insertion sort when objects haven't moved much.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SWEEP_SSE2 1
+	#include <emmintrin.h>
+	
+	#if CP_USE_DOUBLES
+		typedef __m128d sweep_float;
+		#define SWEEP_LANES 2
+		#define sweep_load _mm_loadu_pd
+		#define sweep_set1 _mm_set1_pd
+		#define sweep_cmplt _mm_cmplt_pd
+		#define sweep_cmple _mm_cmple_pd
+		#define sweep_and _mm_and_pd
+		#define sweep_movemask _mm_movemask_pd
+	#else
+		typedef __m128 sweep_float;
+		#define SWEEP_LANES 4
+		#define sweep_load _mm_loadu_ps
+		#define sweep_set1 _mm_set1_ps
+		#define sweep_cmplt _mm_cmplt_ps
+		#define sweep_cmple _mm_cmple_ps
+		#define sweep_and _mm_and_ps
+		#define sweep_movemask _mm_movemask_ps
+	#endif
+#endif
 
-typedef struct Bounds {
-	cpFloat min, max;
-} Bounds;
+//MARK: Basic Structures
 
 typedef struct TableCell {
 	void *obj;
-	Bounds bounds;
+	cpBB bb;
 } TableCell;
 
 struct cpSweep1D
@@ -40,26 +67,32 @@ struct cpSweep1D
 	
 	int num;
 	int max;
-	TableCell *table;
+	
+	// The objects and their bounds, sorted by minX after each reindex.
+	void **objs;
+	cpFloat *minX, *maxX, *minY, *maxY;
 };
 
 static inline bool
-BoundsOverlap(Bounds a, Bounds b)
+CellOverlaps(cpSweep1D *sweep, int i, cpBB bb)
 {
-	return (a.min <= b.max && b.min <= a.max);
+	return (sweep->minX[i] <= bb.r && bb.l <= sweep->maxX[i] && sweep->minY[i] <= bb.t && bb.b <= sweep->maxY[i]);
 }
 
-static inline Bounds
-BBToBounds(cpSweep1D *sweep, cpBB bb)
+static inline void
+SetCell(cpSweep1D *sweep, int i, void *obj, cpBB bb)
 {
-	Bounds bounds = {bb.l, bb.r};
-	return bounds;
+	sweep->objs[i] = obj;
+	sweep->minX[i] = bb.l;
+	sweep->maxX[i] = bb.r;
+	sweep->minY[i] = bb.b;
+	sweep->maxY[i] = bb.t;
 }
 
 static inline TableCell
-MakeTableCell(cpSweep1D *sweep, void *obj)
+GetCell(cpSweep1D *sweep, int i)
 {
-	TableCell cell = {obj, BBToBounds(sweep, sweep->spatialIndex.bbfunc(obj))};
+	TableCell cell = {sweep->objs[i], cpBBNew(sweep->minX[i], sweep->minY[i], sweep->maxX[i], sweep->maxY[i])};
 	return cell;
 }
 
@@ -75,7 +108,11 @@ static void
 ResizeTable(cpSweep1D *sweep, int size)
 {
 	sweep->max = size;
-	sweep->table = (TableCell *)cprealloc(sweep->table, size*sizeof(TableCell));
+	sweep->objs = (void **)cprealloc(sweep->objs, size*sizeof(void *));
+	sweep->minX = (cpFloat *)cprealloc(sweep->minX, size*sizeof(cpFloat));
+	sweep->maxX = (cpFloat *)cprealloc(sweep->maxX, size*sizeof(cpFloat));
+	sweep->minY = (cpFloat *)cprealloc(sweep->minY, size*sizeof(cpFloat));
+	sweep->maxY = (cpFloat *)cprealloc(sweep->maxY, size*sizeof(cpFloat));
 }
 
 cpSpatialIndex *
@@ -98,8 +135,12 @@ cpSweep1DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
 static void
 cpSweep1DDestroy(cpSweep1D *sweep)
 {
-	cpfree(sweep->table);
-	sweep->table = NULL;
+	cpfree(sweep->objs);
+	cpfree(sweep->minX);
+	cpfree(sweep->maxX);
+	cpfree(sweep->minY);
+	cpfree(sweep->maxY);
+	sweep->objs = NULL;
 }
 
 //MARK: Misc
@@ -113,19 +154,25 @@ cpSweep1DCount(cpSweep1D *sweep)
 static void
 cpSweep1DEach(cpSweep1D *sweep, cpSpatialIndexIteratorFunc func, void *data)
 {
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++) func(table[i].obj, data);
+	void **objs = sweep->objs;
+	for(int i=0, count=sweep->num; i<count; i++) func(objs[i], data);
 }
 
 static int
-cpSweep1DContains(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+FindCell(cpSweep1D *sweep, void *obj)
 {
-	TableCell *table = sweep->table;
+	void **objs = sweep->objs;
 	for(int i=0, count=sweep->num; i<count; i++){
-		if(table[i].obj == obj) return true;
+		if(objs[i] == obj) return i;
 	}
 	
-	return false;
+	return -1;
+}
+
+static int
+cpSweep1DContains(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	return (FindCell(sweep, obj) >= 0);
 }
 
 //MARK: Basic Operations
@@ -135,24 +182,23 @@ cpSweep1DInsert(cpSweep1D *sweep, void *obj, cpHashValue hashid)
 {
 	if(sweep->num == sweep->max) ResizeTable(sweep, sweep->max*2);
 	
-	sweep->table[sweep->num] = MakeTableCell(sweep, obj);
+	SetCell(sweep, sweep->num, obj, sweep->spatialIndex.bbfunc(obj));
 	sweep->num++;
 }
 
 static void
 cpSweep1DRemove(cpSweep1D *sweep, void *obj, cpHashValue hashid)
 {
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++){
-		if(table[i].obj == obj){
-			int num = --sweep->num;
-			
-			table[i] = table[num];
-			table[num].obj = NULL;
-			
-			return;
-		}
-	}
+	int i = FindCell(sweep, obj);
+	if(i < 0) return;
+	
+	// Shift the rest of the table down to keep it sorted.
+	int tail = --sweep->num - i;
+	memmove(sweep->objs + i, sweep->objs + i + 1, tail*sizeof(void *));
+	memmove(sweep->minX + i, sweep->minX + i + 1, tail*sizeof(cpFloat));
+	memmove(sweep->maxX + i, sweep->maxX + i + 1, tail*sizeof(cpFloat));
+	memmove(sweep->minY + i, sweep->minY + i + 1, tail*sizeof(cpFloat));
+	memmove(sweep->maxY + i, sweep->maxY + i + 1, tail*sizeof(cpFloat));
 }
 
 //MARK: Reindexing Functions
@@ -178,12 +224,9 @@ cpSweep1DQuery(cpSweep1D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc fun
 	// Implementing binary search here would allow you to find an upper limit
 	// but not a lower limit. Probably not worth the hassle.
 	
-	Bounds bounds = BBToBounds(sweep, bb);
-	
-	TableCell *table = sweep->table;
+	void **objs = sweep->objs;
 	for(int i=0, count=sweep->num; i<count; i++){
-		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds) && obj != cell.obj) func(obj, cell.obj, 0, data);
+		if(CellOverlaps(sweep, i, bb) && obj != objs[i]) func(obj, objs[i], 0, data);
 	}
 }
 
@@ -191,12 +234,10 @@ static void
 cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	cpBB bb = cpBBExpand(cpBBNew(a.x, a.y, a.x, a.y), b);
-	Bounds bounds = BBToBounds(sweep, bb);
 	
-	TableCell *table = sweep->table;
+	void **objs = sweep->objs;
 	for(int i=0, count=sweep->num; i<count; i++){
-		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds)) func(obj, cell.obj, data);
+		if(CellOverlaps(sweep, i, bb)) func(obj, objs[i], data);
 	}
 }
 
@@ -205,26 +246,94 @@ cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t
 static int
 TableSort(TableCell *a, TableCell *b)
 {
-	return (a->bounds.min < b->bounds.min ? -1 : (a->bounds.min > b->bounds.min ? 1 : 0));
+	return (a->bb.l < b->bb.l ? -1 : (a->bb.l > b->bb.l ? 1 : 0));
+}
+
+static void
+QuickSortTable(cpSweep1D *sweep)
+{
+	int count = sweep->num;
+	TableCell *table = (TableCell *)cpcalloc(count, sizeof(TableCell));
+	
+	for(int i=0; i<count; i++) table[i] = GetCell(sweep, i);
+	qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort);
+	for(int i=0; i<count; i++) SetCell(sweep, i, table[i].obj, table[i].bb);
+	
+	cpfree(table);
+}
+
+// The table is usually nearly sorted from the last step, which makes insertion sort very fast.
+// If it turns out not to be, give up and use qsort() instead.
+static void
+SortTable(cpSweep1D *sweep)
+{
+	int count = sweep->num, moves = 0, maxMoves = 4*count;
+	cpFloat *minX = sweep->minX;
+	
+	for(int i=1; i<count; i++){
+		cpFloat key = minX[i];
+		if(minX[i - 1] <= key) continue;
+		
+		TableCell cell = GetCell(sweep, i);
+		int j = i;
+		
+		for(; j > 0 && minX[j - 1] > key; j--){
+			TableCell prev = GetCell(sweep, j - 1);
+			SetCell(sweep, j, prev.obj, prev.bb);
+		}
+		
+		SetCell(sweep, j, cell.obj, cell.bb);
+		
+		moves += i - j;
+		if(moves > maxMoves){
+			QuickSortTable(sweep);
+			return;
+		}
+	}
 }
 
 static void
 cpSweep1DReindexQuery(cpSweep1D *sweep, cpSpatialIndexQueryFunc func, void *data)
 {
-	TableCell *table = sweep->table;
 	int count = sweep->num;
+	void **objs = sweep->objs;
+	cpFloat *minX = sweep->minX, *maxX = sweep->maxX, *minY = sweep->minY, *maxY = sweep->maxY;
 	
 	// Update bounds and sort
-	for(int i=0; i<count; i++) table[i] = MakeTableCell(sweep, table[i].obj);
-	qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort); // TODO: use insertion sort instead
+	cpSpatialIndexBBFunc bbfunc = sweep->spatialIndex.bbfunc;
+	for(int i=0; i<count; i++) SetCell(sweep, i, objs[i], bbfunc(objs[i]));
+	SortTable(sweep);
 	
 	for(int i=0; i<count; i++){
-		TableCell cell = table[i];
-		cpFloat max = cell.bounds.max;
+		void *obj = objs[i];
+		cpFloat max = maxX[i], b = minY[i], t = maxY[i];
+		int j = i + 1;
+		
+#if SWEEP_SSE2
+		// Test several cells at a time, stopping at the first batch that passes the end of the x bounds.
+		sweep_float v_max = sweep_set1(max), v_b = sweep_set1(b), v_t = sweep_set1(t);
+		int full = (1<<SWEEP_LANES) - 1;
 		
-		for(int j=i+1; table[j].bounds.min < max && j<count; j++){
-			func(cell.obj, table[j].obj, 0, data);
+		for(; j + SWEEP_LANES <= count; j += SWEEP_LANES){
+			sweep_float x = sweep_cmplt(sweep_load(minX + j), v_max);
+			sweep_float y = sweep_and(sweep_cmple(sweep_load(minY + j), v_t), sweep_cmple(v_b, sweep_load(maxY + j)));
+			int xmask = sweep_movemask(x);
+			
+			for(int mask = sweep_movemask(sweep_and(x, y)), k = 0; mask; mask >>= 1, k++){
+				if(mask&1) func(obj, objs[j + k], 0, data);
+			}
+			
+			if(xmask != full) goto next;
+		}
+#endif
+		
+		for(; j<count && minX[j] < max; j++){
+			if(minY[j] <= t && b <= maxY[j]) func(obj, objs[j], 0, data);
 		}
+		
+#if SWEEP_SSE2
+		next:;
+#endif
 	}
 	
 	// Reindex query is also responsible for colliding against the static index.
@@ -251,4 +360,3 @@ static cpSpatialIndexClass klass = {
 };
 
 static inline cpSpatialIndexClass *Klass(void){return &klass;}
-
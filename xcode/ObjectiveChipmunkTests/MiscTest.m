@@ -22,6 +22,7 @@
 #import <XCTest/XCTest.h>
 #import "ObjectiveChipmunk/ObjectiveChipmunk.h"
 #import "ObjectiveChipmunk/ChipmunkAutoGeometry.h"
+#import "chipmunk/chipmunk_private.h"
 
 
 @interface MiscTest : XCTestCase {}
@@ -331,6 +332,80 @@
 	XCTAssertEqualWithAccuracy(area5, area6, 1e-3, @"");
 }
 
+//MARK: cpHashSet
+
+#define HASH_SET_FUZZ_KEYS 1024
+
+static int HashSetKeyEql(const void *ptr, const void *elt){return *(const int *)ptr == *(const int *)elt;}
+static void *HashSetKeyTrans(const void *ptr, void *keys){return (int *)keys + *(const int *)ptr;}
+static void HashSetKeyVisit(void *elt, void *visits){((int *)visits)[*(int *)elt]++;}
+
+// Removes the keys where key%params[0] == params[1].
+static bool HashSetKeyFilter(void *elt, void *params){return *(int *)elt%((int *)params)[0] != ((int *)params)[1];}
+
+// Compare a cpHashSet against an array of flags under random inserts, removes, finds and filters.
+// Keys share a hash in runs of 2^shift. The keys come from a window that slides along, so the old runs of colliding keys
+// get removed and leave tombstones behind that the new ones never probe over. That forces the table to be rebuilt in place.
+-(void)fuzzHashSetWithHashShift:(int)shift
+{
+	int keys[HASH_SET_FUZZ_KEYS];
+	bool present[HASH_SET_FUZZ_KEYS] = {};
+	int count = 0;
+	for(int i=0; i<HASH_SET_FUZZ_KEYS; i++) keys[i] = i;
+	
+	cpHashSet *set = cpHashSetNew(0, HashSetKeyEql);
+	int missing = -1;
+	cpHashSetSetDefaultValue(set, &missing);
+	
+	srand(5318008);
+	for(int op=0; op<100000; op++){
+		int key = (op/16 + rand()%128)%HASH_SET_FUZZ_KEYS;
+		cpHashValue hash = (cpHashValue)key >> shift;
+		
+		bool growing = ((op/4096)%2 == 0);
+		int r = rand()%16;
+		
+		if(r < (growing ? 8 : 4)){
+			XCTAssertEqual(cpHashSetInsert(set, hash, &key, HashSetKeyTrans, keys), (const void *)(keys + key));
+			if(!present[key]){present[key] = true; count++;}
+		} else if(r < 12){
+			XCTAssertEqual(cpHashSetRemove(set, hash, &key), (const void *)(present[key] ? keys + key : NULL));
+			if(present[key]){present[key] = false; count--;}
+		} else if(r < 15){
+			XCTAssertEqual(cpHashSetFind(set, hash, &key), (const void *)(present[key] ? keys + key : &missing));
+		} else if(rand()%32 == 0){
+			int params[2] = {2 + rand()%6, 0};
+			params[1] = rand()%params[0];
+			cpHashSetFilter(set, HashSetKeyFilter, params);
+			
+			for(int i=0; i<HASH_SET_FUZZ_KEYS; i++){
+				if(present[i] && i%params[0] == params[1]){present[i] = false; count--;}
+			}
+		}
+		
+		XCTAssertEqual(cpHashSetCount(set), count);
+		
+		if(op%1000 == 0){
+			int visits[HASH_SET_FUZZ_KEYS] = {};
+			cpHashSetEach(set, HashSetKeyVisit, visits);
+			
+			for(int i=0; i<HASH_SET_FUZZ_KEYS; i++){
+				XCTAssertEqual(visits[i], present[i] ? 1 : 0, @"key %d", i);
+				XCTAssertEqual(cpHashSetFind(set, (cpHashValue)i >> shift, &i), (const void *)(present[i] ? keys + i : &missing), @"key %d", i);
+			}
+		}
+	}
+	
+	cpHashSetFree(set);
+}
+
+-(void)testHashSetFuzz
+{
+	// Unique hashes.
+	[self fuzzHashSetWithHashShift:0];
+	// 32 keys per hash, so nearly every probe has to step over elements with the same tag.
+	[self fuzzHashSetWithHashShift:5];
+}
 
 
 @end
@@ -22,6 +22,7 @@
 #import <XCTest/XCTest.h>
 
 #import "ObjectiveChipmunk/ObjectiveChipmunk.h"
+#import "chipmunk/cpHastySpace.h"
 
 @interface SpaceTest : XCTestCase {}
 @end
@@ -417,6 +418,172 @@ VerifyContactGraph(id self, ChipmunkBody *body1, ChipmunkBody *body2)
 	
 	[space release];
 }
+
+static cpSpace *
+HastyPyramid(bool vectorized, bool packed, unsigned long threads, cpBody **bodies, int count)
+{
+	cpSpace *space = cpHastySpaceNew();
+	cpHastySpaceSetVectorized(space, vectorized);
+	cpHastySpaceSetPackedSolver(space, packed);
+	cpHastySpaceSetThreads(space, threads);
+	cpSpaceSetGravity(space, cpv(0, -100));
+	
+	cpShape *ground = cpSpaceAddShape(space, cpSegmentShapeNew(cpSpaceGetStaticBody(space), cpv(-500, 0), cpv(500, 0), 0));
+	cpShapeSetFriction(ground, 1);
+	
+	int rows = 0;
+	while(rows*(rows + 1)/2 < count) rows++;
+	
+	for(int i=0; i<count; i++){
+		int row = 0, index = i;
+		while(index > row){index -= row + 1; row++;}
+		
+		cpBody *body = bodies[i] = cpSpaceAddBody(space, cpBodyNew(1, cpMomentForBox(1, 10, 10)));
+		cpBodySetPosition(body, cpv(index*11 - row*5.5, 14 + (rows - 1 - row)*11));
+		
+		cpShape *shape = cpSpaceAddShape(space, (i%3 ? cpBoxShapeNew(body, 10, 10, 0) : cpCircleShapeNew(body, 5, cpvzero)));
+		cpShapeSetFriction(shape, 0.8);
+		cpShapeSetElasticity(shape, 0.2);
+	}
+	
+	return space;
+}
+
+static void
+ShapeFreeWrap(cpSpace *space, cpShape *shape, void *unused)
+{
+	cpSpaceRemoveShape(space, shape);
+	cpShapeFree(shape);
+}
+
+static void
+PostShapeFree(cpShape *shape, cpSpace *space)
+{
+	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)ShapeFreeWrap, shape, NULL);
+}
+
+static void
+BodyFreeWrap(cpSpace *space, cpBody *body, void *unused)
+{
+	cpSpaceRemoveBody(space, body);
+	cpBodyFree(body);
+}
+
+static void
+PostBodyFree(cpBody *body, cpSpace *space)
+{
+	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)BodyFreeWrap, body, NULL);
+}
+
+// Remove and free the bodies and shapes before freeing the space itself.
+static void
+FreeHastySpace(cpSpace *space)
+{
+	cpSpaceEachShape(space, (cpSpaceShapeIteratorFunc)PostShapeFree, space);
+	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)PostBodyFree, space);
+	
+	cpHastySpaceFree(space);
+}
+
+static void
+SumImpulses(cpBody *body, cpArbiter *arb, cpVect *sum)
+{
+	*sum = cpvadd(*sum, cpArbiterTotalImpulse(arb));
+}
+
+// The SIMD contact solvers must give exactly the same impulses as the scalar solver.
+-(void)testHastyVectorizedSolver
+{
+	for(int packed=0; packed<2; packed++){
+		cpBody *scalarBodies[28], *simdBodies[28];
+		cpSpace *scalar = HastyPyramid(false, packed, 1, scalarBodies, 28);
+		cpSpace *simd = HastyPyramid(true, packed, 1, simdBodies, 28);
+		
+		for(int step=0; step<200; step++){
+			cpHastySpaceStep(scalar, 1.0/60.0);
+			cpHastySpaceStep(simd, 1.0/60.0);
+			
+			for(int i=0; i<28; i++){
+				cpVect scalarImpulse = cpvzero, simdImpulse = cpvzero;
+				cpBodyEachArbiter(scalarBodies[i], (cpBodyArbiterIteratorFunc)SumImpulses, &scalarImpulse);
+				cpBodyEachArbiter(simdBodies[i], (cpBodyArbiterIteratorFunc)SumImpulses, &simdImpulse);
+				XCTAssertTrue(cpveql(scalarImpulse, simdImpulse), @"");
+				
+				XCTAssertTrue(cpveql(cpBodyGetVelocity(scalarBodies[i]), cpBodyGetVelocity(simdBodies[i])), @"");
+				XCTAssertEqual(cpBodyGetAngularVelocity(scalarBodies[i]), cpBodyGetAngularVelocity(simdBodies[i]), @"");
+			}
+		}
+		
+		FreeHastySpace(scalar);
+		FreeHastySpace(simd);
+	}
+}
+
+// Splitting the solver up between threads must not change the results either.
+// The pyramid is large enough to be graph colored, so the workers share the static body within each color.
+-(void)testHastyThreadedSolver
+{
+	for(int packed=0; packed<2; packed++){
+		cpBody *serialBodies[300], *threadedBodies[300];
+		cpSpace *serial = HastyPyramid(false, packed, 1, serialBodies, 300);
+		cpSpace *threaded = HastyPyramid(true, packed, 4, threadedBodies, 300);
+		
+		for(int step=0; step<100; step++){
+			cpHastySpaceStep(serial, 1.0/60.0);
+			cpHastySpaceStep(threaded, 1.0/60.0);
+			
+			for(int i=0; i<300; i++){
+				XCTAssertTrue(cpveql(cpBodyGetVelocity(serialBodies[i]), cpBodyGetVelocity(threadedBodies[i])), @"");
+				XCTAssertEqual(cpBodyGetAngularVelocity(serialBodies[i]), cpBodyGetAngularVelocity(threadedBodies[i]), @"");
+			}
+		}
+		
+		FreeHastySpace(serial);
+		FreeHastySpace(threaded);
+	}
+}
+
+// Stepping again after restoring a snapshot must give exactly the same results.
+-(void)testSnapshotRestore
+{
+	cpBody *bodies[28];
+	cpSpace *space = HastyPyramid(true, false, 1, bodies, 28);
+	cpSpaceSetSleepTimeThreshold(space, 0.5);
+	
+	for(int step=0; step<30; step++) cpHastySpaceStep(space, 1.0/60.0);
+	
+	size_t size = cpSpaceSnapshot(space, NULL, 0);
+	void *snapshot = malloc(size);
+	XCTAssertEqual(cpSpaceSnapshot(space, snapshot, size), size, @"");
+	
+	cpVect positions[28], velocities[28];
+	for(int step=0; step<300; step++) cpHastySpaceStep(space, 1.0/60.0);
+	for(int i=0; i<28; i++){
+		positions[i] = cpBodyGetPosition(bodies[i]);
+		velocities[i] = cpBodyGetVelocity(bodies[i]);
+	}
+	
+	for(int rollback=0; rollback<2; rollback++){
+		XCTAssertTrue(cpSpaceRestore(space, snapshot, size), @"");
+		for(int step=0; step<300; step++) cpHastySpaceStep(space, 1.0/60.0);
+		
+		for(int i=0; i<28; i++){
+			XCTAssertTrue(cpveql(cpBodyGetPosition(bodies[i]), positions[i]), @"");
+			XCTAssertTrue(cpveql(cpBodyGetVelocity(bodies[i]), velocities[i]), @"");
+		}
+	}
+	
+	// Snapshots can't be restored once objects are added or removed.
+	cpBody *body = cpSpaceAddBody(space, cpBodyNew(1, 1));
+	XCTAssertFalse(cpSpaceRestore(space, snapshot, size), @"");
+	
+	cpSpaceRemoveBody(space, body);
+	cpBodyFree(body);
+	free(snapshot);
+	
+	FreeHastySpace(space);
+}
+
 // TODO more sleeping tests
 
 @end
@@ -0,0 +1,213 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#import <XCTest/XCTest.h>
+#import "ObjectiveChipmunk/ObjectiveChipmunk.h"
+#import "chipmunk/chipmunk_private.h"
+
+// Checks the spatial indexes against brute force while objects are added, moved and removed.
+// Queries are allowed to return extra objects since the indexes can keep loose bounds, but never duplicates.
+
+@interface SpatialIndexTest : XCTestCase {}
+@end
+
+@implementation SpatialIndexTest
+
+#define OBJECT_COUNT 400
+
+typedef struct TestObject {
+	cpBB bb;
+	bool added;
+} TestObject;
+
+typedef struct TestContext {
+	TestObject *objects;
+	int *counts;
+} TestContext;
+
+static cpBB TestObjectBB(TestObject *obj){return obj->bb;}
+
+static cpFloat
+RandomFloat(cpFloat min, cpFloat max)
+{
+	return cpflerp(min, max, (cpFloat)rand()/(cpFloat)RAND_MAX);
+}
+
+// Mostly small boxes with a few large ones, spread over a 1000x1000 area.
+static cpBB
+RandomBB(void)
+{
+	cpFloat size = (rand()%10 ? RandomFloat(1.0, 10.0) : RandomFloat(50.0, 300.0));
+	cpVect center = cpv(RandomFloat(0.0, 1000.0), RandomFloat(0.0, 1000.0));
+	return cpBBNewForExtents(center, RandomFloat(0.2, 1.0)*size, RandomFloat(0.2, 1.0)*size);
+}
+
+static void
+CountEach(TestObject *obj, TestContext *context)
+{
+	context->counts[obj - context->objects]++;
+}
+
+static cpCollisionID
+CountQuery(void *unused, TestObject *obj, cpCollisionID id, TestContext *context)
+{
+	context->counts[obj - context->objects]++;
+	return id;
+}
+
+static cpFloat
+CountSegmentQuery(void *unused, TestObject *obj, TestContext *context)
+{
+	context->counts[obj - context->objects]++;
+	return 1.0f;
+}
+
+static cpCollisionID
+CountPair(TestObject *a, TestObject *b, cpCollisionID id, TestContext *context)
+{
+	int i = (int)(a - context->objects), j = (int)(b - context->objects);
+	if(i > j){int tmp = i; i = j; j = tmp;}
+	
+	context->counts[i*OBJECT_COUNT + j]++;
+	return id;
+}
+
+-(void)checkCounts:(int *)counts objects:(TestObject *)objects expected:(bool *)expected
+{
+	for(int i=0; i<OBJECT_COUNT; i++){
+		if(expected[i]){
+			XCTAssertEqual(counts[i], 1, @"object %d", i);
+		} else {
+			XCTAssertTrue(counts[i] == 0 || (counts[i] == 1 && objects[i].added), @"object %d", i);
+		}
+	}
+}
+
+-(void)checkIndex:(cpSpatialIndex *)index objects:(TestObject *)objects
+{
+	int counts[OBJECT_COUNT];
+	bool expected[OBJECT_COUNT];
+	TestContext context = {objects, counts};
+	
+	int count = 0;
+	for(int i=0; i<OBJECT_COUNT; i++){
+		if(objects[i].added) count++;
+		XCTAssertEqual((bool)cpSpatialIndexContains(index, objects + i, i), objects[i].added, @"object %d", i);
+	}
+	XCTAssertEqual(cpSpatialIndexCount(index), count);
+	
+	for(int i=0; i<OBJECT_COUNT; i++) expected[i] = objects[i].added;
+	memset(counts, 0, sizeof(counts));
+	cpSpatialIndexEach(index, (cpSpatialIndexIteratorFunc)CountEach, &context);
+	[self checkCounts:counts objects:objects expected:expected];
+	
+	for(int n=0; n<20; n++){
+		cpBB bb = RandomBB();
+		for(int i=0; i<OBJECT_COUNT; i++) expected[i] = objects[i].added && cpBBIntersects(objects[i].bb, bb);
+		
+		memset(counts, 0, sizeof(counts));
+		cpSpatialIndexQuery(index, NULL, bb, (cpSpatialIndexQueryFunc)CountQuery, &context);
+		[self checkCounts:counts objects:objects expected:expected];
+	}
+	
+	for(int n=0; n<20; n++){
+		cpVect a = cpv(RandomFloat(-100.0, 1100.0), RandomFloat(-100.0, 1100.0));
+		cpVect b = cpv(RandomFloat(-100.0, 1100.0), RandomFloat(-100.0, 1100.0));
+		for(int i=0; i<OBJECT_COUNT; i++) expected[i] = objects[i].added && cpBBSegmentQuery(objects[i].bb, a, b) < 1.0f;
+		
+		memset(counts, 0, sizeof(counts));
+		cpSpatialIndexSegmentQuery(index, NULL, a, b, 1.0f, (cpSpatialIndexSegmentQueryFunc)CountSegmentQuery, &context);
+		[self checkCounts:counts objects:objects expected:expected];
+	}
+}
+
+-(void)checkReindexQuery:(cpSpatialIndex *)index objects:(TestObject *)objects
+{
+	int *counts = (int *)calloc(OBJECT_COUNT*OBJECT_COUNT, sizeof(int));
+	TestContext context = {objects, counts};
+	cpSpatialIndexReindexQuery(index, (cpSpatialIndexQueryFunc)CountPair, &context);
+	
+	for(int i=0; i<OBJECT_COUNT; i++){
+		XCTAssertEqual(counts[i*OBJECT_COUNT + i], 0, @"object %d collided with itself", i);
+		
+		for(int j=i+1; j<OBJECT_COUNT; j++){
+			int count = counts[i*OBJECT_COUNT + j];
+			if(objects[i].added && objects[j].added && cpBBIntersects(objects[i].bb, objects[j].bb)){
+				XCTAssertEqual(count, 1, @"pair %d, %d", i, j);
+			} else {
+				XCTAssertTrue(count == 0 || (count == 1 && objects[i].added && objects[j].added), @"pair %d, %d", i, j);
+			}
+		}
+	}
+	
+	free(counts);
+}
+
+// Add, move and remove a few objects at a time, checking the index after each batch.
+// The batches are small enough that several of them fit between rebuilds of indexes that keep their changes on the side.
+-(void)churnIndex:(cpSpatialIndex *)index
+{
+	TestObject objects[OBJECT_COUNT] = {};
+	srand(5318008);
+	
+	for(int round=0; round<200; round++){
+		for(int i=0; i<OBJECT_COUNT; i++){
+			TestObject *obj = objects + i;
+			int r = rand()%100;
+			
+			if(!obj->added){
+				if(r < (round < 20 ? 20 : 3)){
+					obj->bb = RandomBB();
+					obj->added = true;
+					cpSpatialIndexInsert(index, obj, i);
+				}
+			} else if(r < 2){
+				obj->added = false;
+				cpSpatialIndexRemove(index, obj, i);
+			} else if(r < 4){
+				// Nudge it, which can leave it inside its old bounds.
+				obj->bb = cpBBOffset(obj->bb, cpv(RandomFloat(-2.0, 2.0), RandomFloat(-2.0, 2.0)));
+				cpSpatialIndexReindexObject(index, obj, i);
+			} else if(r < 5){
+				obj->bb = RandomBB();
+				cpSpatialIndexReindexObject(index, obj, i);
+			}
+		}
+		
+		[self checkIndex:index objects:objects];
+		if(round%10 == 9) [self checkReindexQuery:index objects:objects];
+	}
+	
+	cpSpatialIndexFree(index);
+}
+
+-(void)testQBVH
+{
+	[self churnIndex:cpQBVHNew((cpSpatialIndexBBFunc)TestObjectBB, NULL)];
+}
+
+-(void)testHashGrid
+{
+	// Cells from 8 to 256 units, so the largest objects are bigger than the top level's cells.
+	[self churnIndex:cpHashGridNew(8.0f, 6, (cpSpatialIndexBBFunc)TestObjectBB, NULL)];
+}
+
+@end